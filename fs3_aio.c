@@ -0,0 +1,317 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_aio.c
+//  Description    : This is the implementation of asynchronous FS3 file
+//                   I/O.  Submitted requests wait on a single FIFO; each
+//                   dispatcher thread takes the oldest request whose file
+//                   handle is not already being worked on, so a handle's
+//                   requests keep their order while different handles
+//                   proceed in parallel.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_aio.h>
+
+//
+// Support Macros/Data
+
+// Where a request is
+#define AIO_IDLE    0                   // not submitted, or completed and reaped
+#define AIO_QUEUED  1                   // waiting for a dispatcher
+#define AIO_RUNNING 2                   // being carried out
+#define AIO_DONE    3                   // on the completion queue
+
+#define AIO_HANDLES (1 << 16)           // every int16_t handle value
+
+pthread_mutex_t aioLock = PTHREAD_MUTEX_INITIALIZER;   // the queues and the busy map
+pthread_cond_t aioWork = PTHREAD_COND_INITIALIZER;     // a request can be taken, or stop
+pthread_cond_t aioDone = PTHREAD_COND_INITIALIZER;     // a request completed
+pthread_t aioThreads[FS3_AIO_MAX_DISPATCHERS];
+int aioThreadCount = 0;                 // dispatchers running
+int aioThreadsWanted = FS3_AIO_DEFAULT_DISPATCHERS;    // dispatchers for the next start
+int aioRunning = 0;                     // submissions are accepted
+FS3IoHandler aioHandler;                // carries out a request
+FS3IoRequest *aioHead, *aioTail;        // submitted, oldest first
+FS3IoRequest *aioDoneHead, *aioDoneTail;    // completed, waiting to be reaped
+int aioOutstanding = 0;                 // submitted for reaping and not yet reaped
+uint8_t aioBusy[AIO_HANDLES];           // set while a request on the handle runs
+static __thread int aioDispatcher;      // 1 + the thread's number in dispatchers, else 0
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_aio_take
+// Description  : Unlink the oldest queued request whose handle is idle,
+//                called with aioLock held
+//
+// Inputs       : none
+// Outputs      : the request, NULL if none can run now
+
+static FS3IoRequest *fs3_aio_take(void) {
+    FS3IoRequest *req, *prev = NULL;
+
+    for (req = aioHead; req != NULL; prev = req, req = req->next) {
+        if (!aioBusy[(uint16_t)req->fd]) {
+            if (prev == NULL) {
+                aioHead = req->next;
+            } else {
+                prev->next = req->next;
+            }
+            if (aioTail == req) {
+                aioTail = prev;
+            }
+            req->next = NULL;
+            return(req);
+        }
+    }
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_aio_run
+// Description  : Carry out a request taken off the queue and complete it,
+//                called with aioLock held (dropped while the request runs
+//                and while its callback does)
+//
+// Inputs       : req - the request
+// Outputs      : none
+
+static void fs3_aio_run(FS3IoRequest *req) {
+    uint16_t handle = (uint16_t)req->fd;
+    int32_t result;
+
+    aioBusy[handle] = 1;
+    req->state = AIO_RUNNING;
+    pthread_mutex_unlock(&aioLock);
+    result = aioHandler(req);
+    pthread_mutex_lock(&aioLock);
+
+    // The handle's next request may now run, even alongside the callback
+    aioBusy[handle] = 0;
+    req->result = result;
+    pthread_cond_broadcast(&aioWork);
+    if ((req->callback != NULL) && !req->waited) {
+        req->state = AIO_IDLE;              // the callback may submit it again
+        pthread_mutex_unlock(&aioLock);
+        req->callback(req);
+        pthread_mutex_lock(&aioLock);
+        return;
+    }
+    req->state = AIO_DONE;
+    if (!req->waited) {
+        if (aioDoneTail == NULL) {
+            aioDoneHead = req;
+        } else {
+            aioDoneTail->next = req;
+        }
+        aioDoneTail = req;
+    }
+    pthread_cond_broadcast(&aioDone);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_aio_dispatch
+// Description  : Dispatcher thread, carries out requests until the queue
+//                is stopped and empty
+//
+// Inputs       : arg - the dispatcher's number, cast to a pointer
+// Outputs      : NULL
+
+static void *fs3_aio_dispatch(void *arg) {
+    FS3IoRequest *req;
+
+    aioDispatcher = (int)(intptr_t)arg + 1;
+    pthread_mutex_lock(&aioLock);
+    while (aioRunning || (aioHead != NULL)) {
+        if ((req = fs3_aio_take()) == NULL) {
+            pthread_cond_wait(&aioWork, &aioLock);
+            continue;
+        }
+        fs3_aio_run(req);
+    }
+    pthread_mutex_unlock(&aioLock);
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_io_dispatchers
+// Description  : Select the number of dispatcher threads for the next start
+//
+// Inputs       : threads - 1 to FS3_AIO_MAX_DISPATCHERS
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_io_dispatchers(int threads) {
+    if ((threads < 1) || (threads > FS3_AIO_MAX_DISPATCHERS)) {
+        return(-1);
+    }
+    aioThreadsWanted = threads;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_aio_start
+// Description  : Start the dispatcher threads
+//
+// Inputs       : handler - carries out a request
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_aio_start(FS3IoHandler handler) {
+    if ((handler == NULL) || aioRunning) {
+        return(-1);
+    }
+    pthread_mutex_lock(&aioLock);
+    aioHandler = handler;
+    aioRunning = 1;
+    pthread_mutex_unlock(&aioLock);
+    for (aioThreadCount = 0; aioThreadCount < aioThreadsWanted; aioThreadCount++) {
+        if (pthread_create(&aioThreads[aioThreadCount], NULL, fs3_aio_dispatch, (void *)(intptr_t)aioThreadCount) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Failed starting I/O dispatcher %d", aioThreadCount);
+            fs3_aio_stop();
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_aio_stop
+// Description  : Stop taking submissions, let the dispatchers run what is
+//                queued and wait for them to exit
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_aio_stop(void) {
+    pthread_mutex_lock(&aioLock);
+    if (!aioRunning) {
+        pthread_mutex_unlock(&aioLock);
+        return(-1);
+    }
+    aioRunning = 0;
+    pthread_cond_broadcast(&aioWork);
+    pthread_mutex_unlock(&aioLock);
+    for (int i = 0; i < aioThreadCount; i++) {
+        pthread_join(aioThreads[i], NULL);
+    }
+    aioThreadCount = 0;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_submit
+// Description  : Queue a request for a dispatcher thread
+//
+// Inputs       : req - the request, left alone until it completes
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_submit(FS3IoRequest *req) {
+    if ((req == NULL) || (req->op < FS3_IO_READ) || (req->op > FS3_IO_WRITEV)) {
+        return(-1);
+    }
+    pthread_mutex_lock(&aioLock);
+    if (!aioRunning || (req->state != AIO_IDLE)) {
+        pthread_mutex_unlock(&aioLock);
+        return(-1);
+    }
+    req->next = NULL;
+    req->state = AIO_QUEUED;
+    req->result = -1;
+    if ((req->callback == NULL) && !req->waited) {
+        aioOutstanding++;
+    }
+    if (aioTail == NULL) {
+        aioHead = req;
+    } else {
+        aioTail->next = req;
+    }
+    aioTail = req;
+    pthread_cond_signal(&aioWork);
+    pthread_mutex_unlock(&aioLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_reap
+// Description  : Take completed requests off the completion queue
+//
+// Inputs       : reqs - where to store the completed requests
+//                max - room in reqs
+//                wait - non-zero to block until at least one completes
+// Outputs      : the number of requests taken, -1 if failure
+
+int fs3_reap(FS3IoRequest **reqs, int max, int wait) {
+    int count = 0;
+
+    if ((reqs == NULL) || (max < 1)) {
+        return(-1);
+    }
+    pthread_mutex_lock(&aioLock);
+    while (wait && (aioDoneHead == NULL) && (aioOutstanding > 0)) {
+        pthread_cond_wait(&aioDone, &aioLock);
+    }
+    while ((count < max) && (aioDoneHead != NULL)) {
+        FS3IoRequest *req = aioDoneHead;
+        aioDoneHead = req->next;
+        if (aioDoneHead == NULL) {
+            aioDoneTail = NULL;
+        }
+        req->next = NULL;
+        req->state = AIO_IDLE;
+        reqs[count++] = req;
+    }
+    aioOutstanding -= count;
+    pthread_mutex_unlock(&aioLock);
+    return(count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_submit_wait
+// Description  : Queue a request and block until it completes, without
+//                running its callback or putting it on the completion
+//                queue.  A dispatcher thread (e.g. in a callback) does not
+//                just sleep, which could leave no one to run the request;
+//                it carries out queued requests, in queue order and one
+//                per handle as usual, until its own is done.
+//
+// Inputs       : req - the request
+// Outputs      : the request's result, -1 if it could not be submitted
+
+int32_t fs3_submit_wait(FS3IoRequest *req) {
+    FS3IoRequest *next;
+
+    if (req == NULL) {
+        return(-1);
+    }
+    req->waited = 1;
+    if (fs3_submit(req) == -1) {
+        req->waited = 0;
+        return(-1);
+    }
+    pthread_mutex_lock(&aioLock);
+    while (req->state != AIO_DONE) {
+        if (!aioDispatcher) {
+            pthread_cond_wait(&aioDone, &aioLock);
+        } else if ((next = fs3_aio_take()) != NULL) {
+            fs3_aio_run(next);
+        } else {
+            pthread_cond_wait(&aioWork, &aioLock);
+        }
+    }
+    req->state = AIO_IDLE;
+    req->waited = 0;
+    pthread_mutex_unlock(&aioLock);
+    return(req->result);
+}
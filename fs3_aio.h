@@ -0,0 +1,93 @@
+#ifndef FS3_AIO_INCLUDED
+#define FS3_AIO_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_aio.h
+//  Description    : This is the interface for asynchronous FS3 file I/O.
+//                   Reads and writes are submitted to a queue and carried
+//                   out by dispatcher threads while the caller gets on with
+//                   other work; a finished request either has its callback
+//                   run or waits on the completion queue to be reaped.
+//
+//                   Requests on the same file handle run one at a time in
+//                   the order they were submitted, requests on different
+//                   handles may run in parallel.  A request reads or writes
+//                   at the handle's position when it runs, so do not seek
+//                   or close a handle with requests on it still in flight.
+//                   A callback runs once its request is done, so it may
+//                   overlap the handle's next request.
+//
+
+// Include
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Defines
+#define FS3_AIO_DEFAULT_DISPATCHERS 4   // Dispatcher threads, by default
+#define FS3_AIO_MAX_DISPATCHERS 64
+
+// What a request does
+typedef enum {
+
+    FS3_IO_READ   = 0,  // Read count bytes into buf
+    FS3_IO_WRITE  = 1,  // Write count bytes from buf
+    FS3_IO_READV  = 2,  // Read into the iovcnt buffers of iov
+    FS3_IO_WRITEV = 3   // Write from the iovcnt buffers of iov
+
+} FS3IoOp;
+
+typedef struct fs3IoRequest FS3IoRequest;
+
+// Function run by a dispatcher thread when a request finishes
+typedef void (*FS3IoCallback)(FS3IoRequest *req);
+
+// Function the dispatchers use to carry out a request, returns its result
+typedef int32_t (*FS3IoHandler)(FS3IoRequest *req);
+
+// One operation, owned by the queue from submit until it is completed
+// (callback) or reaped.  Zero it before its first submission.
+struct fs3IoRequest {
+
+    FS3IoOp op;
+    int16_t fd;                 // File handle to read or write
+    void *buf;                  // FS3_IO_READ/WRITE buffer
+    int32_t count;              // and its length
+    const struct iovec *iov;    // FS3_IO_READV/WRITEV buffers
+    int iovcnt;                 // and how many
+    FS3IoCallback callback;     // Run on completion, NULL to reap instead
+    void *data;                 // For the submitter, not used by the queue
+    int32_t result;             // Bytes moved or -1, set on completion
+
+    // Queue bookkeeping
+    struct fs3IoRequest *next;
+    int state;
+    int waited;                 // A blocked submitter is waiting for it
+
+};
+
+//
+// Asynchronous I/O Functions
+
+int fs3_aio_start(FS3IoHandler handler);
+    // Start the dispatcher threads (the driver does this at mount)
+
+int fs3_aio_stop(void);
+    // Run every queued request and stop the dispatchers (at unmount)
+
+int fs3_set_io_dispatchers(int threads);
+    // Select the number of dispatcher threads, takes effect at the next start
+
+int fs3_submit(FS3IoRequest *req);
+    // Queue a request, -1 if the queue is not running or the request is bad
+
+int fs3_reap(FS3IoRequest **reqs, int max, int wait);
+    // Take up to max completed requests that have no callback; if wait is
+    // set, block until at least one completes (returns 0 if none are
+    // outstanding)
+
+int32_t fs3_submit_wait(FS3IoRequest *req);
+    // Queue a request and block until it completes, returns its result;
+    // from a callback it runs queued requests in order while it waits
+
+#endif
@@ -0,0 +1,390 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_alloc.c
+//  Description    : This is the implementation of the FS3 free-space
+//                   bitmap allocator.  Free sectors are found a 64-bit
+//                   word at a time, and full tracks are skipped through
+//                   the summary word without looking at their bitmaps.
+//
+
+// Includes
+#include <string.h>
+#include <pthread.h>
+
+// Project Includes
+#include <fs3_alloc.h>
+
+//
+// Support Macros/Data
+
+#define WORD_OF(sct) ((sct) / FS3_ALLOC_WORD_BITS)
+#define BIT_OF(sct)  (1ULL << ((sct) % FS3_ALLOC_WORD_BITS))
+
+pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;     // every public call holds it
+uint64_t allocMap[FS3_MAX_TRACKS][FS3_ALLOC_TRACK_WORDS];  // set bit = sector in use
+uint16_t allocTrackFree[FS3_MAX_TRACKS];                    // free sectors per track
+uint64_t allocSummary[FS3_ALLOC_SUMMARY_WORDS];            // set bit = track has space
+int allocFree;                                              // free sectors on the disk
+int allocReserved;                                          // of those, held back for extent maps
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_first_free
+// Description  : Find the first free sector on a track at or after a point
+//
+// Inputs       : trk - the track to search
+//                from - the first sector to consider
+// Outputs      : the free sector, -1 if there is none
+
+static int fs3_alloc_first_free(FS3TrackIndex trk, int from) {
+    int w = WORD_OF(from);
+    uint64_t word;
+
+    if (from >= FS3_TRACK_SIZE) {
+        return(-1);
+    }
+    word = ~allocMap[trk][w] & (~0ULL << (from % FS3_ALLOC_WORD_BITS));
+    while (word == 0) {
+        if (++w == FS3_ALLOC_TRACK_WORDS) {
+            return(-1);
+        }
+        word = ~allocMap[trk][w];
+    }
+    return(w * FS3_ALLOC_WORD_BITS + __builtin_ctzll(word));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_run_end
+// Description  : Find the first sector in use on a track at or after a
+//                point, i.e. the end of the free run starting there
+//
+// Inputs       : trk - the track to search
+//                from - the first sector of the run
+// Outputs      : the sector ending the run (FS3_TRACK_SIZE at track end)
+
+static int fs3_alloc_run_end(FS3TrackIndex trk, int from) {
+    int w = WORD_OF(from);
+    uint64_t word = allocMap[trk][w] & (~0ULL << (from % FS3_ALLOC_WORD_BITS));
+
+    while (word == 0) {
+        if (++w == FS3_ALLOC_TRACK_WORDS) {
+            return(FS3_TRACK_SIZE);
+        }
+        word = allocMap[trk][w];
+    }
+    return(w * FS3_ALLOC_WORD_BITS + __builtin_ctzll(word));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_next_track
+// Description  : Find the next track with free space, wrapping around to
+//                track 0 after the last track
+//
+// Inputs       : from - the first track to consider
+// Outputs      : the track, -1 if the disk is full
+
+static int fs3_alloc_next_track(int from) {
+    for (int pass = 0; pass < 2; pass++) {
+        int start = (pass == 0) ? from : 0;
+        for (int w = WORD_OF(start); (start < FS3_MAX_TRACKS) && (w < FS3_ALLOC_SUMMARY_WORDS); w++) {
+            uint64_t word = allocSummary[w];
+            if (w == WORD_OF(start)) {
+                word &= ~0ULL << (start % FS3_ALLOC_WORD_BITS);
+            }
+            if (word != 0) {
+                return(w * FS3_ALLOC_WORD_BITS + __builtin_ctzll(word));
+            }
+        }
+    }
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_set
+// Description  : Mark a run of sectors on one track used or free, keeping
+//                the per-track and summary counts in step
+//
+// Inputs       : trk - the track
+//                sct - the first sector
+//                count - the number of sectors
+//                used - non-zero to mark in use, zero to free
+// Outputs      : 0 if successful, -1 if the run is out of range
+
+static int fs3_alloc_set(FS3TrackIndex trk, FS3SectorIndex sct, int count, int used) {
+    if ((trk >= FS3_MAX_TRACKS) || (count < 0) || (sct + count > FS3_TRACK_SIZE)) {
+        return(-1);
+    }
+    for (int s = sct; s < sct + count; s++) {
+        uint64_t *word = &allocMap[trk][WORD_OF(s)];
+        if (used && !(*word & BIT_OF(s))) {
+            *word |= BIT_OF(s);
+            allocTrackFree[trk]--;
+            allocFree--;
+        } else if (!used && (*word & BIT_OF(s))) {
+            *word &= ~BIT_OF(s);
+            allocTrackFree[trk]++;
+            allocFree++;
+        }
+    }
+    if (allocTrackFree[trk] > 0) {
+        allocSummary[WORD_OF(trk)] |= BIT_OF(trk);
+    } else {
+        allocSummary[WORD_OF(trk)] &= ~BIT_OF(trk);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_init
+// Description  : Mark every sector on the disk free
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_alloc_init(void) {
+    pthread_mutex_lock(&allocLock);
+    memset(allocMap, 0x0, sizeof(allocMap));
+    memset(allocSummary, 0x0, sizeof(allocSummary));
+    for (int t = 0; t < FS3_MAX_TRACKS; t++) {
+        allocTrackFree[t] = FS3_TRACK_SIZE;
+        allocSummary[WORD_OF(t)] |= BIT_OF(t);
+    }
+    allocFree = FS3_MAX_TRACKS * FS3_TRACK_SIZE;
+    allocReserved = 0;
+    pthread_mutex_unlock(&allocLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_take
+// Description  : Allocate a run of contiguous sectors near a hint, usually
+//                the sector after the end of the file being extended,
+//                leaving the sectors reserved for extent maps free.
+//                Called with allocLock held
+//
+// Inputs       : hintTrk - preferred track (FS3_ALLOC_NO_HINT for none)
+//                hintSct - preferred first sector on that track
+//                want - the most sectors wanted
+//                trk, sct - where to store the first sector allocated
+// Outputs      : number of sectors allocated, -1 if the disk is full
+
+static int fs3_alloc_take(FS3TrackIndex hintTrk, FS3SectorIndex hintSct, int want,
+                          FS3TrackIndex *trk, FS3SectorIndex *sct) {
+    int t = -1, s = -1, end;
+
+    if (allocFree - allocReserved <= 0) {
+        return(-1);
+    }
+    if (want < 1) {
+        want = 1;
+    }
+    if (want > allocFree - allocReserved) {
+        want = allocFree - allocReserved;
+    }
+
+    // The hint itself or the next free sector after it on the same track
+    if (hintTrk < FS3_MAX_TRACKS) {
+        t = hintTrk;
+        s = fs3_alloc_first_free(t, hintSct);
+    }
+
+    // Otherwise the first free sector on the next track with space
+    if (s == -1) {
+        t = fs3_alloc_next_track((hintTrk < FS3_MAX_TRACKS) ? hintTrk + 1 : 0);
+        if (t == -1) {
+            return(-1);
+        }
+        s = fs3_alloc_first_free(t, 0);
+    }
+    end = fs3_alloc_run_end(t, s);
+    if (end - s < want) {
+        want = end - s;
+    }
+    fs3_alloc_set(t, s, want, 1);
+    *trk = t;
+    *sct = s;
+    return(want);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_run
+// Description  : Allocate a run of contiguous sectors near a hint
+//
+// Inputs       : as fs3_alloc_take
+// Outputs      : number of sectors allocated, -1 if the disk is full
+
+int fs3_alloc_run(FS3TrackIndex hintTrk, FS3SectorIndex hintSct, int want,
+                  FS3TrackIndex *trk, FS3SectorIndex *sct) {
+    int result;
+
+    pthread_mutex_lock(&allocLock);
+    result = fs3_alloc_take(hintTrk, hintSct, want, trk, sct);
+    pthread_mutex_unlock(&allocLock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_exact
+// Description  : Allocate a run of exactly count contiguous sectors, taking
+//                the first free run long enough on the lowest track; the
+//                sectors may come out of the extent map reserve, which the
+//                caller then releases
+//
+// Inputs       : count - the sectors wanted (at most FS3_TRACK_SIZE)
+//                trk, sct - where to store the first sector allocated
+// Outputs      : 0 if successful, -1 if no free run is long enough
+
+int fs3_alloc_exact(int count, FS3TrackIndex *trk, FS3SectorIndex *sct) {
+    if ((count < 1) || (count > FS3_TRACK_SIZE)) {
+        return(-1);
+    }
+    pthread_mutex_lock(&allocLock);
+    for (int t = fs3_alloc_next_track(0); t != -1; t = (t + 1 < FS3_MAX_TRACKS) ? fs3_alloc_next_track(t + 1) : -1) {
+        if (allocTrackFree[t] < count) {
+            continue;
+        }
+        for (int s = fs3_alloc_first_free(t, 0); s != -1; ) {
+            int end = fs3_alloc_run_end(t, s);
+            if (end - s >= count) {
+                fs3_alloc_set(t, s, count, 1);
+                pthread_mutex_unlock(&allocLock);
+                *trk = t;
+                *sct = s;
+                return(0);
+            }
+            s = fs3_alloc_first_free(t, end);
+        }
+    }
+    pthread_mutex_unlock(&allocLock);
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_reserve
+// Description  : Hold free sectors back from fs3_alloc_run so that extent
+//                maps can still be written once data has filled the disk,
+//                or release them again
+//
+// Inputs       : count - sectors to hold back, negative to release
+// Outputs      : 0 if successful, -1 if too few sectors are free
+
+int fs3_alloc_reserve(int count) {
+    int result = 0;
+
+    pthread_mutex_lock(&allocLock);
+    if (allocFree - allocReserved < count) {
+        result = -1;
+    } else {
+        allocReserved += count;
+        if (allocReserved < 0) {
+            allocReserved = 0;
+        }
+    }
+    pthread_mutex_unlock(&allocLock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_mark
+// Description  : Mark a run of sectors in use
+//
+// Inputs       : trk - the track
+//                sct - the first sector
+//                count - the number of sectors
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_alloc_mark(FS3TrackIndex trk, FS3SectorIndex sct, int count) {
+    int result;
+
+    pthread_mutex_lock(&allocLock);
+    result = fs3_alloc_set(trk, sct, count, 1);
+    pthread_mutex_unlock(&allocLock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_free
+// Description  : Return a run of sectors to the free pool
+//
+// Inputs       : trk - the track
+//                sct - the first sector
+//                count - the number of sectors
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_alloc_free(FS3TrackIndex trk, FS3SectorIndex sct, int count) {
+    int result;
+
+    pthread_mutex_lock(&allocLock);
+    result = fs3_alloc_set(trk, sct, count, 0);
+    pthread_mutex_unlock(&allocLock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_load
+// Description  : Replace a track's bitmap with a saved copy and recount
+//                its free sectors
+//
+// Inputs       : trk - the track
+//                map - FS3_ALLOC_TRACK_WORDS bitmap words
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_alloc_load(FS3TrackIndex trk, const uint64_t *map) {
+    int used = 0;
+
+    if ((trk >= FS3_MAX_TRACKS) || (map == NULL)) {
+        return(-1);
+    }
+    pthread_mutex_lock(&allocLock);
+    memcpy(allocMap[trk], map, sizeof(allocMap[trk]));
+    for (int w = 0; w < FS3_ALLOC_TRACK_WORDS; w++) {
+        used += __builtin_popcountll(allocMap[trk][w]);
+    }
+    allocFree += (FS3_TRACK_SIZE - used) - allocTrackFree[trk];
+    allocTrackFree[trk] = FS3_TRACK_SIZE - used;
+    fs3_alloc_set(trk, 0, 0, 1);                // refresh the summary bit
+    pthread_mutex_unlock(&allocLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_map
+// Description  : Copy out a track's bitmap so it can be saved
+//
+// Inputs       : trk - the track
+//                map - room for FS3_ALLOC_TRACK_WORDS bitmap words
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_alloc_map(FS3TrackIndex trk, uint64_t *map) {
+    if ((trk >= FS3_MAX_TRACKS) || (map == NULL)) {
+        return(-1);
+    }
+    pthread_mutex_lock(&allocLock);
+    memcpy(map, allocMap[trk], sizeof(allocMap[trk]));
+    pthread_mutex_unlock(&allocLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_alloc_free_count
+// Description  : Get the number of free sectors on the disk
+//
+// Inputs       : none
+// Outputs      : the number of free sectors
+
+int fs3_alloc_free_count(void) {
+    return(__atomic_load_n(&allocFree, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,59 @@
+#ifndef FS3_ALLOC_INCLUDED
+#define FS3_ALLOC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_alloc.h
+//  Description    : This is the interface for the FS3 free-space allocator.
+//                   Every sector on the disk has a bit in a per-track
+//                   bitmap (set = in use) and a summary word records which
+//                   tracks still have space, so finding a free sector costs
+//                   the same on an empty disk as on a nearly full one.
+//
+
+// Include
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_ALLOC_WORD_BITS  64
+#define FS3_ALLOC_TRACK_WORDS (FS3_TRACK_SIZE / FS3_ALLOC_WORD_BITS)    // Bitmap words per track
+#define FS3_ALLOC_SUMMARY_WORDS ((FS3_MAX_TRACKS + FS3_ALLOC_WORD_BITS - 1) / FS3_ALLOC_WORD_BITS)
+#define FS3_ALLOC_NO_HINT FS3_NO_TRACK  // No preferred track, take the first free
+
+//
+// Allocator Functions
+
+int fs3_alloc_init(void);
+    // Mark every sector on the disk free
+
+int fs3_alloc_run(FS3TrackIndex hintTrk, FS3SectorIndex hintSct, int want,
+                  FS3TrackIndex *trk, FS3SectorIndex *sct);
+    // Allocate up to want contiguous sectors, starting at the hint if it is
+    // free, else as close after it as possible; returns the number taken
+    // (at least 1) and the first sector, -1 if the disk is full
+
+int fs3_alloc_exact(int count, FS3TrackIndex *trk, FS3SectorIndex *sct);
+    // Allocate exactly count contiguous sectors, first fit, -1 if no free
+    // run is long enough; may use the reserve held by fs3_alloc_reserve
+
+int fs3_alloc_reserve(int count);
+    // Hold count free sectors back from fs3_alloc_run for extent maps
+    // (negative to release them), -1 if too few are free
+
+int fs3_alloc_mark(FS3TrackIndex trk, FS3SectorIndex sct, int count);
+    // Mark a run of sectors in use (e.g. reserved or loaded from disk)
+
+int fs3_alloc_free(FS3TrackIndex trk, FS3SectorIndex sct, int count);
+    // Return a run of sectors to the free pool
+
+int fs3_alloc_load(FS3TrackIndex trk, const uint64_t *map);
+    // Replace a track's bitmap (FS3_ALLOC_TRACK_WORDS words) with a saved one
+
+int fs3_alloc_map(FS3TrackIndex trk, uint64_t *map);
+    // Copy out a track's bitmap (FS3_ALLOC_TRACK_WORDS words) for saving
+
+int fs3_alloc_free_count(void);
+    // Get the number of free sectors on the disk
+
+#endif
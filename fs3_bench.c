@@ -0,0 +1,606 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_bench.c
+//  Description    : This is the benchmark program for the FS3 driver.  It
+//                   loads a workload file (the format fs3_sim runs) into
+//                   memory once, then replays it against a freshly mounted
+//                   disk for each cache configuration asked for, timing
+//                   every command.  Results are printed as a table and can
+//                   also be written as JSON.
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+// Project Include Files
+#include <fs3_driver.h>
+#include <fs3_controller.h>
+#include <fs3_cache.h>
+#include <fs3_slab.h>
+#include <fs3_sched.h>
+#include <fs3_image.h>
+#include <fs3_workload.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define FS3_BENCH_ARGUMENTS "hwgn:c:p:s:i:j:"
+#define FS3_BENCH_MAX_FILES FS3_MAX_TOTAL_FILES  // Files a workload may name
+#define FS3_BENCH_MAX_SWEEP 16          // Values in a -c or -p list
+#define BENCH_COMMANDS (FS3_WORKLOAD_SEEK + 1)     // Commands reported, in FS3WorkloadCommand order
+#define USAGE \
+    "USAGE: fs3_bench [-h] [-w] [-g] [-n <iterations>] [-c <sizes>] [-p <policies>] [-s <shards>] [-i <image>] [-j <file>] <workload-file>\n" \
+    "\n" \
+    "where:\n" \
+    "    -h - help mode (display this message)\n" \
+    "    -w - use a write-back cache (default is write-through)\n" \
+    "    -g - back sector buffers with huge pages where available\n" \
+    "    -n - replay the workload this many times per configuration (default 1)\n" \
+    "    -c - cache sizes to run, comma separated (e.g. 0,64,1024)\n" \
+    "    -p - cache policies to run, comma separated (e.g. lru,arc)\n" \
+    "    -s - split the cache into this many locked shards (power of two)\n" \
+    "    -i - run on a disk image file <image> instead of the controller,\n" \
+    "         emptied before each replay\n" \
+    "    -j - also write the results as JSON to <file> (- for stdout)\n" \
+    "\n" \
+    "    Every combination of the -c and -p values is run.\n" \
+    "\n" \
+    "    <workload-file> - file contain the workload to replay, text or compiled\n" \
+    "\n" \
+
+// One command of the workload
+typedef struct {
+
+    FS3WorkloadCommand command;
+    int file;               // Index in benchFiles
+    int32_t length;         // Bytes to read or write
+    int32_t offset;         // Position for SEEK and WRITEAT
+    const char *data;       // Text to write, '^' already made a newline
+
+} FS3BenchOp;
+
+// Latencies of one command type over a configuration's replays
+typedef struct {
+
+    uint64_t *ns;
+    size_t count;
+    size_t size;
+
+} FS3BenchSamples;
+
+// What one configuration measured
+typedef struct {
+
+    uint16_t cacheSize;
+    int policy;
+    uint64_t ops;               // Commands replayed
+    uint64_t bytes;             // Bytes read and written by the commands
+    uint64_t controllerOps;     // TSEEK, RDSECT and WRSECT sent
+    uint64_t elapsed;           // Time spent replaying (ns)
+    uint64_t virtualTime;       // Disk image virtual time (ns), 0 if not used
+    FS3BenchSamples samples[BENCH_COMMANDS];
+
+} FS3BenchResult;
+
+//
+// Global Data
+
+const char *benchCommandNames[BENCH_COMMANDS] = { "READ", "WRITE", "WRITEAT", "SEEK" };
+FS3BenchOp *benchOps = NULL;            // The workload
+size_t benchOpCount = 0;
+char *benchFiles[FS3_BENCH_MAX_FILES];  // Files the workload names
+int benchFileCount = 0;
+int32_t benchMaxRead = 0;               // Longest READ, sizes the read buffer
+int benchImage = 0;                     // Running on a disk image (-i)
+char *benchImagePath = NULL;
+FS3Workload benchLog;                   // The workload, if it is a compiled log
+FILE *benchOut;                         // The table, stderr if the JSON is on stdout
+
+//
+// Functional Prototypes
+
+int load_workload(char *wload);                                 // read the workload into benchOps
+int run_configuration(int iterations, FS3BenchResult *result);  // replay for one configuration
+int replay_workload(FS3BenchResult *result);                    // replay the workload once
+int report_result(FS3BenchResult *result, FILE *json, int first);   // print a configuration's results
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_now
+// Description  : Read the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time (ns)
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_sample
+// Description  : Record the latency of one command
+//
+// Inputs       : samples - the command type's samples
+//                ns - the latency
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_sample(FS3BenchSamples *samples, uint64_t ns) {
+    uint64_t *grown;
+
+    if (samples->count == samples->size) {
+        samples->size = (samples->size == 0) ? 1024 : samples->size * 2;
+        if ((grown = realloc(samples->ns, samples->size * sizeof(uint64_t))) == NULL) {
+            return(-1);
+        }
+        samples->ns = grown;
+    }
+    samples->ns[samples->count++] = ns;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_ns_order
+// Description  : qsort comparison for latencies
+//
+// Inputs       : a, b - pointers to the latencies to compare
+// Outputs      : <0, 0, >0 as a is less than, equal to or greater than b
+
+static int bench_ns_order(const void *a, const void *b) {
+    uint64_t na = *(const uint64_t *)a, nb = *(const uint64_t *)b;
+
+    return((na > nb) - (na < nb));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_percentile
+// Description  : Get a nearest-rank percentile of sorted latencies
+//
+// Inputs       : samples - the latencies, sorted
+//                pct - the percentile (0-100)
+// Outputs      : the latency (ns), 0 if there are none
+
+static uint64_t bench_percentile(FS3BenchSamples *samples, double pct) {
+    size_t rank;
+
+    if (samples->count == 0) {
+        return(0);
+    }
+    rank = (size_t)((pct / 100.0) * samples->count + 0.999999);
+    rank = (rank < 1) ? 1 : (rank > samples->count) ? samples->count : rank;
+    return(samples->ns[rank - 1]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_split
+// Description  : Split a comma separated option into its values
+//
+// Inputs       : list - the option (modified)
+//                values - where to store the values
+//                max - room in values
+// Outputs      : the number of values, -1 if there are too many
+
+static int bench_split(char *list, char **values, int max) {
+    char *save = NULL, *value;
+    int count = 0;
+
+    for (value = strtok_r(list, ",", &save); value != NULL; value = strtok_r(NULL, ",", &save)) {
+        if (count == max) {
+            return(-1);
+        }
+        values[count++] = value;
+    }
+    return(count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the FS3 benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char *argv[]) {
+
+    // Local variables
+    char *sizeList[FS3_BENCH_MAX_SWEEP], *policyList[FS3_BENCH_MAX_SWEEP];
+    uint16_t sizes[FS3_BENCH_MAX_SWEEP];
+    int policies[FS3_BENCH_MAX_SWEEP] = { FS3_CACHE_LRU };
+    int ch, iterations = 1, sizeCount = 1, policyCount = 1, shards, s, p, i, result = 0;
+    FS3BenchResult run;
+    FILE *json = NULL;
+    char *jsonPath = NULL;
+
+    sizes[0] = FS3_DEFAULT_CACHE_SIZE;
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, FS3_BENCH_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return(-1);
+
+        case 'w': // Write-back cache flag
+            fs3_set_cache_mode(FS3_CACHE_WRITEBACK);
+            break;
+
+        case 'g': // Huge page sector buffers
+            fs3_set_slab_hugepages(1);
+            break;
+
+        case 'n': // Replays per configuration
+            if ((sscanf(optarg, "%d", &iterations) != 1) || (iterations < 1)) {
+                fprintf(stderr, "Bad iteration count [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        case 'c': // Cache sizes to sweep
+            if ((sizeCount = bench_split(optarg, sizeList, FS3_BENCH_MAX_SWEEP)) < 1) {
+                fprintf(stderr, "Bad cache size list, at most %d sizes, aborting.\n", FS3_BENCH_MAX_SWEEP);
+                return(-1);
+            }
+            for (i = 0; i < sizeCount; i++) {
+                if (sscanf(sizeList[i], "%hu", &sizes[i]) != 1) {
+                    fprintf(stderr, "Bad cache size [%s], aborting.\n", sizeList[i]);
+                    return(-1);
+                }
+            }
+            break;
+
+        case 'p': // Cache policies to sweep
+            if ((policyCount = bench_split(optarg, policyList, FS3_BENCH_MAX_SWEEP)) < 1) {
+                fprintf(stderr, "Bad cache policy list, at most %d policies, aborting.\n", FS3_BENCH_MAX_SWEEP);
+                return(-1);
+            }
+            for (i = 0; i < policyCount; i++) {
+                if ((policies[i] = fs3_cache_policy_by_name(policyList[i])) == -1) {
+                    fprintf(stderr, "Unknown cache policy [%s], aborting.\n", policyList[i]);
+                    return(-1);
+                }
+            }
+            break;
+
+        case 's': // Set the number of cache shards
+            if ((sscanf(optarg, "%d", &shards) != 1) || (fs3_set_cache_shards(shards) == -1)) {
+                fprintf(stderr, "Bad cache shard count [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        case 'i': // Use a disk image as the controller
+            if (fs3_image_set_path(optarg, 1) == -1) {
+                fprintf(stderr, "Bad disk image path [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            fs3_sched_set_controller(fs3_image_syscall);
+            benchImage = 1;
+            benchImagePath = optarg;
+            break;
+
+        case 'j': // JSON results
+            jsonPath = optarg;
+            break;
+
+        default:  // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return(-1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Missing command line parameters, use -h to see usage, aborting.\n");
+        return(-1);
+    }
+
+    // Setup the log, only errors are shown
+    initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    FS3ControllerLLevel = registerLogLevel("FS3_CONTROLLER", 0);
+    FS3DriverLLevel = registerLogLevel("FS3_DRIVER", 0);
+    FS3SimulatorLLevel = registerLogLevel("FS3_SIMULATOR", 0);
+
+    // Load the workload, then run every configuration
+    if (load_workload(argv[optind]) == -1) {
+        return(-1);
+    }
+    if (jsonPath != NULL) {
+        if ((json = (strcmp(jsonPath, "-") == 0) ? stdout : fopen(jsonPath, "w")) == NULL) {
+            fprintf(stderr, "Cannot open JSON output [%s]: %s, aborting.\n", jsonPath, strerror(errno));
+            return(-1);
+        }
+        fprintf(json, "{\"workload\": \"%s\", \"iterations\": %d, \"operations\": %lu, \"results\": [",
+            argv[optind], iterations, (unsigned long)benchOpCount);
+    }
+    benchOut = (json == stdout) ? stderr : stdout;
+    fprintf(benchOut, "Workload %s: %lu commands on %d files, %d replay(s) per configuration\n",
+        argv[optind], (unsigned long)benchOpCount, benchFileCount, iterations);
+    for (p = 0; (p < policyCount) && (result == 0); p++) {
+        for (s = 0; (s < sizeCount) && (result == 0); s++) {
+            memset(&run, 0x0, sizeof(run));
+            run.cacheSize = sizes[s];
+            run.policy = policies[p];
+            fs3_set_cache_policy(policies[p]);
+            if ((result = run_configuration(iterations, &run)) == 0) {
+                report_result(&run, json, (p == 0) && (s == 0));
+            }
+            for (i = 0; i < BENCH_COMMANDS; i++) {
+                free(run.samples[i].ns);
+            }
+        }
+    }
+    if (json != NULL) {
+        fprintf(json, "]}\n");
+        if (json != stdout) {
+            fclose(json);
+        }
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_workload
+// Description  : Read a text workload into memory, or take the ops of a
+//                compiled log from its mapping
+//
+// Inputs       : wload - the name of the workload file
+// Outputs      : 0 if successful, -1 if failure
+
+int load_workload(char *wload) {
+
+    // Local variables
+    char line[FS3_WORKLOAD_MAX_LINE], fname[FS3_MAX_PATH_LENGTH], *text, *data;
+    FS3WorkloadCommand command;
+    size_t size = 0;
+    int32_t len, off;
+    int linecount = 0, idx, mapped;
+    FS3BenchOp *op;
+    FILE *fhandle;
+
+    if ((mapped = fs3_workload_map(wload, &benchLog)) == -1) {
+        return(-1);
+    }
+    if (mapped) {
+        benchOpCount = benchLog.header->ops;
+        benchFileCount = benchLog.header->files;
+        benchMaxRead = benchLog.header->maxRead;
+        if ((benchOps = malloc(benchOpCount * sizeof(FS3BenchOp))) == NULL) {
+            return(-1);
+        }
+        for (idx = 0; idx < benchFileCount; idx++) {
+            benchFiles[idx] = (char *)benchLog.names[idx];
+        }
+        for (size_t n = 0; n < benchOpCount; n++) {
+            benchOps[n].command = benchLog.ops[n].command;
+            benchOps[n].file = benchLog.ops[n].file;
+            benchOps[n].length = benchLog.ops[n].length;
+            benchOps[n].offset = benchLog.ops[n].offset;
+            benchOps[n].data = &benchLog.payload[benchLog.ops[n].payload];
+        }
+        return(0);
+    }
+
+    if ((fhandle = fopen(wload, "r")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.", wload, strerror(errno));
+        return(-1);
+    }
+    while (fgets(line, sizeof(line), fhandle) != NULL) {
+        linecount++;
+        if (fs3_workload_parse(line, fname, &command, &len, &off, &text) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "FS3 un-parsable workload string, aborting [%s], line %d", line, linecount);
+            fclose(fhandle);
+            return(-1);
+        }
+        if (benchOpCount == size) {
+            size = (size == 0) ? 1024 : size * 2;
+            if ((op = realloc(benchOps, size * sizeof(FS3BenchOp))) == NULL) {
+                fclose(fhandle);
+                return(-1);
+            }
+            benchOps = op;
+        }
+        op = &benchOps[benchOpCount];
+        memset(op, 0x0, sizeof(FS3BenchOp));
+        op->command = command;
+        op->length = len;
+        op->offset = off;
+
+        // Find or add the file
+        for (idx = 0; (idx < benchFileCount) && (strcmp(benchFiles[idx], fname) != 0); idx++);
+        if (idx == benchFileCount) {
+            if (benchFileCount == FS3_BENCH_MAX_FILES) {
+                logMessage(LOG_ERROR_LEVEL, "Too many files in workload, line %d", linecount);
+                fclose(fhandle);
+                return(-1);
+            }
+            benchFiles[benchFileCount++] = strdup(fname);
+        }
+        op->file = idx;
+
+        // Keep the text to write, already decoded
+        if ((command == FS3_WORKLOAD_WRITE) || (command == FS3_WORKLOAD_WRITEAT)) {
+            if ((data = malloc(len)) == NULL) {
+                fclose(fhandle);
+                return(-1);
+            }
+            memcpy(data, text, len);
+            op->data = data;
+        } else if ((command == FS3_WORKLOAD_READ) && (len > benchMaxRead)) {
+            benchMaxRead = len;
+        }
+        benchOpCount++;
+    }
+    fclose(fhandle);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_configuration
+// Description  : Replay the workload on a fresh mount a number of times
+//
+// Inputs       : iterations - replays to run
+//                result - the configuration, where to add the measurements
+// Outputs      : 0 if successful, -1 if failure
+
+int run_configuration(int iterations, FS3BenchResult *result) {
+    FS3SchedStats before, after;
+    uint64_t clock;
+
+    for (int i = 0; i < iterations; i++) {
+        if (benchImage) {
+            fs3_image_set_path(benchImagePath, 1);
+        }
+        fs3_sched_stats(&before);
+        clock = fs3_image_clock();
+        if ((fs3_mount_disk() == -1) || (fs3_init_cache(result->cacheSize) == -1)) {
+            logMessage(LOG_ERROR_LEVEL, "FS3 benchmark failed initialization.");
+            return(-1);
+        }
+        if (replay_workload(result) == -1) {
+            return(-1);
+        }
+        if ((fs3_unmount_disk() == -1) || (fs3_close_cache() == -1) || (fs3_slab_close() == -1)) {
+            logMessage(LOG_ERROR_LEVEL, "FS3 benchmark failed shutdown.");
+            return(-1);
+        }
+
+        // Write-back sectors reach the disk at unmount, so count after it
+        fs3_sched_stats(&after);
+        result->controllerOps += (after.seeks - before.seeks) + (after.reads - before.reads) + (after.writes - before.writes);
+        result->virtualTime += fs3_image_clock() - clock;
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_workload
+// Description  : Open the workload's files, run every command timing each
+//                one, and close the files
+//
+// Inputs       : result - where to add the measurements
+// Outputs      : 0 if successful, -1 if failure
+
+int replay_workload(FS3BenchResult *result) {
+    int16_t handles[FS3_BENCH_MAX_FILES];
+    char *rbuf;
+    uint64_t start, begin;
+    int32_t moved;
+    FS3BenchOp *op;
+    int i;
+
+    if ((rbuf = malloc(benchMaxRead + 1)) == NULL) {
+        return(-1);
+    }
+    begin = bench_now();
+    for (i = 0; i < benchFileCount; i++) {
+        if ((handles[i] = fs3_open(benchFiles[i])) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Open of file [%s] failed, aborting benchmark.", benchFiles[i]);
+            free(rbuf);
+            return(-1);
+        }
+    }
+    for (size_t n = 0; n < benchOpCount; n++) {
+        op = &benchOps[n];
+        start = bench_now();
+        switch (op->command) {
+        case FS3_WORKLOAD_READ:
+            moved = fs3_read(handles[op->file], rbuf, op->length);
+            break;
+        case FS3_WORKLOAD_WRITEAT:
+            moved = (fs3_seek(handles[op->file], op->offset) == 0) ? fs3_write(handles[op->file], (char *)op->data, op->length) : -1;
+            break;
+        case FS3_WORKLOAD_WRITE:
+            moved = fs3_write(handles[op->file], (char *)op->data, op->length);
+            break;
+        default:
+            moved = (fs3_seek(handles[op->file], op->offset) == 0) ? 0 : -1;
+            break;
+        }
+        if ((moved == -1) || ((op->command != FS3_WORKLOAD_SEEK) && (moved != op->length))) {
+            logMessage(LOG_ERROR_LEVEL, "%s of file [%s] failed, aborting benchmark.",
+                benchCommandNames[op->command], benchFiles[op->file]);
+            free(rbuf);
+            return(-1);
+        }
+        if (bench_sample(&result->samples[op->command], bench_now() - start) == -1) {
+            free(rbuf);
+            return(-1);
+        }
+        result->bytes += moved;
+    }
+    for (i = 0; i < benchFileCount; i++) {
+        fs3_close(handles[i]);
+    }
+    result->elapsed += bench_now() - begin;
+    result->ops += benchOpCount;
+    free(rbuf);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : report_result
+// Description  : Print a configuration's results, and add them to the JSON
+//
+// Inputs       : result - the measurements
+//                json - the JSON output, NULL if not wanted
+//                first - this is the first configuration reported
+// Outputs      : 0 if successful, -1 if failure
+
+int report_result(FS3BenchResult *result, FILE *json, int first) {
+    double seconds = result->elapsed / 1e9;
+    FS3BenchSamples *samples;
+    int i;
+
+    fprintf(benchOut, "\nCache %s/%u: %.0f ops/s, %.0f bytes/s, %.4f controller ops/byte",
+        fs3_cache_policy_name(result->policy), result->cacheSize, result->ops / seconds,
+        result->bytes / seconds, (result->bytes > 0) ? (double)result->controllerOps / result->bytes : 0.0);
+    if (benchImage) {
+        fprintf(benchOut, ", %.3f ms virtual disk time", result->virtualTime / 1e6);
+    }
+    fprintf(benchOut, "\n    %-8s %10s %10s %10s %10s %10s\n", "command", "count", "p50 ns", "p95 ns", "p99 ns", "max ns");
+    if (json != NULL) {
+        fprintf(json, "%s\n  {\"policy\": \"%s\", \"cacheSize\": %u, \"seconds\": %.6f, \"operations\": %lu, "
+            "\"bytes\": %lu, \"opsPerSec\": %.1f, \"bytesPerSec\": %.1f, \"controllerOps\": %lu, "
+            "\"controllerOpsPerByte\": %.6f, \"virtualNs\": %lu, \"latency\": {",
+            first ? "" : ",", fs3_cache_policy_name(result->policy), result->cacheSize, seconds,
+            (unsigned long)result->ops, (unsigned long)result->bytes, result->ops / seconds,
+            result->bytes / seconds, (unsigned long)result->controllerOps,
+            (result->bytes > 0) ? (double)result->controllerOps / result->bytes : 0.0,
+            (unsigned long)result->virtualTime);
+    }
+    for (i = 0; i < BENCH_COMMANDS; i++) {
+        samples = &result->samples[i];
+        qsort(samples->ns, samples->count, sizeof(uint64_t), bench_ns_order);
+        fprintf(benchOut, "    %-8s %10lu %10lu %10lu %10lu %10lu\n", benchCommandNames[i], (unsigned long)samples->count,
+            (unsigned long)bench_percentile(samples, 50), (unsigned long)bench_percentile(samples, 95),
+            (unsigned long)bench_percentile(samples, 99), (unsigned long)bench_percentile(samples, 100));
+        if (json != NULL) {
+            fprintf(json, "%s\"%s\": {\"count\": %lu, \"p50\": %lu, \"p95\": %lu, \"p99\": %lu, \"max\": %lu}",
+                (i == 0) ? "" : ", ", benchCommandNames[i], (unsigned long)samples->count,
+                (unsigned long)bench_percentile(samples, 50), (unsigned long)bench_percentile(samples, 95),
+                (unsigned long)bench_percentile(samples, 99), (unsigned long)bench_percentile(samples, 100));
+        }
+    }
+    if (json != NULL) {
+        fprintf(json, "}}");
+    }
+    return(0);
+}
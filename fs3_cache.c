@@ -1,7 +1,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  File           : fs3_cache.c
-//  Description    : This is the implementation of the cache for the 
+//  Description    : This is the implementation of the cache for the
 //                   FS3 filesystem interface.
 //
 //  Author         : Patrick McDaniel
@@ -9,191 +9,1674 @@
 //
 
 // Includes
-#include <cmpsc311_log.h>
-#include "cmpsc311_log.h"
-#include "fs3_controller.h"
+#include <stdio.h>
 #include <stdlib.h>
-//#include <fs3_common.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <cmpsc311_log.h>
+
 // Project Includes
 #include <fs3_cache.h>
+#include <fs3_cache_policy.h>
+#include <fs3_slab.h>
 #include <fs3_controller.h>
-//#include <fs3_common.h>
 
 //
-// Support Macros/Data
-typedef enum {T, F} boolean;
-double Hits =0;
-double Misses =0;
-int Attempts =0;
-double HitRatio;
-int cacheSize;
-int init=0;
-int cacheCount = 0;
-struct cacheParts{
-    int sector;
-    int track;
-    int timeStamp;
-    void *buffer;
-    boolean used;
-}*CACHE;
+// Support Macros/Data
+
+FS3CacheShard cacheShards[FS3_CACHE_MAX_SHARDS] = {
+    [0 ... FS3_CACHE_MAX_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+int shardCount = 1;                 // shards in the open cache, a power of two
+int shardMask = 0;                  // shardCount - 1
+int cacheSize;                      // lines across all shards
+struct cacheParts *CACHE;           // all lines, each shard owns a slice
+struct cacheParts **flushList;      // scratch list of dirty lines to write
+
+int cacheShardsWanted = FS3_DEFAULT_CACHE_SHARDS;  // shards for the next init
+FS3CachePolicy cachePolicy = FS3_CACHE_LRU;     // policy for the next init
+const FS3CachePolicyOps *policy;                // policy of the open cache
+
+FS3CacheMode cacheMode = FS3_CACHE_WRITETHROUGH;    // mode for the next init
+FS3CacheMode openMode;                              // mode of the open cache
+FS3CacheWriter cacheWriter;         // writes dirty sectors back to disk
+FS3CacheReader cacheReader;         // reads missing sectors in for pins
+
+pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;  // the flusher's wakeups
+pthread_cond_t flushWork = PTHREAD_COND_INITIALIZER;    // a shard wants flushing, or stop
+pthread_t flushThread;
+int flushRunning = 0;               // the flusher thread is running
+int flushStop;                      // the flusher should exit
+int flushPending;                   // shards were marked since the last sweep
+
+// Why a line gave up its sector
+typedef enum {
+
+    FS3_EVICT_CLEAN    = 0, // Replaced by the policy, nothing to write
+    FS3_EVICT_DIRTY    = 1, // Replaced by the policy, written back first
+    FS3_EVICT_PREFETCH = 2, // Read ahead and replaced before being used
+    FS3_EVICT_CLOSE    = 3, // Still cached when the cache was closed
+    FS3_EVICT_REASONS  = 4
+
+} FS3CacheEvictReason;
+
+static const char *cacheEvictNames[FS3_EVICT_REASONS] = { "clean", "dirty", "prefetch", "close" };
+
+// Detailed statistics of one shard, kept under the shard lock; all of the
+// fields are counters so shards are summed a word at a time.  Histograms
+// are by powers of two, bucket b > 0 counting values in [2^(b-1), 2^b)
+typedef struct {
+    uint64_t trackHits[FS3_MAX_TRACKS];
+    uint64_t trackMisses[FS3_MAX_TRACKS];
+    uint64_t ownerHits[FS3_CACHE_MAX_OWNERS + 1];       // last is unattributed
+    uint64_t ownerMisses[FS3_CACHE_MAX_OWNERS + 1];
+    uint64_t coldRefs;                                  // first reference to a sector
+    uint64_t reuse[FS3_CACHE_HIST_BUCKETS];             // references since the last to the sector
+    uint64_t evictions[FS3_EVICT_REASONS];
+    uint64_t evictAge[FS3_CACHE_HIST_BUCKETS];          // references since the line was filled
+    uint64_t lookups;
+    uint64_t lookupTotalNs;
+    uint64_t lookupNs[FS3_CACHE_HIST_BUCKETS];
+    uint64_t inserts;
+    uint64_t insertTotalNs;
+    uint64_t insertNs[FS3_CACHE_HIST_BUCKETS];
+} FS3CacheStats;
+
+int cacheStatsWanted = 0;           // detailed stats for the next init
+int statsLines;                     // lines of the cache the stats describe
+FS3CacheStats *cacheStats[FS3_CACHE_MAX_SHARDS];   // per shard, NULL if not kept
+uint64_t *cacheLastRef;             // reference clock + 1 of each sector's last reference
+uint64_t cacheClock;                // references made so far, all shards
+static __thread int cacheOwner = -1;    // file the thread's references are for
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_list_push
+// Description  : Insert a node at the head of a list
+//
+// Inputs       : list - the list to insert into
+//                node - the (unlinked) node to insert
+// Outputs      : none
+
+void fs3_cache_list_push(FS3CacheList *list, FS3CacheNode *node) {
+    node->prev = NULL;
+    node->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = node;
+    } else {
+        list->tail = node;
+    }
+    list->head = node;
+    list->count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_list_remove
+// Description  : Remove a node from a list
+//
+// Inputs       : list - the list holding the node
+//                node - the node to remove
+// Outputs      : none
+
+void fs3_cache_list_remove(FS3CacheList *list, FS3CacheNode *node) {
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        list->head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        list->tail = node->prev;
+    }
+    node->prev = node->next = NULL;
+    list->count--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_list_pop
+// Description  : Remove and return the tail of a list
+//
+// Inputs       : list - the list to pop from
+// Outputs      : the old tail, NULL if the list is empty
+
+FS3CacheNode *fs3_cache_list_pop(FS3CacheList *list) {
+    FS3CacheNode *node = list->tail;
+
+    if (node != NULL) {
+        fs3_cache_list_remove(list, node);
+    }
+    return(node);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_free_line
+// Description  : Take an unused line for a policy to fill
+//
+// Inputs       : shard - the shard the line must come from
+// Outputs      : pointer to the line, NULL if there are no unused lines
+
+struct cacheParts *fs3_cache_free_line(FS3CacheShard *shard) {
+    FS3CacheNode *node = fs3_cache_list_pop(&shard->freeLines);
+
+    return((node == NULL) ? NULL : FS3_CACHE_ENTRY(node, struct cacheParts, link));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_shard
+// Description  : Get the shard a sector is cached in
+//
+// Inputs       : trk - the track number of the sector
+//                sct - the sector number of the sector
+// Outputs      : pointer to the shard
+
+static FS3CacheShard *fs3_cache_shard(FS3TrackIndex trk, FS3SectorIndex sct) {
+    return(&cacheShards[FS3_CACHE_SHARD(FS3_CACHE_KEY(trk, sct), shardMask)]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_stats
+// Description  : Get the detailed statistics of a shard
+//
+// Inputs       : shard - the shard
+// Outputs      : pointer to the statistics, NULL if they are not kept
+
+static FS3CacheStats *fs3_cache_stats(FS3CacheShard *shard) {
+    return(cacheStats[shard - cacheShards]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_now
+// Description  : Read the monotonic clock, if latencies are being kept
+//
+// Inputs       : none
+// Outputs      : the time (ns), 0 if detailed stats are off
+
+static uint64_t fs3_cache_now(void) {
+    struct timespec ts;
+
+    if (cacheLastRef == NULL) {
+        return(0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_bucket
+// Description  : Get the histogram bucket a value is counted in
+//
+// Inputs       : value - the value
+// Outputs      : 0 for 0, otherwise one more than the log2 of the value
+
+static int fs3_cache_bucket(uint64_t value) {
+    int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+
+    return((bucket < FS3_CACHE_HIST_BUCKETS) ? bucket : FS3_CACHE_HIST_BUCKETS - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_timed
+// Description  : Record how long a lookup or insert took
+//
+// Inputs       : hist - the latency histogram
+//                count, total - the operation count and total time
+//                start - fs3_cache_now when the operation began
+// Outputs      : none
+
+static void fs3_cache_timed(uint64_t *hist, uint64_t *count, uint64_t *total, uint64_t start) {
+    uint64_t elapsed = fs3_cache_now() - start;
+
+    hist[fs3_cache_bucket(elapsed)]++;
+    (*count)++;
+    *total += elapsed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_account
+// Description  : Count a reference against its track and file, and the
+//                number of references made since the sector was last asked
+//                for.  Called with the shard lock held
+//
+// Inputs       : shard - the sector's shard
+//                trk - the track number of the sector
+//                sct - the sector number of the sector
+//                hit - non-zero if the sector was cached
+// Outputs      : none
+
+static void fs3_cache_account(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct, int hit) {
+    FS3CacheStats *stats = fs3_cache_stats(shard);
+    int owner = ((cacheOwner >= 0) && (cacheOwner < FS3_CACHE_MAX_OWNERS)) ? cacheOwner : FS3_CACHE_MAX_OWNERS;
+    uint64_t now, *last;
+
+    if ((stats == NULL) || (trk >= FS3_MAX_TRACKS) || (sct >= FS3_TRACK_SIZE)) {
+        return;
+    }
+    if (hit) {
+        stats->trackHits[trk]++;
+        stats->ownerHits[owner]++;
+    } else {
+        stats->trackMisses[trk]++;
+        stats->ownerMisses[owner]++;
+    }
+
+    // A sector always maps to this shard, so its slot is ours to update
+    now = __atomic_fetch_add(&cacheClock, 1, __ATOMIC_RELAXED);
+    last = &cacheLastRef[(size_t)trk * FS3_TRACK_SIZE + sct];
+    if (*last == 0) {
+        stats->coldRefs++;
+    } else {
+        stats->reuse[fs3_cache_bucket(now - *last)]++;
+    }
+    *last = now + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_evicted
+// Description  : Count a line giving up its sector, and how long it held it
+//
+// Inputs       : shard - the line's shard
+//                line - the line, still holding the sector
+//                reason - why it is giving it up
+// Outputs      : none
+
+static void fs3_cache_evicted(FS3CacheShard *shard, struct cacheParts *line, FS3CacheEvictReason reason) {
+    FS3CacheStats *stats = fs3_cache_stats(shard);
+
+    if (stats != NULL) {
+        stats->evictions[reason]++;
+        stats->evictAge[fs3_cache_bucket(__atomic_load_n(&cacheClock, __ATOMIC_RELAXED) - line->inserted)]++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_lock_all
+// Description  : Take or release every shard lock, in shard order
+//
+// Inputs       : lock - non-zero to take the locks, zero to release them
+// Outputs      : none
+
+static void fs3_cache_lock_all(int lock) {
+    for (int i = 0; i < shardCount; i++) {
+        if (lock) {
+            pthread_mutex_lock(&cacheShards[i].lock);
+        } else {
+            pthread_mutex_unlock(&cacheShards[i].lock);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_find
+// Description  : Find the line holding a sector using the hash table
+//
+// Inputs       : shard - the sector's shard
+//                trk - the track number of the sector to find
+//                sct - the sector number of the sector to find
+// Outputs      : pointer to the line if found, NULL otherwise
+
+static struct cacheParts *fs3_cache_find(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    struct cacheParts *line;
+
+    line = shard->table[FS3_CACHE_HASH(FS3_CACHE_KEY(trk, sct), shard->bits)];
+    while ((line != NULL) && ((line->track != trk) || (line->sector != sct))) {
+        line = line->hashNext;
+    }
+    return(line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_lookup
+// Description  : Find the line holding a sector for a reference, timing the
+//                search when detailed stats are kept
+//
+// Inputs       : as fs3_cache_find
+// Outputs      : as fs3_cache_find
+
+static struct cacheParts *fs3_cache_lookup(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    FS3CacheStats *stats = fs3_cache_stats(shard);
+    uint64_t start = fs3_cache_now();
+    struct cacheParts *line = fs3_cache_find(shard, trk, sct);
+
+    if (stats != NULL) {
+        fs3_cache_timed(stats->lookupNs, &stats->lookups, &stats->lookupTotalNs, start);
+    }
+    return(line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_unhash
+// Description  : Remove a line from its hash bucket
+//
+// Inputs       : shard - the line's shard
+//                line - the line to remove
+// Outputs      : none
+
+static void fs3_cache_unhash(FS3CacheShard *shard, struct cacheParts *line) {
+    struct cacheParts **link;
+
+    link = &shard->table[FS3_CACHE_HASH(FS3_CACHE_KEY(line->track, line->sector), shard->bits)];
+    while (*link != line) {
+        link = &(*link)->hashNext;
+    }
+    *link = line->hashNext;
+    line->hashNext = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_invalidate
+// Description  : Drop the sector a clean, unpinned line holds, so that the
+//                next reference reads it from the disk
+//
+// Inputs       : shard - the line's shard
+//                line - the line, linked into the policy
+// Outputs      : none
+
+static void fs3_cache_invalidate(FS3CacheShard *shard, struct cacheParts *line) {
+    policy->unlink(shard, line);
+    fs3_cache_unhash(shard, line);
+    fs3_slab_free(line->buffer);
+    line->buffer = NULL;
+    line->prefetched = 0;
+    shard->count--;
+    fs3_cache_list_push(&shard->freeLines, &line->link);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_writeback
+// Description  : Write a dirty line back to the disk and mark it clean
+//
+// Inputs       : shard - the line's shard
+//                line - the dirty line
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_cache_writeback(FS3CacheShard *shard, struct cacheParts *line) {
+    if ((cacheWriter == NULL) || (cacheWriter(line->track, line->sector, line->buffer) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed writing back cached sector [%d/%d]",
+            line->track, line->sector);
+        return(-1);
+    }
+    line->dirty = 0;
+    shard->dirtyCount--;
+    shard->stats.writebacks++;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_key_order
+// Description  : qsort comparison putting lines in (track, sector) order
+//
+// Inputs       : a, b - pointers to the line pointers to compare
+// Outputs      : <0, 0, >0 as a sorts before, with or after b
+
+static int fs3_cache_key_order(const void *a, const void *b) {
+    const struct cacheParts *la = *(struct cacheParts * const *)a;
+    const struct cacheParts *lb = *(struct cacheParts * const *)b;
+    uint32_t ka = FS3_CACHE_KEY(la->track, la->sector);
+    uint32_t kb = FS3_CACHE_KEY(lb->track, lb->sector);
+
+    return((ka > kb) - (ka < kb));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_flush_to
+// Description  : Write back a shard's dirty lines in ascending (track,
+//                sector) order, resuming after the point the previous flush
+//                stopped, until no more than target lines are dirty
+//
+// Inputs       : shard - the shard to flush
+//                target - the number of dirty lines to leave behind
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_cache_flush_to(FS3CacheShard *shard, int target) {
+    struct cacheParts **list = shard->flushList;
+    int count = 0, start = 0, result = 0;
+
+    if (shard->dirtyCount <= target) {
+        return(0);
+    }
+    for (int i = 0; i < shard->size; i++) {
+        if ((shard->lines[i].buffer != NULL) && shard->lines[i].dirty) {
+            list[count++] = &shard->lines[i];
+        }
+    }
+    qsort(list, count, sizeof(struct cacheParts *), fs3_cache_key_order);
+
+    // Sweep like an elevator, continuing from the last key written
+    while ((start < count) &&
+            (FS3_CACHE_KEY(list[start]->track, list[start]->sector) <= shard->flushKey)) {
+        start++;
+    }
+    for (int i = 0; (i < count) && (shard->dirtyCount > target); i++) {
+        struct cacheParts *line = list[(start + i) % count];
+        if (fs3_cache_writeback(shard, line) == -1) {
+            result = -1;
+        }
+        shard->flushKey = FS3_CACHE_KEY(line->track, line->sector);
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_flusher
+// Description  : Flusher thread, writes back the shards that crossed the
+//                high watermark down to the low one until it is stopped.
+//                Lines that fail to write stay dirty for the next flush
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void *fs3_cache_flusher(void *arg) {
+    pthread_mutex_lock(&flushLock);
+    while (!flushStop) {
+        if (!flushPending) {
+            pthread_cond_wait(&flushWork, &flushLock);
+            continue;
+        }
+        flushPending = 0;
+        pthread_mutex_unlock(&flushLock);
+        for (int i = 0; i < shardCount; i++) {
+            FS3CacheShard *shard = &cacheShards[i];
+            pthread_mutex_lock(&shard->lock);
+            if (shard->flushWanted) {
+                shard->flushWanted = 0;
+                fs3_cache_flush_to(shard, (shard->size * FS3_CACHE_DIRTY_LOW) / 100);
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+        pthread_mutex_lock(&flushLock);
+    }
+    pthread_mutex_unlock(&flushLock);
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_mark_dirty
+// Description  : Mark a line as modified; crossing the high watermark
+//                wakes the flusher, and only a shard with every line dirty
+//                is flushed down to the low watermark by the caller
+//
+// Inputs       : shard - the line's shard
+//                line - the modified line
+// Outputs      : 0 if successful, -1 if a flush failed
+
+static int fs3_cache_mark_dirty(FS3CacheShard *shard, struct cacheParts *line) {
+    if (!line->dirty) {
+        line->dirty = 1;
+        shard->dirtyCount++;
+    }
+    shard->stats.absorbed++;
+    if (shard->dirtyCount >= shard->size) {
+        return(fs3_cache_flush_to(shard, (shard->size * FS3_CACHE_DIRTY_LOW) / 100));
+    }
+    if ((shard->dirtyCount * 100 > shard->size * FS3_CACHE_DIRTY_HIGH) && !shard->flushWanted) {
+        shard->flushWanted = 1;
+        pthread_mutex_lock(&flushLock);
+        flushPending = 1;
+        pthread_cond_signal(&flushWork);
+        pthread_mutex_unlock(&flushLock);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_referenced
+// Description  : Note that a cached line was asked for, crediting the
+//                readahead that brought it in if it has not been used yet
+//
+// Inputs       : shard - the line's shard
+//                line - the line referenced
+// Outputs      : none
+
+static void fs3_cache_referenced(FS3CacheShard *shard, struct cacheParts *line) {
+    if (line->prefetched) {
+        line->prefetched = 0;
+        shard->stats.prefetchHits++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_insert
+// Description  : Store a sector in a line chosen by the policy, ejecting
+//                whatever the line held.  A dirty line that cannot be
+//                written back keeps its sector, it holds the only copy
+//
+// Inputs       : shard - the sector's shard
+//                trk - the track number of the sector
+//                sct - the sector number of the sector
+//                buf - slab sector buffer, owned by the cache on success
+//                filled - where to store the filled line, NULL if no line
+//                         could be freed
+// Outputs      : 0 if successful, -1 if writing back the old sector failed
+
+static int fs3_cache_insert(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct, void *buf,
+                            struct cacheParts **filled) {
+    struct cacheParts *line;
+    FS3CacheEvictReason reason;
+    uint32_t bucket;
+    uint64_t start = fs3_cache_now();
+
+    *filled = NULL;
+    if ((line = policy->place(shard, trk, sct)) == NULL) {
+        return(0);
+    }
+    if (line->buffer != NULL) {
+        reason = line->prefetched ? FS3_EVICT_PREFETCH : (line->dirty ? FS3_EVICT_DIRTY : FS3_EVICT_CLEAN);
+        if (line->dirty && (fs3_cache_writeback(shard, line) == -1)) {
+            policy->unplace(shard, line);
+            return(-1);
+        }
+        fs3_cache_evicted(shard, line, reason);
+        if (line->prefetched) {
+            line->prefetched = 0;
+            __atomic_fetch_add(&shard->stats.prefetchWasted, 1, __ATOMIC_RELAXED);
+        }
+        fs3_cache_unhash(shard, line);
+        fs3_slab_free(line->buffer);
+        shard->count--;
+    }
+
+    // Fill the line and hand it back to the policy
+    bucket = FS3_CACHE_HASH(FS3_CACHE_KEY(trk, sct), shard->bits);
+    line->track = trk;
+    line->sector = sct;
+    line->buffer = buf;
+    line->hashNext = shard->table[bucket];
+    shard->table[bucket] = line;
+    shard->count++;
+    policy->insert(shard, line);
+    if (fs3_cache_stats(shard) != NULL) {
+        FS3CacheStats *stats = fs3_cache_stats(shard);
+        line->inserted = __atomic_load_n(&cacheClock, __ATOMIC_RELAXED);
+        fs3_cache_timed(stats->insertNs, &stats->inserts, &stats->insertTotalNs, start);
+    }
+    *filled = line;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_find_detached
+// Description  : Find a pinned sector that is held outside the cache
+//
+// Inputs       : shard - the sector's shard
+//                trk - the track number of the sector to find
+//                sct - the sector number of the sector to find
+// Outputs      : pointer to the line if found, NULL otherwise
+
+static struct cacheParts *fs3_cache_find_detached(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    FS3CacheNode *node;
+
+    for (node = shard->detachedLines.head; node != NULL; node = node->next) {
+        struct cacheParts *line = FS3_CACHE_ENTRY(node, struct cacheParts, link);
+        if ((line->track == trk) && (line->sector == sct)) {
+            return(line);
+        }
+    }
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_mode
+// Description  : Select write-through or write-back for the next init
+//
+// Inputs       : mode - the write mode to use
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_cache_mode(FS3CacheMode mode) {
+    if ((mode != FS3_CACHE_WRITETHROUGH) && (mode != FS3_CACHE_WRITEBACK)) {
+        return(-1);
+    }
+    cacheMode = mode;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_shards
+// Description  : Select how many independently locked shards the next init
+//                splits the cache into
+//
+// Inputs       : shards - a power of two up to FS3_CACHE_MAX_SHARDS
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_cache_shards(int shards) {
+    if ((shards < 1) || (shards > FS3_CACHE_MAX_SHARDS) || (shards & (shards - 1))) {
+        return(-1);
+    }
+    cacheShardsWanted = shards;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_writer
+// Description  : Register the function used to write dirty sectors back
+//
+// Inputs       : writer - the write-back function (NULL to clear)
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_cache_writer(FS3CacheWriter writer) {
+    cacheWriter = writer;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_reader
+// Description  : Register the function used to read in sectors being pinned
+//
+// Inputs       : reader - the read function (NULL to clear)
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_cache_reader(FS3CacheReader reader) {
+    cacheReader = reader;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_flush
+// Description  : Write back all dirty sectors in track order across every
+//                shard, called with all of the shard locks held
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_cache_flush(void) {
+    int count = 0, result = 0;
+
+    for (int i = 0; i < cacheSize; i++) {
+        if ((CACHE[i].buffer != NULL) && CACHE[i].dirty) {
+            flushList[count++] = &CACHE[i];
+        }
+    }
+    qsort(flushList, count, sizeof(struct cacheParts *), fs3_cache_key_order);
+    for (int i = 0; i < count; i++) {
+        if (fs3_cache_writeback(fs3_cache_shard(flushList[i]->track, flushList[i]->sector), flushList[i]) == -1) {
+            result = -1;
+        }
+    }
+    for (int i = 0; i < shardCount; i++) {
+        cacheShards[i].flushKey = 0;
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_flush_cache
+// Description  : Locked entry point for fs3_cache_flush
+//
+// Inputs       : as fs3_cache_flush
+// Outputs      : as fs3_cache_flush
+
+int fs3_flush_cache(void) {
+    int result;
+
+    fs3_cache_lock_all(1);
+    result = fs3_cache_flush();
+    fs3_cache_lock_all(0);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_flush_cache_run
+// Description  : Write back the dirty sectors of a run on one track, such
+//                as an extent of a file being closed.  Short runs are
+//                looked up a sector at a time, long ones by scanning the
+//                lines
+//
+// Inputs       : trk - the track of the run
+//                sct - the first sector of the run
+//                count - the number of sectors in the run
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_flush_cache_run(FS3TrackIndex trk, FS3SectorIndex sct, int count) {
+    struct cacheParts *line;
+    int result = 0;
+
+    if (cacheSize == 0) {
+        return(0);
+    }
+    if (count > cacheSize) {
+        fs3_cache_lock_all(1);
+        for (int i = 0; i < cacheSize; i++) {
+            line = &CACHE[i];
+            if ((line->buffer != NULL) && line->dirty && (line->track == trk) &&
+                    (line->sector >= sct) && (line->sector < sct + count) &&
+                    (fs3_cache_writeback(fs3_cache_shard(trk, line->sector), line) == -1)) {
+                result = -1;
+            }
+        }
+        fs3_cache_lock_all(0);
+        return(result);
+    }
+    for (int s = sct; s < sct + count; s++) {
+        FS3CacheShard *shard = fs3_cache_shard(trk, s);
+        pthread_mutex_lock(&shard->lock);
+        line = (shard->size > 0) ? fs3_cache_find(shard, trk, s) : NULL;
+        if ((line != NULL) && line->dirty && (fs3_cache_writeback(shard, line) == -1)) {
+            result = -1;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_policy
+// Description  : Select the replacement policy used by the next init
+//
+// Inputs       : newPolicy - the policy to use
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_cache_policy(FS3CachePolicy newPolicy) {
+    if ((newPolicy < 0) || (newPolicy >= FS3_CACHE_MAXPOLICY)) {
+        return(-1);
+    }
+    cachePolicy = newPolicy;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_policy_by_name
+// Description  : Look up a replacement policy by its name
+//
+// Inputs       : name - the policy name (case insensitive)
+// Outputs      : the policy, -1 if there is no such policy
 
+int fs3_cache_policy_by_name(const char *name) {
+    for (int i = 0; i < FS3_CACHE_MAXPOLICY; i++) {
+        if (strcasecmp(name, fs3CachePolicies[i]->name) == 0) {
+            return(i);
+        }
+    }
+    return(-1);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_policy_name
+// Description  : Get the name of a replacement policy
+//
+// Inputs       : which - the policy
+// Outputs      : the policy name
 
+const char * fs3_cache_policy_name(FS3CachePolicy which) {
+    if ((which < 0) || (which >= FS3_CACHE_MAXPOLICY)) {
+        return("unknown");
+    }
+    return(fs3CachePolicies[which]->name);
+}
 
+////////////////////////////////////////////////////////////////////////////////
 //
-// Implementation
+// Function     : fs3_cache_release
+// Description  : Free every line buffer and the shards' tables and policy
+//                state, leaving each shard empty
+//
+// Inputs       : none
+// Outputs      : none
+
+static void fs3_cache_release(void) {
+    for (int i = 0; i < shardCount; i++) {
+        FS3CacheShard *shard = &cacheShards[i];
+        for (int j = 0; j < shard->size; j++) {
+            if (shard->lines[j].buffer != NULL) {
+                fs3_cache_evicted(shard, &shard->lines[j], FS3_EVICT_CLOSE);
+            }
+            fs3_slab_free(shard->lines[j].buffer);
+            shard->lines[j].buffer = NULL;
+        }
+        if (shard->size > 0) {
+            policy->close(shard);
+        }
+        free(shard->table);
+        shard->table = NULL;
+        shard->lines = NULL;
+        shard->flushList = NULL;
+        memset(&shard->freeLines, 0x0, sizeof(shard->freeLines));
+        shard->size = 0;
+        shard->count = 0;
+        shard->dirtyCount = 0;
+    }
+    free(CACHE);
+    free(flushList);
+    free(cacheLastRef);
+    CACHE = NULL;
+    flushList = NULL;
+    cacheLastRef = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_stop_flusher
+// Description  : Stop the flusher thread, if it is running, and wait for it
+//
+// Inputs       : none
+// Outputs      : none
+
+static void fs3_cache_stop_flusher(void) {
+    if (!flushRunning) {
+        return;
+    }
+    pthread_mutex_lock(&flushLock);
+    flushStop = 1;
+    pthread_cond_signal(&flushWork);
+    pthread_mutex_unlock(&flushLock);
+    pthread_join(flushThread, NULL);
+    flushRunning = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_stats_init
+// Description  : Drop the statistics of the last cache and, if detailed
+//                stats were asked for, allocate them for the shards of the
+//                cache being opened
+//
+// Inputs       : cachelines - the number of lines in the cache
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_cache_stats_init(int cachelines) {
+    for (int i = 0; i < FS3_CACHE_MAX_SHARDS; i++) {
+        free(cacheStats[i]);
+        cacheStats[i] = NULL;
+    }
+    free(cacheLastRef);
+    cacheLastRef = NULL;
+    cacheClock = 0;
+    statsLines = cachelines;
+    if (!cacheStatsWanted) {
+        return(0);
+    }
+
+    cacheLastRef = (uint64_t *)calloc((size_t)FS3_MAX_TRACKS * FS3_TRACK_SIZE, sizeof(uint64_t));
+    for (int i = 0; (i < shardCount) && (cacheLastRef != NULL); i++) {
+        if ((cacheStats[i] = (FS3CacheStats *)calloc(1, sizeof(FS3CacheStats))) == NULL) {
+            free(cacheLastRef);
+            cacheLastRef = NULL;
+        }
+    }
+    if (cacheLastRef == NULL) {
+        for (int i = 0; i < shardCount; i++) {
+            free(cacheStats[i]);
+            cacheStats[i] = NULL;
+        }
+        return(-1);
+    }
+    return(0);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_init_cache
-// Description  : Initialize the cache with a fixed number of cache lines
+// Description  : Initialize the cache with a fixed number of cache lines,
+//                dealt out evenly to the shards
 //
 // Inputs       : cachelines - the number of cache lines to include in cache
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_init_cache(uint16_t cachelines) {
-    CACHE = (struct cacheParts *)malloc(cachelines * sizeof(struct cacheParts));
-    if (cachelines > 0)
-    {
-        for(int i = 0; i<cachelines; i++){
-        CACHE[i].sector=0;
-        CACHE[i].track=0;
-        CACHE[i].timeStamp=0;
-        CACHE[i].buffer= (void *)malloc(FS3_SECTOR_SIZE);
-        CACHE[i].used = F;
-        }
-    }    
+    int next = 0;
+
+    fs3_cache_stop_flusher();   // of a cache that was never closed
+
+    // Never more shards than lines, so that every shard can cache something
+    shardCount = cacheShardsWanted;
+    while ((shardCount > 1) && (shardCount > cachelines)) {
+        shardCount /= 2;
+    }
+    shardMask = shardCount - 1;
     cacheSize = cachelines;
+    CACHE = NULL;
+    flushList = NULL;
+    policy = fs3CachePolicies[cachePolicy];
+    openMode = cacheMode;
+    for (int i = 0; i < shardCount; i++) {
+        // Everything after the lock, which stays initialized
+        memset((char *)&cacheShards[i] + offsetof(FS3CacheShard, lines), 0x0,
+               sizeof(FS3CacheShard) - offsetof(FS3CacheShard, lines));
+    }
+    if (fs3_cache_stats_init(cachelines) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failed allocating cache statistics");
+        return(-1);
+    }
+    if (cachelines == 0) {
+        return(0);
+    }
+
+    CACHE = (struct cacheParts *)calloc(cachelines, sizeof(struct cacheParts));
+    flushList = (struct cacheParts **)calloc(cachelines, sizeof(struct cacheParts *));
+    if (fs3_slab_init(cachelines) == -1) {  // map the lines' buffers up front
+        logMessage(LOG_ERROR_LEVEL, "Failed mapping buffers for %d cache lines", cachelines);
+        fs3_cache_release();
+        cacheSize = 0;
+        return(-1);
+    }
+    for (int i = 0; (i < shardCount) && (CACHE != NULL) && (flushList != NULL); i++) {
+        FS3CacheShard *shard = &cacheShards[i];
+        shard->lines = &CACHE[next];
+        shard->flushList = &flushList[next];
+        shard->size = cachelines / shardCount + (i < cachelines % shardCount);
+
+        // Keep the table at most half full so chains stay short
+        shard->bits = 1;
+        while ((1 << shard->bits) < (2 * shard->size)) {
+            shard->bits++;
+        }
+        shard->table = (struct cacheParts **)calloc(1 << shard->bits, sizeof(struct cacheParts *));
+        if ((shard->table == NULL) || (policy->init(shard) == -1)) {
+            break;
+        }
+        for (int j = shard->size - 1; j >= 0; j--) {
+            fs3_cache_list_push(&shard->freeLines, &shard->lines[j].link);
+        }
+        next += shard->size;
+    }
+    if (next < cachelines) {
+        logMessage(LOG_ERROR_LEVEL, "Failed allocating cache of %d lines", cachelines);
+        fs3_cache_release();
+        cacheSize = 0;
+        return(-1);
+    }
+
+    // Only a write-back cache has dirty lines to flush
+    if (openMode == FS3_CACHE_WRITEBACK) {
+        flushStop = 0;
+        flushPending = 0;
+        if (pthread_create(&flushThread, NULL, fs3_cache_flusher, NULL) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Failed starting the cache flusher");
+            fs3_cache_release();
+            cacheSize = 0;
+            return(-1);
+        }
+        flushRunning = 1;
+    }
     return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_close_cache
-// Description  : Close the cache, freeing any buffers held in it
+// Description  : Close the cache, stopping the flusher and freeing any
+//                buffers held in it
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_close_cache(void)  {
-    if (cacheSize>0){
-        for(int i=0; i<cacheSize-1;i++){
-        CACHE[i].sector=0;
-        CACHE[i].track=0;
-        CACHE[i].timeStamp=0;
-        free(CACHE[i].buffer);
-        CACHE[i].buffer=NULL;
-        
-        }
-        free(CACHE);
-    }
-    
-    return(0);
+    int result;
+    FS3CacheNode *node;
+
+    fs3_cache_stop_flusher();
+    fs3_cache_lock_all(1);
+    result = fs3_cache_flush();
+    for (int i = 0; i < shardCount; i++) {
+        while ((node = fs3_cache_list_pop(&cacheShards[i].detachedLines)) != NULL) {
+            struct cacheParts *line = FS3_CACHE_ENTRY(node, struct cacheParts, link);
+            fs3_slab_free(line->buffer);
+            free(line);
+        }
+    }
+    fs3_cache_release();
+    cacheSize = 0;
+    fs3_cache_lock_all(0);
+    return(result);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_put_cache
-// Description  : Put an element in the cache
+// Function     : fs3_cache_put
+// Description  : Put an element in the cache, the cache takes ownership of
+//                the buffer and frees it when the line is evicted.  Called
+//                with the shard lock held
 //
-// Inputs       : trk - the track number of the sector to put in cache
+// Inputs       : shard - the sector's shard
+//                trk - the track number of the sector to put in cache
 //                sct - the sector number of the sector to put in cache
+//                buf - sector buffer from fs3_slab_alloc to insert
 // Outputs      : 0 if inserted, -1 if not inserted
 
-int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
-    int index;
-    int full =1;
-    if (cacheSize>0){       // make sure the size of the cache isn't 0
-        if(cacheCount<cacheSize){cacheCount+=1;}    // increase number of items in cache until equal to cachelines
-        // determine if cache is full //
-        if(cacheCount<cacheSize){
-            for(int i=0; i<cacheSize-1;i++){
-                if(CACHE[i].used==F){
-                    index = i;
-                    CACHE[i].used = T;
-                    full = 0;
-                }
-                if(full==0){break;}
-            }
-            CACHE[index].sector=sct;
-            CACHE[index].track=trk;
-            CACHE[index].timeStamp=Attempts;
-            CACHE[index].buffer=buf;
-        }
-        // remove LRU //
-        if(cacheCount == cacheSize){
-            int oldest = CACHE[cacheSize-1].timeStamp;
-            for(int j=0; j<cacheSize-1;j++){
-                if(CACHE[j].timeStamp < oldest){
-                    oldest = CACHE[j].timeStamp;
-                    index = j;
-                }
+static int fs3_cache_put(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    struct cacheParts *line;
+
+    if ((shard->size == 0) || (buf == NULL)) {
+        return(-1);
+    }
+
+    // Already cached, swap in the new buffer (copy into it while pinned)
+    if ((line = fs3_cache_find(shard, trk, sct)) != NULL) {
+        if (line->pins > 0) {
+            if (line->buffer != buf) {
+                memcpy(line->buffer, buf, FS3_SECTOR_SIZE);
+                fs3_slab_free(buf);
             }
-            //free(CACHE[index].buffer);
-            CACHE[index].buffer = buf;
-            CACHE[index].sector=sct;
-            CACHE[index].track = trk;
-            CACHE[index].timeStamp=Attempts;
+            return(0);
+        }
+        if (line->buffer != buf) {
+            fs3_slab_free(line->buffer);
+            line->buffer = buf;
         }
-        // assign values to cache //
-        
+        policy->touch(shard, line);
+        return(0);
     }
-    
-    //fs3_log_cache_metrics();
-    return(0);
+    if (fs3_cache_insert(shard, trk, sct, buf, &line) == -1) {
+        return(-1);
+    }
+    return((line == NULL) ? -1 : 0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_get_cache
-// Description  : Get an element from the cache (
+// Function     : fs3_put_cache
+// Description  : Locked entry point for fs3_cache_put
 //
-// Inputs       : trk - the track number of the sector to find
+// Inputs       : as fs3_cache_put
+// Outputs      : as fs3_cache_put
+
+int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    FS3CacheShard *shard = fs3_cache_shard(trk, sct);
+    int result;
+
+    pthread_mutex_lock(&shard->lock);
+    result = fs3_cache_put(shard, trk, sct, buf);
+    pthread_mutex_unlock(&shard->lock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_get
+// Description  : Get an element from the cache, called with the shard
+//                lock held; the buffer may be evicted once it is dropped
+//
+// Inputs       : shard - the sector's shard
+//                trk - the track number of the sector to find
 //                sct - the sector number of the sector to find
 // Outputs      : returns NULL if not found or failed, pointer to buffer if found
 
-void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct)  {
-    //int index;
-    void *wanted;
-    if(cacheSize>0){
-        int inCache =0;
-        Attempts+=1;
-        
-        //wanted = NULL;
-        for(int i=0; i<cacheCount-1;i++){
-            if((CACHE[i].sector==sct)&&(CACHE[i].track==trk)){
-                Hits+=1;
-                inCache=1;
-                CACHE[i].timeStamp=Attempts;
-                wanted = CACHE[i].buffer;
-                //fs3_log_cache_metrics();
-                //return(CACHE[i].buffer);
+static void * fs3_cache_get(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    struct cacheParts *line;
+
+    if (shard->size == 0) {
+        return(NULL);
+    }
+    shard->stats.attempts++;
+    line = fs3_cache_lookup(shard, trk, sct);
+    fs3_cache_account(shard, trk, sct, line != NULL);
+    if (line == NULL) {
+        shard->stats.misses++;
+        return(NULL);
+    }
+    shard->stats.hits++;
+    fs3_cache_referenced(shard, line);
+    if (line->pins == 0) {
+        policy->touch(shard, line);
+    }
+    return(line->buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_get_cache
+// Description  : Locked entry point for fs3_cache_get
+//
+// Inputs       : as fs3_cache_get
+// Outputs      : as fs3_cache_get
+
+void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct) {
+    FS3CacheShard *shard = fs3_cache_shard(trk, sct);
+    void *result;
+
+    pthread_mutex_lock(&shard->lock);
+    result = fs3_cache_get(shard, trk, sct);
+    pthread_mutex_unlock(&shard->lock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_pin
+// Description  : Get a reference to a sector's buffer, reading it in on a
+//                miss; the line cannot be evicted until it is unpinned.
+//                Called with the shard lock held
+//
+// Inputs       : shard - the sector's shard
+//                trk - the track number of the sector
+//                sct - the sector number of the sector
+//                mode - FS3_PIN_WRITE if the caller will modify the buffer,
+//                       FS3_PIN_OVERWRITE if it replaces all of the contents
+//                       (a miss then gets a zeroed buffer, not a disk read)
+// Outputs      : pointer to the sector buffer, NULL if failure
+
+static void * fs3_cache_pin(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct, FS3PinMode mode) {
+    struct cacheParts *line = NULL;
+    void *buf;
+
+    // Already in memory, either cached or pinned outside the cache
+    if (shard->size > 0) {
+        shard->stats.attempts++;
+        line = fs3_cache_lookup(shard, trk, sct);
+    }
+    if (line == NULL) {
+        line = fs3_cache_find_detached(shard, trk, sct);
+    }
+    if (shard->size > 0) {
+        fs3_cache_account(shard, trk, sct, line != NULL);
+    }
+    if (line != NULL) {
+        if (shard->size > 0) {
+            shard->stats.hits++;
+        }
+        fs3_cache_referenced(shard, line);
+        if ((line->pins == 0) && !line->detached) {
+            policy->unlink(shard, line);
+        }
+        line->pins++;
+        line->pinWrite |= (mode != FS3_PIN_READ);
+        return(line->buffer);
+    }
+
+    // Read it in and cache it, or hold it aside if nothing can be evicted
+    if (shard->size > 0) {
+        shard->stats.misses++;
+    }
+    if (((cacheReader == NULL) && (mode != FS3_PIN_OVERWRITE)) || ((buf = fs3_slab_alloc()) == NULL)) {
+        return(NULL);
+    }
+    if (mode == FS3_PIN_OVERWRITE) {
+        memset(buf, 0x0, FS3_SECTOR_SIZE);
+        shard->stats.overwrites++;
+    } else if (cacheReader(trk, sct, buf) == -1) {
+        fs3_slab_free(buf);
+        return(NULL);
+    }
+    if ((shard->size > 0) && (fs3_cache_insert(shard, trk, sct, buf, &line) == -1)) {
+        fs3_slab_free(buf);
+        return(NULL);
+    }
+    if (line != NULL) {
+        policy->unlink(shard, line);
+    } else {
+        if ((line = (struct cacheParts *)calloc(1, sizeof(struct cacheParts))) == NULL) {
+            fs3_slab_free(buf);
+            return(NULL);
+        }
+        line->track = trk;
+        line->sector = sct;
+        line->buffer = buf;
+        line->detached = 1;
+        fs3_cache_list_push(&shard->detachedLines, &line->link);
+    }
+    line->pins = 1;
+    line->pinWrite = (mode != FS3_PIN_READ);
+    return(line->buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_pin_sector
+// Description  : Locked entry point for fs3_cache_pin
+//
+// Inputs       : as fs3_cache_pin
+// Outputs      : as fs3_cache_pin
+
+void * fs3_pin_sector(FS3TrackIndex trk, FS3SectorIndex sct, FS3PinMode mode) {
+    FS3CacheShard *shard = fs3_cache_shard(trk, sct);
+    void *result;
+
+    pthread_mutex_lock(&shard->lock);
+    result = fs3_cache_pin(shard, trk, sct, mode);
+    pthread_mutex_unlock(&shard->lock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_prefetch
+// Description  : Read a sector into the cache ahead of it being asked for;
+//                it is counted as a hit only if something references it
+//                before it is evicted.  Called with the shard lock held
+//
+// Inputs       : shard - the sector's shard
+//                trk - the track number of the sector
+//                sct - the sector number of the sector
+// Outputs      : 0 if the sector is (now) cached, -1 if failure
+
+static int fs3_cache_prefetch(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    struct cacheParts *line;
+    void *buf;
+
+    if ((shard->size == 0) || (cacheReader == NULL)) {
+        return(-1);
+    }
+    if ((fs3_cache_find(shard, trk, sct) != NULL) || (fs3_cache_find_detached(shard, trk, sct) != NULL)) {
+        return(0);
+    }
+    if ((buf = fs3_slab_alloc()) == NULL) {
+        return(-1);
+    }
+    if ((cacheReader(trk, sct, buf) == -1) || (fs3_cache_insert(shard, trk, sct, buf, &line) == -1) ||
+            (line == NULL)) {
+        fs3_slab_free(buf);
+        return(-1);
+    }
+    line->prefetched = 1;
+    shard->stats.prefetched++;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_prefetch_sector
+// Description  : Locked entry point for fs3_cache_prefetch
+//
+// Inputs       : as fs3_cache_prefetch
+// Outputs      : as fs3_cache_prefetch
+
+int fs3_prefetch_sector(FS3TrackIndex trk, FS3SectorIndex sct) {
+    FS3CacheShard *shard = fs3_cache_shard(trk, sct);
+    int result;
+
+    pthread_mutex_lock(&shard->lock);
+    result = fs3_cache_prefetch(shard, trk, sct);
+    pthread_mutex_unlock(&shard->lock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_prefetch_wasted
+// Description  : Get the number of read ahead sectors evicted unreferenced,
+//                used to shrink the readahead window
+//
+// Inputs       : none
+// Outputs      : the count so far
+
+int fs3_prefetch_wasted(void) {
+    int wasted = 0;
+
+    for (int i = 0; i < shardCount; i++) {
+        wasted += __atomic_load_n(&cacheShards[i].stats.prefetchWasted, __ATOMIC_RELAXED);
+    }
+    return(wasted);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_lines
+// Description  : Get the number of lines in the open cache
+//
+// Inputs       : none
+// Outputs      : the number of lines
+
+int fs3_cache_lines(void) {
+    return(cacheSize);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_unpin
+// Description  : Drop a reference taken by fs3_pin_sector; when the last
+//                writer lets go the sector is dirtied (write-back) or
+//                written to disk (write-through).  A write-through that
+//                fails drops the line, whose contents the disk does not
+//                have.  Called with the shard lock held
+//
+// Inputs       : shard - the sector's shard
+//                trk - the track number of the sector
+//                sct - the sector number of the sector
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_cache_unpin(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    struct cacheParts *line = NULL;
+    int result = 0, written;
+
+    if (shard->size > 0) {
+        line = fs3_cache_find(shard, trk, sct);
+    }
+    if (line == NULL) {
+        line = fs3_cache_find_detached(shard, trk, sct);
+    }
+    if ((line == NULL) || (line->pins == 0)) {
+        return(-1);
+    }
+    if (--line->pins > 0) {
+        return(0);
+    }
+
+    // Last reference, publish any modification
+    written = line->pinWrite;
+    line->pinWrite = 0;
+    if (line->detached) {
+        if (written && ((cacheWriter == NULL) || (cacheWriter(trk, sct, line->buffer) == -1))) {
+            result = -1;
+        }
+        fs3_cache_list_remove(&shard->detachedLines, &line->link);
+        fs3_slab_free(line->buffer);
+        free(line);
+        return(result);
+    }
+    policy->relink(shard, line);
+    if (written) {
+        if ((openMode == FS3_CACHE_WRITEBACK) && (cacheWriter != NULL)) {
+            result = fs3_cache_mark_dirty(shard, line);
+        } else if ((cacheWriter == NULL) || (cacheWriter(trk, sct, line->buffer) == -1)) {
+            fs3_cache_invalidate(shard, line);
+            result = -1;
+        }
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_unpin_sector
+// Description  : Locked entry point for fs3_cache_unpin
+//
+// Inputs       : as fs3_cache_unpin
+// Outputs      : as fs3_cache_unpin
+
+int fs3_unpin_sector(FS3TrackIndex trk, FS3SectorIndex sct) {
+    FS3CacheShard *shard = fs3_cache_shard(trk, sct);
+    int result;
+
+    pthread_mutex_lock(&shard->lock);
+    result = fs3_cache_unpin(shard, trk, sct);
+    pthread_mutex_unlock(&shard->lock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_sum_stats
+// Description  : Sum the shards' counters, one shard lock at a time
+//
+// Inputs       : total - where to put the summed counters
+//                detail - where to put the summed detailed stats (NULL if
+//                         not wanted), zeroed if they are not kept
+//                resident - where to put the count of read ahead sectors
+//                           still cached and not yet referenced
+// Outputs      : 1 if detailed stats are kept, 0 if not
+
+static int fs3_cache_sum_stats(FS3CacheShardStats *total, FS3CacheStats *detail, int *resident) {
+    int detailed = 0;
+
+    memset(total, 0x0, sizeof(*total));
+    if (detail != NULL) {
+        memset(detail, 0x0, sizeof(*detail));
+    }
+    *resident = 0;
+    for (int i = 0; i < shardCount; i++) {
+        FS3CacheShard *shard = &cacheShards[i];
+        pthread_mutex_lock(&shard->lock);
+        total->hits += shard->stats.hits;
+        total->misses += shard->stats.misses;
+        total->attempts += shard->stats.attempts;
+        total->absorbed += shard->stats.absorbed;
+        total->writebacks += shard->stats.writebacks;
+        total->overwrites += shard->stats.overwrites;
+        total->prefetched += shard->stats.prefetched;
+        total->prefetchHits += shard->stats.prefetchHits;
+        total->prefetchWasted += shard->stats.prefetchWasted;
+        for (int j = 0; j < shard->size; j++) {
+            *resident += (shard->lines[j].buffer != NULL) && shard->lines[j].prefetched;
+        }
+        if (cacheStats[i] != NULL) {
+            detailed = 1;
+            if (detail != NULL) {
+                const uint64_t *from = (const uint64_t *)cacheStats[i];
+                uint64_t *to = (uint64_t *)detail;
+                for (size_t w = 0; w < sizeof(FS3CacheStats) / sizeof(uint64_t); w++) {
+                    to[w] += from[w];
+                }
             }
-            if(inCache==1){break;}
         }
-        if(inCache==0){
-            Misses+=1;
-            wanted=NULL;
-        //fs3_log_cache_metrics();
-            //return(NULL);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return(detailed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_hist_median
+// Description  : Get the bucket holding the median of a histogram
+//
+// Inputs       : hist - the histogram
+// Outputs      : the upper bound of the bucket, 0 if the histogram is empty
+
+static uint64_t fs3_cache_hist_median(const uint64_t *hist) {
+    uint64_t count = 0, seen = 0;
+
+    for (int b = 0; b < FS3_CACHE_HIST_BUCKETS; b++) {
+        count += hist[b];
+    }
+    for (int b = 0; b < FS3_CACHE_HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if ((count > 0) && (seen * 2 >= count)) {
+            return((b == 0) ? 0 : (1ULL << b) - 1);
         }
     }
-    return(wanted);
+    return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_log_cache_metrics
-// Description  : Log the metrics for the cache 
+// Description  : Log the metrics for the cache
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_log_cache_metrics(void) {
+    FS3CacheShardStats total;
+    FS3CacheStats *detail;
+    int resident, detailed;
+
+    if ((detail = (FS3CacheStats *)malloc(sizeof(FS3CacheStats))) == NULL) {
+        return(-1);
+    }
+    detailed = fs3_cache_sum_stats(&total, detail, &resident);
+
     // calculate hit ratio //
-    double atmp = Hits+Misses;
-    HitRatio = Hits/atmp;
-    HitRatio *= 100;
-    logMessage(FS3DriverLLevel,"\nHits: %.0f\nMisses: %.0f\nAttemts: %d\nHit Ratio: %.2f percent",Hits, Misses, Attempts, HitRatio);
+    double atmp = total.hits + total.misses;
+    double hitRatio = (atmp > 0) ? (total.hits / atmp) * 100 : 0;
+    logMessage(FS3DriverLLevel,"\nPolicy: %s (%d lines, %d shards, %s)\nHits: %lu\nMisses: %lu\nAttemts: %lu\nHit Ratio: %.2f percent",
+        (policy != NULL) ? policy->name : "none", cacheSize, shardCount,
+        (openMode == FS3_CACHE_WRITEBACK) ? "write-back" : "write-through", (unsigned long)total.hits,
+        (unsigned long)total.misses, (unsigned long)total.attempts, hitRatio);
+    if (openMode == FS3_CACHE_WRITEBACK) {
+        logMessage(FS3DriverLLevel,"\nAbsorbed writes: %lu\nWrite-backs: %lu",
+            (unsigned long)total.absorbed, (unsigned long)total.writebacks);
+    }
+    logMessage(FS3DriverLLevel,"\nOverwrites (no read): %lu", (unsigned long)total.overwrites);
+    if (total.prefetched > 0) {
+        logMessage(FS3DriverLLevel,"\nPrefetched: %lu\nPrefetch hits: %lu\nPrefetched unused: %d evicted, %d still cached",
+            (unsigned long)total.prefetched, (unsigned long)total.prefetchHits, total.prefetchWasted, resident);
+    }
+    if (detailed) {
+        logMessage(FS3DriverLLevel,"\nEvictions: %lu clean, %lu dirty, %lu unused prefetch (median age < %lu references)"
+            "\nReuse distance: %lu first references, median < %lu references"
+            "\nLookup: %.0f ns mean, Insert: %.0f ns mean",
+            (unsigned long)detail->evictions[FS3_EVICT_CLEAN], (unsigned long)detail->evictions[FS3_EVICT_DIRTY],
+            (unsigned long)detail->evictions[FS3_EVICT_PREFETCH], (unsigned long)fs3_cache_hist_median(detail->evictAge) + 1,
+            (unsigned long)detail->coldRefs, (unsigned long)fs3_cache_hist_median(detail->reuse) + 1,
+            (detail->lookups > 0) ? (double)detail->lookupTotalNs / detail->lookups : 0.0,
+            (detail->inserts > 0) ? (double)detail->insertTotalNs / detail->inserts : 0.0);
+    }
+    free(detail);
+    return(fs3_log_slab_metrics());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_stats
+// Description  : Select whether the next init keeps detailed statistics
+//
+// Inputs       : detailed - non-zero to keep them
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_cache_stats(int detailed) {
+    cacheStatsWanted = (detailed != 0);
     return(0);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_owner
+// Description  : Attribute the calling thread's references to a file, so
+//                the detailed stats can count hits and misses per file
+//
+// Inputs       : owner - the file (-1 for none)
+// Outputs      : the previous owner
+
+int fs3_set_cache_owner(int owner) {
+    int previous = cacheOwner;
+
+    cacheOwner = owner;
+    return(previous);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_json_hist
+// Description  : Write a histogram as a JSON array of its non-empty buckets
+//
+// Inputs       : out - the file
+//                name - the key of the array
+//                hist - the histogram
+// Outputs      : none
+
+static void fs3_cache_json_hist(FILE *out, const char *name, const uint64_t *hist) {
+    const char *sep = "";
+
+    fprintf(out, ",\n  \"%s\": [", name);
+    for (int b = 0; b < FS3_CACHE_HIST_BUCKETS; b++) {
+        if (hist[b] > 0) {
+            fprintf(out, "%s{\"min\": %llu, \"max\": %llu, \"count\": %llu}", sep,
+                    (b == 0) ? 0ULL : 1ULL << (b - 1), (b == 0) ? 0ULL : (1ULL << b) - 1,
+                    (unsigned long long)hist[b]);
+            sep = ", ";
+        }
+    }
+    fprintf(out, "]");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_stats_dump
+// Description  : Write the cache counters and, if they are kept, the
+//                detailed statistics to a file as one JSON object
+//
+// Inputs       : path - the file to write ("-" for stdout)
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_cache_stats_dump(const char *path) {
+    FS3CacheShardStats total;
+    FS3CacheStats *detail;
+    FILE *out;
+    const char *sep = "";
+    int resident, detailed, result;
+
+    if ((detail = (FS3CacheStats *)malloc(sizeof(FS3CacheStats))) == NULL) {
+        return(-1);
+    }
+    if ((out = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failed opening cache statistics file [%s]", path);
+        free(detail);
+        return(-1);
+    }
+    detailed = fs3_cache_sum_stats(&total, detail, &resident);
+
+    fprintf(out, "{\n  \"policy\": \"%s\", \"lines\": %d, \"shards\": %d, \"mode\": \"%s\",\n",
+            (policy != NULL) ? policy->name : "none", statsLines, shardCount,
+            (openMode == FS3_CACHE_WRITEBACK) ? "write-back" : "write-through");
+    fprintf(out, "  \"hits\": %llu, \"misses\": %llu, \"attempts\": %llu, \"absorbed\": %llu, "
+            "\"writebacks\": %llu, \"overwrites\": %llu,\n  \"prefetched\": %llu, \"prefetchHits\": %llu, "
+            "\"prefetchWasted\": %d, \"prefetchResident\": %d,\n  \"detailed\": %s",
+            (unsigned long long)total.hits, (unsigned long long)total.misses, (unsigned long long)total.attempts,
+            (unsigned long long)total.absorbed, (unsigned long long)total.writebacks,
+            (unsigned long long)total.overwrites, (unsigned long long)total.prefetched,
+            (unsigned long long)total.prefetchHits, total.prefetchWasted, resident, detailed ? "true" : "false");
+    if (detailed) {
+        // Hits and misses of every track, as a heatmap
+        fprintf(out, ",\n  \"tracks\": [");
+        for (int t = 0; t < FS3_MAX_TRACKS; t++) {
+            fprintf(out, "%s{\"hits\": %llu, \"misses\": %llu}", (t == 0) ? "" : ", ",
+                    (unsigned long long)detail->trackHits[t], (unsigned long long)detail->trackMisses[t]);
+        }
+
+        // Files that were referenced, then what no file was named for
+        fprintf(out, "],\n  \"files\": [");
+        for (int f = 0; f < FS3_CACHE_MAX_OWNERS; f++) {
+            if ((detail->ownerHits[f] > 0) || (detail->ownerMisses[f] > 0)) {
+                fprintf(out, "%s{\"file\": %d, \"hits\": %llu, \"misses\": %llu}", sep, f,
+                        (unsigned long long)detail->ownerHits[f], (unsigned long long)detail->ownerMisses[f]);
+                sep = ", ";
+            }
+        }
+        fprintf(out, "],\n  \"unattributed\": {\"hits\": %llu, \"misses\": %llu}",
+                (unsigned long long)detail->ownerHits[FS3_CACHE_MAX_OWNERS],
+                (unsigned long long)detail->ownerMisses[FS3_CACHE_MAX_OWNERS]);
+
+        fprintf(out, ",\n  \"firstReferences\": %llu", (unsigned long long)detail->coldRefs);
+        fs3_cache_json_hist(out, "reuseDistance", detail->reuse);
+        fprintf(out, ",\n  \"evictions\": {");
+        for (int r = 0; r < FS3_EVICT_REASONS; r++) {
+            fprintf(out, "%s\"%s\": %llu", (r == 0) ? "" : ", ", cacheEvictNames[r],
+                    (unsigned long long)detail->evictions[r]);
+        }
+        fprintf(out, "}");
+        fs3_cache_json_hist(out, "evictionAge", detail->evictAge);
+        fprintf(out, ",\n  \"lookups\": %llu, \"lookupTotalNs\": %llu",
+                (unsigned long long)detail->lookups, (unsigned long long)detail->lookupTotalNs);
+        fs3_cache_json_hist(out, "lookupNs", detail->lookupNs);
+        fprintf(out, ",\n  \"inserts\": %llu, \"insertTotalNs\": %llu",
+                (unsigned long long)detail->inserts, (unsigned long long)detail->insertTotalNs);
+        fs3_cache_json_hist(out, "insertNs", detail->insertNs);
+    }
+    fprintf(out, "\n}\n");
+
+    result = ferror(out) ? -1 : 0;
+    if ((out != stdout) && (fclose(out) != 0)) {
+        result = -1;
+    }
+    if (result == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failed writing cache statistics file [%s]", path);
+    }
+    free(detail);
+    return(result);
+}
@@ -5,7 +5,9 @@
 //
 //  File           : fs3_cache.h
 //  Description    : This is the interface for the sector cache in the FS3
-//                   filesystem.
+//                   filesystem.  Calls may be made from several threads,
+//                   except init and close; the cache can be split into
+//                   shards by sector so that they rarely share a lock.
 //
 //  Author         : Patrick McDaniel
 //  Last Modified  : Sun 17 Oct 2021 09:36:52 AM EDT
@@ -16,6 +18,51 @@
 
 // Defines
 #define FS3_DEFAULT_CACHE_SIZE 0x8; // 8 cache entries, by default
+#define FS3_DEFAULT_CACHE_SHARDS 1  // One lock for the whole cache
+#define FS3_CACHE_MAX_SHARDS 64
+#define FS3_CACHE_MAX_OWNERS 1024   // Files references can be attributed to
+#define FS3_CACHE_HIST_BUCKETS 40   // Power-of-two buckets in a stats histogram
+
+// Replacement policies the cache can run with
+typedef enum {
+
+    FS3_CACHE_LRU    = 0,   // Least recently used (default)
+    FS3_CACHE_FIFO   = 1,   // First-in first-out
+    FS3_CACHE_DIRECT = 2,   // Direct mapped by disk sector address
+    FS3_CACHE_CLOCK  = 3,   // CLOCK (second chance)
+    FS3_CACHE_2Q     = 4,   // 2Q with A1in/A1out/Am queues
+    FS3_CACHE_ARC    = 5,   // Adaptive replacement cache
+    FS3_CACHE_MAXPOLICY = 6 // Number of policies
+
+} FS3CachePolicy;
+
+// How writes to cached sectors reach the disk
+typedef enum {
+
+    FS3_CACHE_WRITETHROUGH = 0, // Every write goes to the disk (default)
+    FS3_CACHE_WRITEBACK    = 1  // Writes dirty the line, flushed later
+
+} FS3CacheMode;
+
+// Write-back flusher watermarks, in percent of a shard's lines dirty; the
+// writer itself only flushes once every line is dirty
+#define FS3_CACHE_DIRTY_HIGH 75 // Wake the flusher thread above this
+#define FS3_CACHE_DIRTY_LOW  25 // The flusher stops at this
+
+// Function the cache uses to write a dirty sector back to disk
+typedef int (*FS3CacheWriter)(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+
+// Function the cache uses to read in a sector being pinned
+typedef int (*FS3CacheReader)(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+
+// What a pinner will do with the sector buffer
+typedef enum {
+
+    FS3_PIN_READ      = 0,  // Only read the buffer
+    FS3_PIN_WRITE     = 1,  // Modify the buffer, written/dirtied on unpin
+    FS3_PIN_OVERWRITE = 2   // Replace the contents, not read in on a miss
+
+} FS3PinMode;
 
 //
 // Cache Functions
@@ -30,9 +77,65 @@ int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
     // Put an element in the cache
 
 void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct);
-    // Get an element from the cache (returns NULL if not found)
+    // Get an element from the cache (returns NULL if not found); the buffer
+    // is not pinned, so threads sharing the cache should use fs3_pin_sector
+
+int fs3_set_cache_policy(FS3CachePolicy policy);
+    // Select the replacement policy, takes effect at the next init
+
+int fs3_cache_policy_by_name(const char *name);
+    // Look up a policy by name (lru, fifo, ...), -1 if unknown
+
+const char * fs3_cache_policy_name(FS3CachePolicy policy);
+    // Get the name of a policy
+
+int fs3_set_cache_mode(FS3CacheMode mode);
+    // Select write-through or write-back, takes effect at the next init
+
+int fs3_set_cache_shards(int shards);
+    // Split the cache into a power-of-two number of independently locked
+    // shards, each with its share of the lines; takes effect at the next init
+
+int fs3_set_cache_writer(FS3CacheWriter writer);
+    // Register the function used to write dirty sectors back
+
+int fs3_set_cache_reader(FS3CacheReader reader);
+    // Register the function used to read in sectors being pinned
+
+void * fs3_pin_sector(FS3TrackIndex trk, FS3SectorIndex sct, FS3PinMode mode);
+    // Pin a sector in memory (reading it on a miss), returns its buffer
+
+int fs3_unpin_sector(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Release a pin, writing or dirtying the sector if pinned for write
+
+int fs3_prefetch_sector(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Read a sector into the cache ahead of use (readahead)
+
+int fs3_prefetch_wasted(void);
+    // Get the number of read ahead sectors evicted without being used
+
+int fs3_cache_lines(void);
+    // Get the number of lines in the open cache
+
+int fs3_flush_cache(void);
+    // Write back all dirty sectors in track order
+
+int fs3_flush_cache_run(FS3TrackIndex trk, FS3SectorIndex sct, int count);
+    // Write back the dirty sectors of a run of sectors on one track
 
 int fs3_log_cache_metrics(void);
     // Log the metrics for the cache 
 
+int fs3_set_cache_stats(int detailed);
+    // Keep detailed statistics (per-track and per-file hits, reuse
+    // distances, evictions by reason, latencies); takes effect at the next
+    // init and is kept until the init after that
+
+int fs3_set_cache_owner(int owner);
+    // Attribute the calling thread's references to a file (-1 for none),
+    // returns the previous owner
+
+int fs3_cache_stats_dump(const char *path);
+    // Write the cache statistics to a file as JSON ("-" for stdout)
+
 #endif
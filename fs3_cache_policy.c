@@ -0,0 +1,458 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_cache_policy.c
+//  Description    : This is the implementation of the replacement policies
+//                   for the FS3 sector cache (LRU, FIFO, direct mapped,
+//                   CLOCK, 2Q and ARC).  All state lives in the shard
+//                   being worked on.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <fs3_cache_policy.h>
+
+//
+// Support Macros/Data
+
+#define LINE_OF(node) FS3_CACHE_ENTRY(node, struct cacheParts, link)
+#define GHOST_OF(node) FS3_CACHE_ENTRY(node, struct cacheGhost, link)
+
+// Queues a line or ghost can be on
+#define Q_NONE  0
+#define Q_MAIN  1   // LRU/FIFO list, 2Q Am, ARC T2
+#define Q_IN    2   // 2Q A1in, ARC T1
+#define Q_B1    3   // ARC ghosts of T1, 2Q A1out
+#define Q_B2    4   // ARC ghosts of T2
+
+// Remembered keys of recently evicted sectors (2Q A1out, ARC B1/B2)
+struct cacheGhost {
+    uint32_t key;
+    uint8_t queue;
+    struct cacheGhost *hashNext;
+    FS3CacheNode link;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pop_line
+// Description  : Remove and return the line at the tail of a list
+//
+// Inputs       : list - the list to pop from
+// Outputs      : the line, NULL if the list is empty
+
+static struct cacheParts *pop_line(FS3CacheList *list) {
+    FS3CacheNode *node = fs3_cache_list_pop(list);
+
+    return((node == NULL) ? NULL : LINE_OF(node));
+}
+
+//
+// Ghost (evicted key) directory
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_init
+// Description  : Allocate the ghost directory
+//
+// Inputs       : shard - the shard
+//                entries - the maximum number of remembered keys
+// Outputs      : 0 if successful, -1 if failure
+
+static int ghost_init(FS3CacheShard *shard, int entries) {
+    memset(&shard->ghostB1, 0x0, sizeof(shard->ghostB1));
+    memset(&shard->ghostB2, 0x0, sizeof(shard->ghostB2));
+    memset(&shard->ghostFree, 0x0, sizeof(shard->ghostFree));
+    shard->ghostBits = 1;
+    while ((1 << shard->ghostBits) < (2 * entries)) {
+        shard->ghostBits++;
+    }
+    shard->ghostPool = (struct cacheGhost *)calloc(entries, sizeof(struct cacheGhost));
+    shard->ghostTable = (struct cacheGhost **)calloc(1 << shard->ghostBits, sizeof(struct cacheGhost *));
+    if ((shard->ghostPool == NULL) || (shard->ghostTable == NULL)) {
+        free(shard->ghostPool);
+        free(shard->ghostTable);
+        shard->ghostPool = NULL;
+        shard->ghostTable = NULL;
+        return(-1);
+    }
+    for (int i = 0; i < entries; i++) {
+        fs3_cache_list_push(&shard->ghostFree, &shard->ghostPool[i].link);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_close
+// Description  : Release the ghost directory
+//
+// Inputs       : shard - the shard
+// Outputs      : none
+
+static void ghost_close(FS3CacheShard *shard) {
+    free(shard->ghostPool);
+    free(shard->ghostTable);
+    shard->ghostPool = NULL;
+    shard->ghostTable = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_find
+// Description  : Find the ghost entry remembering a key
+//
+// Inputs       : shard - the shard
+//                key - the packed (track, sector) key
+// Outputs      : pointer to the entry, NULL if the key is not remembered
+
+static struct cacheGhost *ghost_find(FS3CacheShard *shard, uint32_t key) {
+    struct cacheGhost *ghost = shard->ghostTable[FS3_CACHE_HASH(key, shard->ghostBits)];
+
+    while ((ghost != NULL) && (ghost->key != key)) {
+        ghost = ghost->hashNext;
+    }
+    return(ghost);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_drop
+// Description  : Forget a ghost entry
+//
+// Inputs       : shard - the shard
+//                ghost - the entry to forget
+// Outputs      : none
+
+static void ghost_drop(FS3CacheShard *shard, struct cacheGhost *ghost) {
+    struct cacheGhost **link = &shard->ghostTable[FS3_CACHE_HASH(ghost->key, shard->ghostBits)];
+
+    while (*link != ghost) {
+        link = &(*link)->hashNext;
+    }
+    *link = ghost->hashNext;
+    fs3_cache_list_remove((ghost->queue == Q_B1) ? &shard->ghostB1 : &shard->ghostB2, &ghost->link);
+    ghost->queue = Q_NONE;
+    fs3_cache_list_push(&shard->ghostFree, &ghost->link);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_drop_oldest
+// Description  : Forget the oldest key on a ghost list
+//
+// Inputs       : shard - the shard
+//                list - its ghostB1 or ghostB2
+// Outputs      : none
+
+static void ghost_drop_oldest(FS3CacheShard *shard, FS3CacheList *list) {
+    if (list->tail != NULL) {
+        ghost_drop(shard, GHOST_OF(list->tail));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_remember
+// Description  : Remember the key of a line that is being evicted
+//
+// Inputs       : shard - the shard
+//                line - the line being evicted
+//                queue - Q_B1 or Q_B2
+// Outputs      : none
+
+static void ghost_remember(FS3CacheShard *shard, struct cacheParts *line, uint8_t queue) {
+    struct cacheGhost *ghost;
+    uint32_t bucket;
+
+    // The directory is sized so this only triggers on policy bookkeeping slack
+    if (shard->ghostFree.count == 0) {
+        ghost_drop_oldest(shard, (shard->ghostB1.count >= shard->ghostB2.count) ? &shard->ghostB1 : &shard->ghostB2);
+    }
+    ghost = GHOST_OF(fs3_cache_list_pop(&shard->ghostFree));
+    ghost->key = FS3_CACHE_KEY(line->track, line->sector);
+    ghost->queue = queue;
+    bucket = FS3_CACHE_HASH(ghost->key, shard->ghostBits);
+    ghost->hashNext = shard->ghostTable[bucket];
+    shard->ghostTable[bucket] = ghost;
+    fs3_cache_list_push((queue == Q_B1) ? &shard->ghostB1 : &shard->ghostB2, &ghost->link);
+}
+
+//
+// LRU
+
+static int lru_init(FS3CacheShard *shard) {
+    memset(&shard->mainList, 0x0, sizeof(shard->mainList));
+    return(0);
+}
+
+static void lru_close(FS3CacheShard *shard) {
+}
+
+static void lru_touch(FS3CacheShard *shard, struct cacheParts *line) {
+    fs3_cache_list_remove(&shard->mainList, &line->link);
+    fs3_cache_list_push(&shard->mainList, &line->link);
+}
+
+static struct cacheParts *lru_place(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    struct cacheParts *line = fs3_cache_free_line(shard);
+
+    return((line != NULL) ? line : pop_line(&shard->mainList));
+}
+
+static void lru_insert(FS3CacheShard *shard, struct cacheParts *line) {
+    fs3_cache_list_push(&shard->mainList, &line->link);
+}
+
+static void lru_unlink(FS3CacheShard *shard, struct cacheParts *line) {
+    fs3_cache_list_remove(&shard->mainList, &line->link);
+}
+
+static const FS3CachePolicyOps lruPolicy = {
+    "lru", lru_init, lru_close, lru_touch, lru_place, lru_insert, lru_insert, lru_unlink, lru_insert
+};
+
+//
+// FIFO, same lists as LRU but a reference does not reorder
+
+static void fifo_touch(FS3CacheShard *shard, struct cacheParts *line) {
+}
+
+static const FS3CachePolicyOps fifoPolicy = {
+    "fifo", lru_init, lru_close, fifo_touch, lru_place, lru_insert, lru_insert, lru_unlink, lru_insert
+};
+
+//
+// Direct mapped, each disk sector address has exactly one candidate line
+
+static void direct_touch(FS3CacheShard *shard, struct cacheParts *line) {
+}
+
+static struct cacheParts *direct_place(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    uint32_t address = ((uint32_t)trk * FS3_TRACK_SIZE) + sct;
+    struct cacheParts *line = &shard->lines[address % shard->size];
+
+    if (line->pins > 0) {
+        return(NULL);
+    }
+    if (line->buffer == NULL) {
+        fs3_cache_list_remove(&shard->freeLines, &line->link);     // only empty lines stay free
+    }
+    return(line);
+}
+
+static void direct_insert(FS3CacheShard *shard, struct cacheParts *line) {
+}
+
+static const FS3CachePolicyOps directPolicy = {
+    "direct", lru_init, lru_close, direct_touch, direct_place, direct_insert, direct_insert, direct_insert, direct_insert
+};
+
+//
+// CLOCK, a hand sweeps the lines giving referenced ones a second chance
+
+static int clock_init(FS3CacheShard *shard) {
+    shard->clockHand = 0;
+    return(0);
+}
+
+static void clock_touch(FS3CacheShard *shard, struct cacheParts *line) {
+    line->ref = 1;
+}
+
+static struct cacheParts *clock_place(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    struct cacheParts *line = fs3_cache_free_line(shard);
+
+    if (line != NULL) {
+        return(line);
+    }
+
+    // Two full turns clear every reference bit, so only pins can stop us
+    for (int i = 0; i < 2 * shard->size; i++) {
+        line = &shard->lines[shard->clockHand];
+        shard->clockHand = (shard->clockHand + 1) % shard->size;
+        if (line->pins > 0) {
+            continue;
+        }
+        if (!line->ref) {
+            return(line);
+        }
+        line->ref = 0;
+    }
+    return(NULL);
+}
+
+static void clock_insert(FS3CacheShard *shard, struct cacheParts *line) {
+    line->ref = 1;
+}
+
+static const FS3CachePolicyOps clockPolicy = {
+    "clock", clock_init, lru_close, clock_touch, clock_place, clock_insert, clock_insert, direct_insert, clock_insert
+};
+
+//
+// 2Q (Johnson & Shasha), new sectors enter a FIFO (A1in) and only move to
+// the LRU main queue (Am) if they are referenced again after leaving it
+
+static int twoq_init(FS3CacheShard *shard) {
+    memset(&shard->mainList, 0x0, sizeof(shard->mainList));
+    memset(&shard->inList, 0x0, sizeof(shard->inList));
+    shard->twoQKin = (shard->size / 4 > 0) ? shard->size / 4 : 1;
+    shard->twoQKout = (shard->size / 2 > 0) ? shard->size / 2 : 1;
+    return(ghost_init(shard, shard->twoQKout));
+}
+
+static void twoq_touch(FS3CacheShard *shard, struct cacheParts *line) {
+    if (line->queue == Q_MAIN) {
+        fs3_cache_list_remove(&shard->mainList, &line->link);
+        fs3_cache_list_push(&shard->mainList, &line->link);
+    }
+}
+
+static struct cacheParts *twoq_place(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    struct cacheGhost *ghost = ghost_find(shard, FS3_CACHE_KEY(trk, sct));
+    struct cacheParts *line;
+
+    // Seen recently enough to be remembered, promote straight to Am
+    shard->placedQueue = Q_IN;
+    if (ghost != NULL) {
+        ghost_drop(shard, ghost);
+        shard->placedQueue = Q_MAIN;
+    }
+    if ((line = fs3_cache_free_line(shard)) != NULL) {
+        return(line);
+    }
+
+    // Reclaim from A1in while it is over its share, remembering the key
+    if (((shard->inList.count > shard->twoQKin) || (shard->mainList.count == 0)) && (shard->inList.count > 0)) {
+        line = pop_line(&shard->inList);
+        if (shard->ghostB1.count >= shard->twoQKout) {
+            ghost_drop_oldest(shard, &shard->ghostB1);
+        }
+        ghost_remember(shard, line, Q_B1);
+    } else {
+        line = pop_line(&shard->mainList);
+    }
+    return(line);
+}
+
+static void twoq_insert(FS3CacheShard *shard, struct cacheParts *line) {
+    line->queue = shard->placedQueue;
+    fs3_cache_list_push((shard->placedQueue == Q_MAIN) ? &shard->mainList : &shard->inList, &line->link);
+}
+
+static void twoq_unlink(FS3CacheShard *shard, struct cacheParts *line) {
+    fs3_cache_list_remove((line->queue == Q_MAIN) ? &shard->mainList : &shard->inList, &line->link);
+}
+
+static void twoq_relink(FS3CacheShard *shard, struct cacheParts *line) {
+    fs3_cache_list_push((line->queue == Q_MAIN) ? &shard->mainList : &shard->inList, &line->link);
+}
+
+static void twoq_unplace(FS3CacheShard *shard, struct cacheParts *line) {
+    struct cacheGhost *ghost = ghost_find(shard, FS3_CACHE_KEY(line->track, line->sector));
+
+    if (ghost != NULL) {
+        ghost_drop(shard, ghost);               // remembered by place, still cached
+    }
+    twoq_relink(shard, line);
+}
+
+static const FS3CachePolicyOps twoQPolicy = {
+    "2q", twoq_init, ghost_close, twoq_touch, twoq_place, twoq_insert, twoq_unplace, twoq_unlink, twoq_relink
+};
+
+//
+// ARC (Megiddo & Modha), balances a recency list T1 against a frequency list
+// T2, adapting the target size of T1 from hits on the ghost lists B1/B2
+
+static int arc_init(FS3CacheShard *shard) {
+    memset(&shard->mainList, 0x0, sizeof(shard->mainList));
+    memset(&shard->inList, 0x0, sizeof(shard->inList));
+    shard->arcTarget = 0;
+    return(ghost_init(shard, shard->size));
+}
+
+static void arc_touch(FS3CacheShard *shard, struct cacheParts *line) {
+    fs3_cache_list_remove((line->queue == Q_IN) ? &shard->inList : &shard->mainList, &line->link);
+    line->queue = Q_MAIN;
+    fs3_cache_list_push(&shard->mainList, &line->link);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arc_replace
+// Description  : The ARC REPLACE step, evict from T1 or T2 into its ghost list
+//
+// Inputs       : shard - the shard
+//                inB2 - the sector being placed is remembered in B2
+// Outputs      : the evicted line, NULL if every line is pinned
+
+static struct cacheParts *arc_replace(FS3CacheShard *shard, int inB2) {
+    struct cacheParts *line;
+
+    if ((shard->inList.count > 0) &&
+            ((shard->inList.count > shard->arcTarget) || (inB2 && (shard->inList.count == shard->arcTarget)) || (shard->mainList.count == 0))) {
+        line = pop_line(&shard->inList);
+        ghost_remember(shard, line, Q_B1);
+    } else if ((line = pop_line(&shard->mainList)) != NULL) {
+        ghost_remember(shard, line, Q_B2);
+    }
+    return(line);
+}
+
+static struct cacheParts *arc_place(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct) {
+    struct cacheGhost *ghost = ghost_find(shard, FS3_CACHE_KEY(trk, sct));
+    struct cacheParts *line;
+    int delta, inB2 = 0;
+
+    // Ghost hit, adapt the target and bring the sector back into T2
+    if (ghost != NULL) {
+        if (ghost->queue == Q_B1) {
+            delta = (shard->ghostB2.count > shard->ghostB1.count) ? shard->ghostB2.count / shard->ghostB1.count : 1;
+            shard->arcTarget = (shard->arcTarget + delta < shard->size) ? shard->arcTarget + delta : shard->size;
+        } else {
+            delta = (shard->ghostB1.count > shard->ghostB2.count) ? shard->ghostB1.count / shard->ghostB2.count : 1;
+            shard->arcTarget = (shard->arcTarget - delta > 0) ? shard->arcTarget - delta : 0;
+            inB2 = 1;
+        }
+        ghost_drop(shard, ghost);
+        shard->placedQueue = Q_MAIN;
+        line = fs3_cache_free_line(shard);
+        return((line != NULL) ? line : arc_replace(shard, inB2));
+    }
+
+    // Complete miss, keep |T1|+|B1| <= c and the whole directory <= 2c
+    shard->placedQueue = Q_IN;
+    if (shard->inList.count + shard->ghostB1.count >= shard->size) {
+        if (shard->inList.count < shard->size) {
+            ghost_drop_oldest(shard, &shard->ghostB1);
+        } else {
+            return(pop_line(&shard->inList));
+        }
+    } else if (shard->inList.count + shard->mainList.count + shard->ghostB1.count + shard->ghostB2.count >= shard->size) {
+        if (shard->inList.count + shard->mainList.count + shard->ghostB1.count + shard->ghostB2.count >= 2 * shard->size) {
+            ghost_drop_oldest(shard, &shard->ghostB2);
+        }
+    }
+    line = fs3_cache_free_line(shard);
+    return((line != NULL) ? line : arc_replace(shard, 0));
+}
+
+static const FS3CachePolicyOps arcPolicy = {
+    "arc", arc_init, ghost_close, arc_touch, arc_place, twoq_insert, twoq_unplace, twoq_unlink, twoq_relink
+};
+
+//
+// Policy table, indexed by FS3CachePolicy
+
+const FS3CachePolicyOps *fs3CachePolicies[FS3_CACHE_MAXPOLICY] = {
+    &lruPolicy,
+    &fifoPolicy,
+    &directPolicy,
+    &clockPolicy,
+    &twoQPolicy,
+    &arcPolicy
+};
@@ -0,0 +1,161 @@
+#ifndef FS3_CACHE_POLICY_INCLUDED
+#define FS3_CACHE_POLICY_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_cache_policy.h
+//  Description    : This is the internal interface between the FS3 sector
+//                   cache and its pluggable replacement policies.  The cache
+//                   owns the lines, the hash table and the buffers; a policy
+//                   only decides which line a new sector goes into.
+//                   The cache is split into shards, each with its own lines,
+//                   lock and policy state, so every policy call is made on
+//                   one shard with that shard's lock held.
+//
+
+// Include
+#include <stddef.h>
+#include <pthread.h>
+#include <fs3_controller.h>
+#include <fs3_cache.h>
+
+// Pack a (track, sector) pair into a single lookup key
+#define FS3_CACHE_KEY(trk, sct) ((((uint32_t)(trk)) << 16) | (uint32_t)(sct))
+
+// Fibonacci hashing of a packed key into a power-of-two sized table
+#define FS3_CACHE_HASH(key, bits) ((uint32_t)(((key) * 2654435769u) >> (32 - (bits))))
+
+// Shard holding a packed key; uses other bits than FS3_CACHE_HASH so the
+// shard's own hash table still spreads its keys
+#define FS3_CACHE_SHARD(key, mask) ((((key) * 0x85ebca6bu) >> 16) & (mask))
+
+// Recover the enclosing structure from an embedded list node
+#define FS3_CACHE_ENTRY(node, type, member) \
+    ((type *)((char *)(node) - offsetof(type, member)))
+
+//
+// Type definitions
+
+typedef struct fs3CacheNode {
+    struct fs3CacheNode *prev;      // towards the head (more recent)
+    struct fs3CacheNode *next;      // towards the tail (older)
+} FS3CacheNode;
+
+typedef struct {
+    FS3CacheNode *head;             // most recently inserted/used
+    FS3CacheNode *tail;             // next candidate for removal
+    int count;                      // number of nodes on the list
+} FS3CacheList;
+
+struct cacheParts{
+    FS3TrackIndex track;
+    FS3SectorIndex sector;
+    void *buffer;                   // NULL when the line holds nothing
+    struct cacheParts *hashNext;    // next line in the same hash bucket
+    FS3CacheNode link;              // position on the policy's list(s)
+    uint8_t queue;                  // policy-specific list the line is on
+    uint8_t ref;                    // policy-specific reference bit
+    uint8_t dirty;                  // modified since last written to disk
+    uint8_t pinWrite;               // a pinner intends to modify the buffer
+    uint8_t detached;               // pinned outside the cache, no room
+    uint8_t prefetched;             // read ahead and not yet referenced
+    uint16_t pins;                  // outstanding pins, never evicted if >0
+    uint64_t inserted;              // reference clock when stored (detailed stats)
+};
+
+// Counters kept by each shard, summed when the metrics are logged
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t attempts;
+    uint64_t absorbed;              // writes that only dirtied a line
+    uint64_t writebacks;            // dirty lines written back to disk
+    uint64_t overwrites;            // misses pinned without reading the disk
+    uint64_t prefetched;            // sectors read ahead into the cache
+    uint64_t prefetchHits;          // read ahead sectors later referenced
+    int prefetchWasted;             // read ahead sectors evicted unreferenced,
+                                    // read without the lock by readahead
+} FS3CacheShardStats;
+
+struct cacheGhost;
+
+// One independently locked slice of the cache
+typedef struct {
+    pthread_mutex_t lock;           // held by every call touching the shard
+    struct cacheParts *lines;       // this shard's lines, size entries
+    int size;
+    int count;                      // lines holding a sector
+    struct cacheParts **table;      // hash buckets, chained through hashNext
+    int bits;                       // log2 of the number of buckets
+    FS3CacheList freeLines;         // lines not holding a sector
+    FS3CacheList detachedLines;     // pinned sectors the shard had no room for
+    int dirtyCount;                 // lines currently dirty
+    struct cacheParts **flushList;  // scratch list of dirty lines to write
+    uint32_t flushKey;              // where the last watermark flush stopped
+    uint8_t flushWanted;            // above the high watermark, for the flusher
+    FS3CacheShardStats stats;
+
+    // Policy state
+    FS3CacheList mainList;          // LRU/FIFO order, 2Q Am, ARC T2
+    FS3CacheList inList;            // 2Q A1in, ARC T1
+    FS3CacheList ghostB1;           // 2Q A1out, ARC B1
+    FS3CacheList ghostB2;           // ARC B2
+    int clockHand;                  // CLOCK sweep position
+    int twoQKin;                    // 2Q A1in target size
+    int twoQKout;                   // 2Q A1out size
+    int arcTarget;                  // ARC target size of T1 (p)
+    uint8_t placedQueue;            // queue chosen for the line being placed
+    struct cacheGhost *ghostPool;   // all ghost entries
+    struct cacheGhost **ghostTable; // hash buckets, chained through hashNext
+    int ghostBits;                  // log2 of the number of buckets
+    FS3CacheList ghostFree;         // unused ghost entries
+
+} __attribute__((aligned(64))) FS3CacheShard;
+
+typedef struct {
+    const char *name;
+    int (*init)(FS3CacheShard *shard);
+        // Set up policy state for a shard of shard->size lines
+    void (*close)(FS3CacheShard *shard);
+        // Release any policy state
+    void (*touch)(FS3CacheShard *shard, struct cacheParts *line);
+        // A cached sector was referenced again
+    struct cacheParts *(*place)(FS3CacheShard *shard, FS3TrackIndex trk, FS3SectorIndex sct);
+        // Pick the line a new sector goes into, unlinking it from the
+        // policy lists; the cache evicts its old contents if any.  NULL
+        // if every candidate line is pinned
+    void (*insert)(FS3CacheShard *shard, struct cacheParts *line);
+        // A new sector has been stored in the line returned by place
+    void (*unplace)(FS3CacheShard *shard, struct cacheParts *line);
+        // The line returned by place could not be evicted (its dirty
+        // sector failed to write back), it keeps its sector
+    void (*unlink)(FS3CacheShard *shard, struct cacheParts *line);
+        // The line was pinned, it must not be chosen by place
+    void (*relink)(FS3CacheShard *shard, struct cacheParts *line);
+        // The line was unpinned, it may be replaced again
+} FS3CachePolicyOps;
+
+//
+// Cache internals shared with the policies
+
+struct cacheParts *fs3_cache_free_line(FS3CacheShard *shard);
+    // Take an unused line of the shard, NULL if every line holds a sector
+
+//
+// List helpers
+
+void fs3_cache_list_push(FS3CacheList *list, FS3CacheNode *node);
+    // Insert a node at the head of a list
+
+void fs3_cache_list_remove(FS3CacheList *list, FS3CacheNode *node);
+    // Remove a node from a list
+
+FS3CacheNode *fs3_cache_list_pop(FS3CacheList *list);
+    // Remove and return the tail of a list (NULL if empty)
+
+//
+// Policy tables
+
+extern const FS3CachePolicyOps *fs3CachePolicies[FS3_CACHE_MAXPOLICY];
+
+#endif
@@ -15,7 +15,9 @@
 #include <stdint.h>
 
 // These are the constants defining the size of the disk elements
-#define FS3_MAX_TRACKS 64
+#ifndef FS3_MAX_TRACKS
+#define FS3_MAX_TRACKS 64          // Larger disks need the image controller
+#endif
 #define FS3_TRACK_SIZE 1024
 #define FS3_SECTOR_SIZE 1024
 #define FS3_NO_TRACK (FS3_MAX_TRACKS+0xff)
@@ -0,0 +1,429 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_crc.c
+//  Description    : This is the implementation of the FS3 sector
+//                   checksums.  The checksums of every track are held in
+//                   memory, a track's sidecar sectors are read the first
+//                   time one of its sectors is checked, and changed
+//                   sidecars are written back when the driver flushes.
+//
+//                   A checksum is recorded by the scheduler once the
+//                   controller has written the sector, with schedLock
+//                   held, so crcLock is taken after it and never held
+//                   across a call into the scheduler.
+//
+
+// Includes
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_crc.h>
+#include <fs3_sched.h>
+
+//
+// Support Macros/Data
+
+#define CRC_POLY 0x82f63b78             // CRC32C (Castagnoli), reflected
+
+pthread_mutex_t crcLock = PTHREAD_MUTEX_INITIALIZER;    // the table and the counters
+pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+uint32_t crcByteTable[256];             // fallback, one byte at a time
+int crcRequested = 0;                   // format new disks with checksums
+int crcActive = 0;                      // this disk has them
+uint32_t crcTable[FS3_MAX_TRACKS][FS3_TRACK_SIZE];     // checksum of every sector, 0 if none
+uint8_t crcLoaded[FS3_MAX_TRACKS];      // track's sidecars have been read
+uint8_t crcFresh[FS3_MAX_TRACKS];       // formatted, sidecars on the disk not written yet
+uint8_t crcDirty[FS3_MAX_TRACKS][FS3_CRC_SECTORS];     // sidecar changed since written
+FS3CrcStats crcStats;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_now
+// Description  : Read the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time (ns)
+
+static uint64_t fs3_crc_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_table_init
+// Description  : Build the table the fallback CRC uses
+//
+// Inputs       : none
+// Outputs      : none
+
+static void fs3_crc_table_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC_POLY : 0);
+        }
+        crcByteTable[i] = crc;
+    }
+}
+
+#if defined(__x86_64__)
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc32c_sse42
+// Description  : CRC32C with the SSE4.2 crc32 instruction, 8 bytes at a time
+//
+// Inputs       : crc - the running CRC (not inverted)
+//                buf, len - the bytes
+// Outputs      : the running CRC
+
+__attribute__((target("sse4.2")))
+static uint32_t fs3_crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t c = crc, word;
+
+    for (; len >= 8; buf += 8, len -= 8) {
+        memcpy(&word, buf, 8);
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    for (; len > 0; buf++, len--) {
+        c = __builtin_ia32_crc32qi((uint32_t)c, *buf);
+    }
+    return((uint32_t)c);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc32c
+// Description  : Continue a CRC32C over some bytes
+//
+// Inputs       : crc - the CRC so far, 0 to start
+//                buf, len - the bytes
+// Outputs      : the CRC
+
+uint32_t fs3_crc32c(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *data = (const unsigned char *)buf;
+
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return(~fs3_crc32c_sse42(crc, data, len));
+    }
+#endif
+    pthread_once(&crcTableOnce, fs3_crc_table_init);
+    for (; len > 0; data++, len--) {
+        crc = (crc >> 8) ^ crcByteTable[(crc ^ *data) & 0xff];
+    }
+    return(~crc);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_sector
+// Description  : Get the checksum of a sector, seeded with its address
+//
+// Inputs       : trk, sct - the sector
+//                buf - its contents
+// Outputs      : the checksum, never 0
+
+static uint32_t fs3_crc_sector(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf) {
+    uint32_t addr = ((uint32_t)trk << 16) | sct;
+    uint32_t crc = fs3_crc32c(fs3_crc32c(0, &addr, sizeof(addr)), buf, FS3_SECTOR_SIZE);
+
+    return((crc == 0) ? 1 : crc);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_load
+// Description  : Read a track's sidecar sectors if they are not in memory.
+//                Checksums recorded since the disk was mounted are newer
+//                than the sidecars and are kept
+//
+// Inputs       : trk - the track
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_crc_load(FS3TrackIndex trk) {
+    uint32_t sidecar[FS3_CRC_SECTORS * FS3_CRC_PER_SECTOR];
+    int loaded;
+
+    pthread_mutex_lock(&crcLock);
+    loaded = crcLoaded[trk];
+    pthread_mutex_unlock(&crcLock);
+    if (loaded) {
+        return(0);
+    }
+    for (size_t k = 0; k < FS3_CRC_SECTORS; k++) {
+        if (fs3_sched_io(FS3_OP_RDSECT, trk, FS3_CRC_FIRST_SECTOR + k, &sidecar[k * FS3_CRC_PER_SECTOR]) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "cannot read the checksums of track %d", trk);
+            return(-1);
+        }
+    }
+
+    pthread_mutex_lock(&crcLock);
+    if (!crcLoaded[trk]) {
+        for (int sct = 0; sct < FS3_TRACK_SIZE; sct++) {
+            if (crcTable[trk][sct] == 0) {
+                crcTable[trk][sct] = sidecar[sct];
+            }
+        }
+        crcLoaded[trk] = 1;
+    }
+    crcStats.sidecarReads += FS3_CRC_SECTORS;
+    pthread_mutex_unlock(&crcLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_crc_checking
+// Description  : Choose whether new disks are formatted with checksums
+//
+// Inputs       : enable - non-zero to checksum
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_crc_checking(int enable) {
+    crcRequested = (enable != 0);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_checking
+// Description  : Get whether new disks are formatted with checksums
+//
+// Inputs       : none
+// Outputs      : 1 if they are, 0 if not
+
+int fs3_crc_checking(void) {
+    return(crcRequested);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_mount
+// Description  : Start checksumming the sectors of a mounted disk
+//
+// Inputs       : active - the disk has checksums
+//                formatted - the disk was just formatted, so its sidecars
+//                            hold nothing; a track's are written out in
+//                            full once one of its sectors is
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_crc_mount(int active, int formatted) {
+    pthread_mutex_lock(&crcLock);
+    memset(&crcStats, 0x0, sizeof(crcStats));
+    memset(crcTable, 0x0, sizeof(crcTable));
+    memset(crcLoaded, formatted ? 1 : 0, sizeof(crcLoaded));
+    memset(crcFresh, formatted ? 1 : 0, sizeof(crcFresh));
+    memset(crcDirty, 0x0, sizeof(crcDirty));
+    crcActive = active;
+    pthread_mutex_unlock(&crcLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_unmount
+// Description  : Stop checksumming sectors
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_crc_unmount(void) {
+    pthread_mutex_lock(&crcLock);
+    crcActive = 0;
+    pthread_mutex_unlock(&crcLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_active
+// Description  : Get whether sectors are being checksummed
+//
+// Inputs       : none
+// Outputs      : 1 if they are, 0 if not
+
+int fs3_crc_active(void) {
+    return(__atomic_load_n(&crcActive, __ATOMIC_RELAXED));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_sector_written
+// Description  : Record the checksum of a sector the controller has just
+//                written, called by the scheduler with schedLock held.  A
+//                track that is not loaded yet keeps it until it is
+//
+// Inputs       : trk, sct - the sector
+//                buf - what was written
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_crc_sector_written(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf) {
+    uint64_t start;
+    uint32_t crc;
+
+    if (!fs3_crc_active() || (trk >= FS3_MAX_TRACKS) || (sct >= FS3_CRC_FIRST_SECTOR)) {
+        return(0);
+    }
+    start = fs3_crc_now();
+    crc = fs3_crc_sector(trk, sct, buf);
+    start = fs3_crc_now() - start;
+
+    pthread_mutex_lock(&crcLock);
+    crcTable[trk][sct] = crc;
+    if (crcFresh[trk]) {
+        memset(crcDirty[trk], 1, sizeof(crcDirty[trk]));   // nothing of the track's is on the disk
+        crcFresh[trk] = 0;
+    } else {
+        crcDirty[trk][sct / FS3_CRC_PER_SECTOR] = 1;
+    }
+    crcStats.computed++;
+    crcStats.computeNs += start;
+    pthread_mutex_unlock(&crcLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_sector_read
+// Description  : Check a sector read in from the disk against its checksum
+//
+// Inputs       : trk, sct - the sector
+//                buf - what was read
+// Outputs      : 0 if it matches (or has no checksum), -1 if not
+
+int fs3_crc_sector_read(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf) {
+    uint64_t start;
+    uint32_t crc, stored;
+    int result = 0;
+
+    if (!fs3_crc_active() || (trk >= FS3_MAX_TRACKS) || (sct >= FS3_CRC_FIRST_SECTOR)) {
+        return(0);
+    }
+    if (fs3_crc_load(trk) == -1) {
+        return(-1);
+    }
+    start = fs3_crc_now();
+    crc = fs3_crc_sector(trk, sct, buf);
+    start = fs3_crc_now() - start;
+
+    pthread_mutex_lock(&crcLock);
+    if ((stored = crcTable[trk][sct]) == 0) {
+        crcStats.unchecked++;
+    } else {
+        if (stored != crc) {
+            crcStats.failures++;
+            result = -1;
+        }
+        crcStats.verified++;
+        crcStats.verifyNs += start;
+    }
+    pthread_mutex_unlock(&crcLock);
+
+    if (result == -1) {
+        logMessage(LOG_ERROR_LEVEL, "checksum mismatch on sector [%d/%d], stored %08x read %08x",
+                   trk, sct, stored, crc);
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_flush
+// Description  : Write the changed sidecar sectors, from a copy so that
+//                checksums can be recorded meanwhile; a sidecar that
+//                changes again or fails to write stays dirty
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_crc_flush(void) {
+    uint32_t sidecar[FS3_CRC_PER_SECTOR];
+    int result = 0, dirty;
+
+    for (int trk = 0; fs3_crc_active() && (trk < FS3_MAX_TRACKS); trk++) {
+        for (size_t k = 0; k < FS3_CRC_SECTORS; k++) {
+            pthread_mutex_lock(&crcLock);
+            dirty = crcDirty[trk][k];
+            pthread_mutex_unlock(&crcLock);
+            if (!dirty) {
+                continue;
+            }
+            if (fs3_crc_load(trk) == -1) {             // the rest of the sidecar is on the disk
+                result = -1;
+                break;
+            }
+
+            pthread_mutex_lock(&crcLock);
+            memcpy(sidecar, &crcTable[trk][k * FS3_CRC_PER_SECTOR], sizeof(sidecar));
+            crcDirty[trk][k] = 0;
+            pthread_mutex_unlock(&crcLock);
+            if (fs3_sched_io(FS3_OP_WRSECT, trk, FS3_CRC_FIRST_SECTOR + k, sidecar) == -1) {
+                logMessage(LOG_ERROR_LEVEL, "cannot write the checksums of track %d", trk);
+                pthread_mutex_lock(&crcLock);
+                crcDirty[trk][k] = 1;
+                pthread_mutex_unlock(&crcLock);
+                result = -1;
+                continue;
+            }
+            pthread_mutex_lock(&crcLock);
+            crcStats.sidecarWrites++;
+            pthread_mutex_unlock(&crcLock);
+        }
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_stats
+// Description  : Copy out the checksum counters
+//
+// Inputs       : stats - where to copy them
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_crc_stats(FS3CrcStats *stats) {
+    if (stats == NULL) {
+        return(-1);
+    }
+    pthread_mutex_lock(&crcLock);
+    *stats = crcStats;
+    pthread_mutex_unlock(&crcLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_crc_log_metrics
+// Description  : Log the checksum counters, with the throughput of the
+//                checksum computations
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_crc_log_metrics(void) {
+    FS3CrcStats stats;
+    double computeRate, verifyRate;
+    int hardware = 0;
+
+    fs3_crc_stats(&stats);
+#if defined(__x86_64__)
+    hardware = __builtin_cpu_supports("sse4.2");
+#endif
+    computeRate = (stats.computeNs > 0) ? (stats.computed * (double)FS3_SECTOR_SIZE * 1000.0) / stats.computeNs : 0;
+    verifyRate = (stats.verifyNs > 0) ? (stats.verified * (double)FS3_SECTOR_SIZE * 1000.0) / stats.verifyNs : 0;
+    logMessage(LOG_OUTPUT_LEVEL, "Checksum metrics (CRC32C, %s): computed %lu (%.0f MB/s) verified %lu (%.0f MB/s) "
+               "unchecked %lu failures %lu sidecar reads %lu writes %lu",
+               hardware ? "sse4.2" : "table", (unsigned long)stats.computed, computeRate,
+               (unsigned long)stats.verified, verifyRate, (unsigned long)stats.unchecked,
+               (unsigned long)stats.failures, (unsigned long)stats.sidecarReads,
+               (unsigned long)stats.sidecarWrites);
+    return(0);
+}
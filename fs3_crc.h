@@ -0,0 +1,85 @@
+#ifndef FS3_CRC_INCLUDED
+#define FS3_CRC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_crc.h
+//  Description    : This is the interface for FS3 sector checksums.  When
+//                   a disk is formatted with them, every sector written
+//                   gets a CRC32C (seeded with its address, so a sector
+//                   written to the wrong place fails too) and every sector
+//                   read in is checked once, as it enters the cache.
+//
+//                   The checksums of a track are kept in sidecar sectors
+//                   at the end of the track, FS3_CRC_PER_SECTOR to a
+//                   sector, so saving them never moves the head to
+//                   another track.  A checksum of 0 means the sector has
+//                   not been written since the disk was formatted.
+//
+
+// Include
+#include <stdint.h>
+#include <stddef.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_CRC_PER_SECTOR (FS3_SECTOR_SIZE / sizeof(uint32_t))
+#define FS3_CRC_SECTORS ((FS3_TRACK_SIZE + FS3_CRC_PER_SECTOR - 1) / FS3_CRC_PER_SECTOR)   // Sidecar sectors per track
+#define FS3_CRC_FIRST_SECTOR (FS3_TRACK_SIZE - FS3_CRC_SECTORS)   // First sidecar sector of a track
+
+// Checksum counters
+typedef struct {
+
+    uint64_t computed;          // Sectors checksummed as they were written
+    uint64_t verified;          // Sectors checked as they were read in
+    uint64_t unchecked;         // Sectors read in that were never written
+    uint64_t failures;          // Sectors that did not match
+    uint64_t computeNs;         // Time spent computing and checking
+    uint64_t verifyNs;
+    uint64_t sidecarReads;      // Sidecar sectors read and written
+    uint64_t sidecarWrites;
+
+} FS3CrcStats;
+
+//
+// Checksum Functions
+
+uint32_t fs3_crc32c(uint32_t crc, const void *buf, size_t len);
+    // Continue a CRC32C over len bytes (start from 0), using the SSE4.2
+    // crc32 instruction where the CPU has it
+
+int fs3_set_crc_checking(int enable);
+    // Format new disks with sector checksums (or not); a disk that is
+    // already formatted keeps what it was formatted with
+
+int fs3_crc_checking(void);
+    // Get whether new disks are formatted with sector checksums
+
+int fs3_crc_mount(int active, int formatted);
+    // Start checksumming sectors if active, formatted if the disk was just
+    // formatted (its sidecar sectors hold nothing yet)
+
+int fs3_crc_unmount(void);
+    // Stop checksumming sectors, the sidecars must have been flushed
+
+int fs3_crc_active(void);
+    // Get whether sectors are being checksummed
+
+int fs3_crc_sector_written(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf);
+    // Record the checksum of a sector the controller has written, the
+    // scheduler's written hook
+
+int fs3_crc_sector_read(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf);
+    // Check a sector that was read in, -1 if it does not match
+
+int fs3_crc_flush(void);
+    // Write the sidecar sectors changed since they were last written, call
+    // unplugged so the checksums of queued writes are recorded first
+
+int fs3_crc_stats(FS3CrcStats *stats);
+    // Copy out the checksum counters
+
+int fs3_crc_log_metrics(void);
+    // Log the checksum counters and throughput
+
+#endif
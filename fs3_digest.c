@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_digest.c
+//  Description    : This is the implementation of the FS3 sector checksums
+//                   and per-file hash trees.  Sectors are hashed a 64-bit
+//                   word at a time (MurmurHash64A), and tree nodes combine
+//                   their children with a 64-bit finalizer, so the digests
+//                   catch corruption but are not meant to resist forgery.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <fs3_digest.h>
+
+//
+// Support Macros/Data
+
+#define DIGEST_MULT 0xc6a4a7935bd1e995ULL      // MurmurHash64A multiplier
+#define DIGEST_SHIFT 47
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_digest_mix
+// Description  : Scramble a 64-bit value (the MurmurHash3 finalizer)
+//
+// Inputs       : h - the value
+// Outputs      : the scrambled value
+
+static uint64_t fs3_digest_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return(h);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_digest_combine
+// Description  : Get the hash of a tree node from its children's, in order
+//
+// Inputs       : left, right - the children's hashes
+// Outputs      : the node's hash, 0 if both children are empty
+
+static uint64_t fs3_digest_combine(uint64_t left, uint64_t right) {
+    if ((left == 0) && (right == 0)) {
+        return(0);
+    }
+    return(fs3_digest_mix(left * DIGEST_MULT + ((right << 31) | (right >> 33))));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_digest_sector
+// Description  : Get the checksum of the file bytes held in one sector
+//
+// Inputs       : buf - the bytes
+//                len - how many (at most a sector)
+// Outputs      : the checksum, never 0 so a written sector differs from
+//                an empty leaf
+
+uint64_t fs3_digest_sector(const void *buf, size_t len) {
+    const unsigned char *data = (const unsigned char *)buf;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * DIGEST_MULT), k;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&k, data + i, 8);
+        k *= DIGEST_MULT;
+        k ^= k >> DIGEST_SHIFT;
+        k *= DIGEST_MULT;
+        h ^= k;
+        h *= DIGEST_MULT;
+    }
+    if (i < len) {
+        k = 0;
+        memcpy(&k, data + i, len - i);
+        h ^= k;
+        h *= DIGEST_MULT;
+    }
+    h ^= h >> DIGEST_SHIFT;
+    h *= DIGEST_MULT;
+    h ^= h >> DIGEST_SHIFT;
+    return((h == 0) ? 1 : h);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_digest_resize
+// Description  : Grow the tree to hold a file of this many sectors, moving
+//                the leaves and rebuilding the nodes above them
+//
+// Inputs       : tree - the tree
+//                sectors - sectors in the file
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_digest_resize(FS3DigestTree *tree, int sectors) {
+    uint64_t *node;
+    int leaves = 1;
+
+    while (leaves < sectors) {
+        leaves <<= 1;
+    }
+    if (leaves == tree->leaves) {
+        return(0);
+    }
+    if ((node = calloc(2 * (size_t)leaves, sizeof(uint64_t))) == NULL) {
+        return(-1);
+    }
+    if (tree->node != NULL) {
+        memcpy(&node[leaves], &tree->node[tree->leaves],
+               ((tree->leaves < leaves) ? tree->leaves : leaves) * sizeof(uint64_t));
+        free(tree->node);
+    }
+    tree->node = node;
+    tree->leaves = leaves;
+    fs3_digest_rehash(tree, 0, leaves - 1);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_digest_set
+// Description  : Store a sector's checksum
+//
+// Inputs       : tree - the tree
+//                idx - the sector within the file
+//                sum - its fs3_digest_sector
+// Outputs      : none
+
+void fs3_digest_set(FS3DigestTree *tree, int idx, uint64_t sum) {
+    if ((idx >= 0) && (idx < tree->leaves)) {
+        tree->node[tree->leaves + idx] = sum;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_digest_rehash
+// Description  : Rehash the ancestors of a run of sectors a level at a
+//                time, so a run of k sectors costs k + log(leaves)
+//
+// Inputs       : tree - the tree
+//                first, last - the sectors
+// Outputs      : none
+
+void fs3_digest_rehash(FS3DigestTree *tree, int first, int last) {
+    int lo, hi, i;
+
+    if ((tree->leaves == 0) || (first > last)) {
+        return;
+    }
+    lo = tree->leaves + first;
+    hi = tree->leaves + ((last < tree->leaves) ? last : tree->leaves - 1);
+    while (lo > 1) {
+        lo >>= 1;
+        hi >>= 1;
+        for (i = lo; i <= hi; i++) {
+            tree->node[i] = fs3_digest_combine(tree->node[2 * i], tree->node[2 * i + 1]);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_digest_final
+// Description  : Get the digest of a file from its tree
+//
+// Inputs       : tree - the tree
+//                length - the file's length in bytes
+// Outputs      : the digest
+
+uint64_t fs3_digest_final(const FS3DigestTree *tree, uint32_t length) {
+    uint64_t root = (tree->leaves == 0) ? 0 : tree->node[1];
+    return(fs3_digest_mix(root ^ ((uint64_t)length * DIGEST_MULT)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_digest_free
+// Description  : Release a tree, leaving it empty
+//
+// Inputs       : tree - the tree
+// Outputs      : none
+
+void fs3_digest_free(FS3DigestTree *tree) {
+    free(tree->node);
+    tree->node = NULL;
+    tree->leaves = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef FS3_DIGEST_INCLUDED
+#define FS3_DIGEST_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_digest.h
+//  Description    : This is the interface for FS3 file digests.  Each
+//                   sector of a file has a 64-bit checksum of the file's
+//                   bytes in it, and the checksums are the leaves of a
+//                   binary hash tree; changing a sector rehashes only its
+//                   path to the root, so the driver keeps the digest of
+//                   every file current as it is written.
+//
+//                   The tree has a power of two leaves, the fewest that
+//                   hold the file, so two files with the same contents
+//                   have the same digest however they were written.
+//
+
+// Include
+#include <stdint.h>
+#include <stddef.h>
+
+// A file's hash tree, node i has children 2i and 2i+1 and leaf j is
+// node leaves+j; empty leaves are 0
+typedef struct {
+
+    uint64_t *node;             // The tree, node[1] is the root
+    int leaves;                 // Leaf slots, a power of two (0 if none yet)
+
+} FS3DigestTree;
+
+//
+// Digest Functions
+
+uint64_t fs3_digest_sector(const void *buf, size_t len);
+    // Get the checksum of the file bytes held in one sector
+
+int fs3_digest_resize(FS3DigestTree *tree, int sectors);
+    // Grow the tree to hold a file of this many sectors, -1 if out of memory
+
+void fs3_digest_set(FS3DigestTree *tree, int idx, uint64_t sum);
+    // Store a sector's checksum, its ancestors are rehashed by the next
+    // fs3_digest_rehash covering it
+
+void fs3_digest_rehash(FS3DigestTree *tree, int first, int last);
+    // Rehash the ancestors of sectors first..last
+
+uint64_t fs3_digest_final(const FS3DigestTree *tree, uint32_t length);
+    // Get the digest of a file of length bytes from its tree
+
+void fs3_digest_free(FS3DigestTree *tree);
+    // Release a tree, leaving it empty
+
+#endif
@@ -15,7 +15,15 @@
 #include "fs3_controller.h"
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
 #include "fs3_cache.h"
+#include "fs3_sched.h"
+#include "fs3_alloc.h"
+#include "fs3_meta.h"
+#include "fs3_aio.h"
+#include "fs3_digest.h"
+#include "fs3_crc.h"
 
 // Project Includes
 #include "fs3_driver.h"
@@ -28,7 +36,17 @@
 
 // Defines
 #define SECTOR_INDEX_NUMBER(x) ((int)(x/FS3_SECTOR_SIZE))
+#define FS3_RA_MIN 4						// readahead window when a stream starts (sectors)
+#define FS3_RA_MAX 64						// largest readahead window (sectors)
+#ifndef IOV_MAX
+#define IOV_MAX 1024					// most buffers a readv/writev may take
+#endif
 #define FS3_SIM_MAX_OPEN_FILES
+#define FS3_FD_SLOT_BITS 10					// low bits of a handle index the file table
+#define FS3_FD_SLOT(fd) ((fd) & ((1 << FS3_FD_SLOT_BITS) - 1))
+#define FS3_FD_GEN(fd) ((fd) >> FS3_FD_SLOT_BITS)
+#define FS3_FD_GENERATIONS 31				// generations before a handle value is reused
+#define FS3_PATH_BUCKETS 2048				// path hash buckets, twice the most files
 //////////////////////////////////////////////////////////////////////////
 //
 // 						Static Global Variables
@@ -37,25 +55,15 @@
 
 typedef enum {T, F} boolean;	// create an enum to allow use off boolean type
 boolean diskIsMounted = F;		// see if disk is mounted
+boolean diskIsAttached = F;		// controller mounted, set before the filesystem is read
 
-int trackSelect = 0;
-int trackCounter = 1;
-//int sectorSelect = 0;
-int sectorCounter = 1;
-void *calls;
+int fileCount = 0;				// files loaded, published after the entry is set up
+pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;	// path index, fileCount, directory
 
-//char *tempStoreBuf;
-uint8_t *op;
-uint16_t *sec;
-uint32_t *trk;
-uint8_t *ret;
-boolean firstWrite = T;
-boolean firstRead =T;
-void *readBuffer;
-FS3CmdBlk command;
-FS3TrackIndex curTrk= 0;
-FS3SectorIndex curSec= 0;
-int fileCount = 0;
+// Lock order: tableLock, then a file's lock, then its posLock; the cache,
+// scheduler and allocator take their own locks below all of these.
+
+int32_t fs3_io_execute(FS3IoRequest *req);	// carries out queued reads and writes, below
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -65,25 +73,55 @@ int fileCount = 0;
 
 
 
+// per-file state every read, write and seek touches, indexed by handle slot.
+// lock is held shared to read the file and exclusive to change its length or
+// layout; posLock orders the position and readahead updates of shared holders
 struct fileParts{
-	//void *fBuffer;
-	char *path;
-	int fileHandle;
+	pthread_rwlock_t lock;
+	pthread_mutex_t posLock;
 	int position;
 	int globalPos;
 	int length;
 	boolean isOpen;
+	uint8_t generation;	// high bits of the handle, bumped on close
 	int sector;
 	int track;
-	boolean fileExisits;
+	int raNext;		// file offset a sequential read would start at
+	int raEnd;		// sector index readahead has reached
+	int raWindow;	// sectors to read ahead, 0 until a stream is seen
+	int raWasted;	// cache's unused-prefetch count at the last readahead
 }*FILES;
 
+// per-file state only open needs
+struct fileNames{
+	char *path;		// interned copy of the path
+	uint32_t hash;	// hash of path
+	int next;		// next file in the same bucket, -1 at the end
+	int dirSlot;	// the file's entry in the on-disk directory
+}*NAMES;
+
+int pathIndex[FS3_PATH_BUCKETS];	// first file in each bucket, -1 if empty
+
+struct fileExtent{
+	int first;			// sector number within the file of the run's first sector
+	uint16_t track;		// track the run is on
+	uint16_t start;		// first sector of the run on that track
+	uint16_t length;	// sectors in the run
+};
+
 struct metaData{
-	int trkLen; // number of tracks used for given file
 	int secLen; // total number of sectors used for a given file
-	int *trkArr; // stores the tracks used for a given file -> [Idx] returns track #
-	int *secArr; // number of sectors per track for a given file [track] -> # of sectors on that track
-	int **secAccess; // resizeable 2D array [track][sector] -> the sector from a given [trackIdx] and [sectorIdx] 	
+	int extLen; // extents in use
+	int extMax; // room in ext
+	struct fileExtent *ext; // runs of sectors in file order, binary searched by first
+	boolean dirty;	// changed since the directory entry was written
+	boolean mapDirty;	// extents changed since the extent map was written
+	int mapReserve;		// sectors held back for writing the next extent map
+	uint16_t mapTrack;		// where the on-disk extent map is
+	uint16_t mapSector;
+	uint16_t mapSectors;	// 0 if it has none
+	FS3DigestTree digest;	// checksum of each sector and the hash tree over them
+	boolean digestBuilt;	// F until the tree covers the file (loaded from disk, or a write failed)
 }*META;
 
 
@@ -98,202 +136,324 @@ struct metaData{
 //
 // Function     : fs3_fileLocation
 // Description  : finds the array index associated with the desired
-//				  file directory/handle value
+//				  file directory/handle value, the handle's low bits are
+//				  the index and its high bits must match the generation
 //
 // Inputs       : file directory(fd)[from user]
-// Outputs      : array index of fd
+// Outputs      : array index of fd, -1 if the handle is stale or bad
 
 int fs3_fileLocation(int16_t fd){
-	int curFile = -1;
-	boolean foundFile =F;
-	if(fileCount==1){curFile = 0;}
-	else{
-	for (int i =0; i<fileCount; i++){
-		if(FILES[i].fileHandle==fd){
-			curFile = i;
-			foundFile =T;
-			
-		}
-		if(foundFile==T){break;}
-	}
-	}
-	logMessage(FS3DriverLLevel,"\n\nfile handle asked: %d\nFile handle given: %d\nFile array index: %d\nFile path: %s\nFile length: %d", fd, FILES[curFile].fileHandle, curFile, FILES[curFile].path, FILES[curFile].length);
+	if (fd < 0){return(-1);}
+	int curFile = FS3_FD_SLOT(fd);
+	if (curFile >= __atomic_load_n(&fileCount, __ATOMIC_ACQUIRE)){return(-1);}
+	if (__atomic_load_n(&FILES[curFile].generation, __ATOMIC_RELAXED) != FS3_FD_GEN(fd)){return(-1);}
 	return (curFile);
 }
 ////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_track_index
-// Description  : find the index of the given track for the given file
-//				  
+// Function     : fs3_file_acquire
+// Description  : resolves a handle and locks its file, checking again
+//				  under the lock that the handle was not closed meanwhile
 //
-// Inputs       : curFile, track
-// Outputs      : track index
-int fs3_track_index(int curFile, int track){
-	int trackLen = META[curFile].trkLen;
-	int trkIdx;
-	boolean foundT = F;
-	for(int t=0; t<trackLen; t++){
-		if(META[curFile].trkArr[t] == track){
-			trkIdx = t;
-			foundT = T;
-		}
-		if(foundT == T){break;}
+// Inputs       : fd, exclusive - T to lock for changing the file
+// Outputs      : array index of fd with the lock held, -1 if failure
+
+int fs3_file_acquire(int16_t fd, boolean exclusive){
+	int curFile = fs3_fileLocation(fd);
+	if (curFile == -1){return(-1);}
+	if (exclusive == T){pthread_rwlock_wrlock(&FILES[curFile].lock);}
+	else {pthread_rwlock_rdlock(&FILES[curFile].lock);}
+	if ((FILES[curFile].isOpen != T) || (FILES[curFile].generation != FS3_FD_GEN(fd))){
+		pthread_rwlock_unlock(&FILES[curFile].lock);
+		return(-1);
 	}
-	return(trkIdx);
+	return(curFile);
 }
 ////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_total_pos
-// Description  : find the total position in a file
-//				  
+// Function     : fs3_path_hash
+// Description  : FNV-1a hash of a path
 //
-// Inputs       : curFile, sector, track
-// Outputs      : total position in file
-int fs3_sector_index(int curFile, int sector, int track){
-	int curTrk = fs3_track_index(curFile, track);
-	int secIdx;
-	boolean foundS =F;
+// Inputs       : path
+// Outputs      : the hash
 
-	if(META[curFile].secArr[curTrk]>1){
-		for(int s=0; s<META[curFile].secArr[curTrk]-1; s++){
-			if(META[curFile].secAccess[curTrk][s] == sector){
-				secIdx =s;
-				foundS = T;
-			}
-			if(foundS == T){break;}
-		}
+uint32_t fs3_path_hash(const char *path){
+	uint32_t hash = 2166136261u;
+	for (; *path != '\0'; path++){
+		hash = (hash ^ (uint8_t)*path) * 16777619u;
 	}
-	if(foundS == F){secIdx = 0;}
-
-	return(secIdx);
+	return(hash);
 }
+////////////////////////////////////////////////////////////////////////////////
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_total_pos
-// Description  : find the total position in a file
-//				  
+// Function     : fs3_path_lookup
+// Description  : finds the file with a path in the path index
 //
-// Inputs       : curFile, sector, track
-// Outputs      : total position in file
-int fs3_total_pos(int curFile, int sector, int track){
-	boolean foundS = F;
-	int secIdx = fs3_sector_index(curFile, sector, track);
-	
-	//// ADD MULTI TRACK IMPLEMENTATION LATER  ////
+// Inputs       : path, hash - the path and its fs3_path_hash
+// Outputs      : array index of the file, -1 if there is none
 
-	// 0) find index of current track in metaData
-	int curTrk = fs3_track_index(curFile, track);
-	
-	// 1) find index of current sector in metaData
-	/*
-	if (META[curFile].secArr[curTrk]>1){
-		for(int s=0; s<META[curFile].secArr[curTrk]-1; s++){
-			if (META[curFile].secAccess[curTrk][s] == sector){
-				secIdx = s;
-				foundS = T;
-			}
-			if(foundS == T){break;}
-		}
+int fs3_path_lookup(const char *path, uint32_t hash){
+	for (int i = pathIndex[hash % FS3_PATH_BUCKETS]; i != -1; i = NAMES[i].next){
+		if ((NAMES[i].hash == hash) && (strcmp(NAMES[i].path, path) == 0)){return(i);}
 	}
-	else{
-		secIdx = 0;
+	return(-1);
+}
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_extent_index
+// Description  : binary searches a file's extents for the one holding
+//				  the given sector of the file
+//
+// Inputs       : curFile, secIdx - sector number within the file
+// Outputs      : index into META[curFile].ext, -1 if not allocated
+
+int fs3_extent_index(int curFile, int secIdx){
+	int lo = 0, hi = META[curFile].extLen - 1;
+	if ((secIdx < 0) || (secIdx >= META[curFile].secLen)){return(-1);}
+	while (lo < hi){										// last extent starting at or before secIdx
+		int mid = (lo + hi + 1) / 2;
+		if (META[curFile].ext[mid].first <= secIdx){lo = mid;}
+		else {hi = mid - 1;}
 	}
-	*/
-	//if(foundS == F){secIdx = 0;}
-	// 2) multiple index by fs3_sector_size
-	int sectorSpan = secIdx * FS3_SECTOR_SIZE;
-	// 3) add current position
-	int totalPos = sectorSpan + FILES[curFile].position;
-
-	return(totalPos);
+	return(lo);
 }
+////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_find_sector
-// Description  : Find the next free sector and add it to a files metaData
-//				  
-//
-// Inputs       : curFile, track, sector
-// Outputs      : new found sector
-int fs3_find_sector(int curFile, int track, int sector){
-	int newSec;// = sector+1;
-	int checks=0;
-	int trkIdx = fs3_track_index(curFile, track);
-	boolean first = T;
-
-	for(int i=sector; i<FS3_SECTOR_SIZE; i++){	// loop through sectors
-		checks = -1;
-		first =T;
-	
-		for(int f=0; f<fileCount; i++){		// loop through all the files
-
-			for(int s=0; s<META[f].secArr[track]-1; s++){	// loop though the sectors on current track used
-				if(META[f].secAccess[trkIdx][s] == i){	//checks to see if the sector is used by that file
-					checks = 0;
-				}
-				if(checks == 0){	// break if sector is used
-					break;
-				}		
-			}
-			// end 
-			if(checks == 0){	// break if sector is used -> move to next sector
-				break;
-			}
+// Function     : fs3_file_run
+// Description  : finds where the given sector of a file lives on disk and
+//				  how many of the file's following sectors sit right after
+//				  it on the same track
+//
+// Inputs       : curFile, secIdx - sector number within the file
+//				  trk, sct - where to store the disk address
+// Outputs      : sectors in the run (at least 1), -1 if not allocated
+
+int fs3_file_run(int curFile, int secIdx, FS3TrackIndex *trk, FS3SectorIndex *sct){
+	int e = fs3_extent_index(curFile, secIdx);
+	if (e == -1){return(-1);}
+	struct fileExtent *ext = &META[curFile].ext[e];
+	*trk = ext->track;
+	*sct = ext->start + (secIdx - ext->first);
+	return(ext->length - (secIdx - ext->first));
+}
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_position
+// Description  : moves a file's position, caller holds its lock exclusive
+//				  or holds posLock
+//
+// Inputs       : curFile, loc - offset in the file
+// Outputs      : none
+
+void fs3_set_position(int curFile, int loc){
+	FS3TrackIndex trk;
+	FS3SectorIndex sct;
+	FILES[curFile].globalPos = loc;							// offset in the file
+	FILES[curFile].position = loc % FS3_SECTOR_SIZE;		// offset in the sector holding loc
+	if (fs3_file_run(curFile, loc / FS3_SECTOR_SIZE, &trk, &sct) != -1){	// O(log extents) lookup
+		FILES[curFile].track = trk;
+		FILES[curFile].sector = sct;
+	}
+}
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_extent_append
+// Description  : adds a newly allocated run of sectors to the end of a
+//				  file, growing the last extent when the run follows it
+//
+// Inputs       : curFile, trk, sct - the first sector allocated
+//				  count - sectors in the run
+// Outputs      : 0 if successful, -1 if failure
 
-			if((checks != 0) && (checks != fileCount)){		// sector isn't used add a check
-				if(first == T){checks=1;first=F;}
-				else{checks+=1;}
+int fs3_extent_append(int curFile, FS3TrackIndex trk, FS3SectorIndex sct, int count){
+	struct metaData *meta = &META[curFile];
+	struct fileExtent *last = (meta->extLen > 0) ? &meta->ext[meta->extLen - 1] : NULL;
 
-			}
-			if(checks == fileCount){
-				newSec = i+1;
-				break;}
-			logMessage(FS3DriverLLevel,"checks: %d",checks);
-		}
-		// end
-		if(checks == fileCount){break;}
-		
+	if ((last != NULL) && (last->track == trk) && (last->start + last->length == sct)){
+		last->length += count;								// contiguous, extend the run
+		meta->secLen += count;
+		return(0);
+	}
+	if (meta->extLen == meta->extMax){						// double the extent array
+		int max = (meta->extMax == 0) ? 4 : meta->extMax * 2;
+		struct fileExtent *ext = realloc(meta->ext, max * sizeof(struct fileExtent));
+		if (ext == NULL){return(-1);}
+		meta->ext = ext;
+		meta->extMax = max;
 	}
-	//end
-	if (checks==fileCount){		// assign the new sector value if all files give a check
-			//newSec = i;
-			META[curFile].secLen +=1;	// increase total sector len
-			//META[curFile].secArr = realloc(META[curFile].secArr, (META[curFile].secArr[trkIdx] + 1) * sizeof(int));
-			META[curFile].secArr[trkIdx]+=1;	// increase track sector len
-			META[curFile].secAccess[trkIdx] = realloc(META[curFile].secAccess[trkIdx], META[curFile].secArr[trkIdx] * sizeof(int));
-			META[curFile].secAccess[trkIdx][ META[curFile].secArr[trkIdx]-1 ] = newSec;	// assign sector to secAccess array
+	meta->ext[meta->extLen].first = meta->secLen;
+	meta->ext[meta->extLen].track = trk;
+	meta->ext[meta->extLen].start = sct;
+	meta->ext[meta->extLen].length = count;
+	meta->extLen++;
+	meta->secLen += count;
+	return(0);
+}
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_extent_truncate
+// Description  : gives back the sectors at the end of a file past a point,
+//				  e.g. those added by a write that failed
+//
+// Inputs       : curFile, secLen - the sectors the file keeps
+// Outputs      : none
+
+void fs3_extent_truncate(int curFile, int secLen){
+	struct metaData *meta = &META[curFile];
+
+	while (meta->secLen > secLen){
+		struct fileExtent *last = &meta->ext[meta->extLen - 1];
+		int drop = meta->secLen - secLen;
+		if (drop >= last->length){								// the whole run goes
+			drop = last->length;
+			meta->extLen--;
 		}
-	if(checks!= fileCount){newSec = -1;}	// if entire sector is ran though and sector isn't found return -1
+		fs3_alloc_free(last->track, last->start + last->length - drop, drop);
+		last->length -= drop;
+		meta->secLen -= drop;
+		meta->mapDirty = T;
+	}
+}
+////////////////////////////////////////////////////////////////////////////////
 
-	return(newSec);		// return the new secotr or -1 if none were found
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_find_sector
+// Description  : Allocate free sectors and add them to the end of a file,
+//				  as close after the file's last sector as the disk allows.
+//				  Room for the file's new extent map is held back first, so
+//				  data filling the disk can't leave the map unsavable
+//
+// Inputs       : curFile, want - sectors still needed
+// Outputs      : sectors added (at least 1), -1 if the disk is full
+
+int fs3_find_sector(int curFile, int want){
+	FS3TrackIndex hintTrk = FS3_ALLOC_NO_HINT, trk;
+	FS3SectorIndex hintSct = 0, sct;
+	int mapNeed = (META[curFile].extLen + FS3_META_EXTENTS_PER_SECTOR) / FS3_META_EXTENTS_PER_SECTOR;	// map with one more run
+	if (mapNeed > META[curFile].mapReserve){
+		if (fs3_alloc_reserve(mapNeed - META[curFile].mapReserve) == -1){return(-1);}
+		META[curFile].mapReserve = mapNeed;
+	}
+	if (META[curFile].extLen > 0){								// try to continue the last run
+		struct fileExtent *last = &META[curFile].ext[META[curFile].extLen - 1];
+		hintTrk = last->track;
+		hintSct = last->start + last->length;
+	}
+	int got = fs3_alloc_run(hintTrk, hintSct, want, &trk, &sct);
+	if (got == -1){return(-1);}
+	if (fs3_extent_append(curFile, trk, sct, got) == -1){
+		fs3_alloc_free(trk, sct, got);
+		return(-1);
+	}
+	META[curFile].mapDirty = T;
+	return(got);
 }
 ////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_find_track
-// Description  : Find the next track and add it to the files metaData
-//				  
+// Function     : fs3_load_file
+// Description  : Fill in a file from its on-disk directory entry, reading
+//				  its extent map
 //
-// Inputs       : curFile, track
-// Outputs      : new track
-int fs3_find_track(int curFile, int track){
-	int newtrack = track +1;
-	int trkIdx = fs3_track_index(curFile, track)+1;
+// Inputs       : curFile, entry - the file and its directory entry
+// Outputs      : 0 if successful, -1 if failure
 
-	META[curFile].trkLen+=1;	// increase total track length
-	META[curFile].secArr=realloc(META[curFile].secArr, META[curFile].trkLen * sizeof(int));		//increase secArr length
-	META[curFile].trkArr=realloc(META[curFile].trkArr, META[curFile].trkLen * sizeof(int));		//increase trkArr length
-	META[curFile].secAccess=realloc(META[curFile].secAccess, META[curFile].trkLen * sizeof(int *));	// increse secAccess length
-	META[curFile].secAccess[trkIdx]=realloc(META[curFile].secAccess[trkIdx], META[curFile].secArr[trkIdx] * sizeof(int));	// increse secAccess[trkIdx] length
+int fs3_load_file(int curFile, const FS3DirEntry *entry){
+	FS3DiskExtent *disk = malloc((entry->extents + 1) * sizeof(FS3DiskExtent));
+	if (disk == NULL){return(-1);}
+	if (fs3_meta_load_map(entry, disk) == -1){free(disk); return(-1);}
+	FILES[curFile].length = entry->length;
+	META[curFile].mapTrack = entry->mapTrack;
+	META[curFile].mapSector = entry->mapSector;
+	META[curFile].mapSectors = entry->mapSectors;
+	for (uint32_t i = 0; i < entry->extents; i++){
+		fs3_extent_append(curFile, disk[i].track, disk[i].start, disk[i].length);	// rebuilds first as it goes
+	}
+	free(disk);
+	return((META[curFile].secLen * FS3_SECTOR_SIZE >= FILES[curFile].length) ? 0 : -1);
+}
+////////////////////////////////////////////////////////////////////////////////
 
-	META[curFile].trkArr[trkIdx]=newtrack;
-	return(newtrack);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_save_meta
+// Description  : Write the directory entry and extent map of every file
+//				  changed since it was last saved, then the bitmap and
+//				  superblock
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_save_meta(void){
+	int result = 0;
+	pthread_mutex_lock(&tableLock);
+	for (int i = 0; i < fileCount; i++){
+		pthread_rwlock_rdlock(&FILES[i].lock);					// layout can't change while saved
+		if (META[i].dirty == F){									// unchanged, entry on disk is current
+			pthread_rwlock_unlock(&FILES[i].lock);
+			continue;
+		}
+		FS3DirEntry entry;
+		FS3DiskExtent *disk = NULL;								// only when the runs changed
+		if ((META[i].mapDirty == T) && ((disk = malloc((META[i].extLen + 1) * sizeof(FS3DiskExtent))) == NULL)){
+			pthread_rwlock_unlock(&FILES[i].lock);
+			pthread_mutex_unlock(&tableLock);
+			return(-1);
+		}
+		memset(&entry, 0x0, sizeof(entry));
+		size_t pathLen = strnlen(NAMES[i].path, FS3_MAX_PATH_LENGTH);	// open refuses longer paths
+		memcpy(entry.path, NAMES[i].path, pathLen);
+		if (pathLen < FS3_MAX_PATH_LENGTH){entry.path[pathLen] = '\0';}	// unterminated only when it fills the field
+		entry.length = FILES[i].length;
+		entry.extents = META[i].extLen;
+		entry.mapTrack = META[i].mapTrack;						// old map, freed by the store
+		entry.mapSector = META[i].mapSector;
+		entry.mapSectors = META[i].mapSectors;
+		for (int e = 0; (disk != NULL) && (e < META[i].extLen); e++){
+			disk[e].track = META[i].ext[e].track;
+			disk[e].start = META[i].ext[e].start;
+			disk[e].length = META[i].ext[e].length;
+			disk[e].reserved = 0;
+		}
+		if (fs3_meta_store(NAMES[i].dirSlot, &entry, disk) == -1){
+			logMessage(LOG_ERROR_LEVEL, "cannot save the metadata of %s", NAMES[i].path);
+			result = -1;
+		}
+		else {
+			META[i].dirty = F;
+			if (disk != NULL){									// new map written, its reserve is spent
+				META[i].mapDirty = F;
+				fs3_alloc_reserve(-META[i].mapReserve);
+				META[i].mapReserve = 0;
+			}
+		}
+		META[i].mapTrack = entry.mapTrack;
+		META[i].mapSector = entry.mapSector;
+		META[i].mapSectors = entry.mapSectors;
+		free(disk);
+		pthread_rwlock_unlock(&FILES[i].lock);
+	}
+	if (fs3_meta_checkpoint() == -1){result = -1;}
+	pthread_mutex_unlock(&tableLock);
+	return(result);
 }
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -338,22 +498,150 @@ FS3CmdBlk construct_fs3_cmdblock(uint8_t op, uint16_t sec, uint_fast32_t trk, ui
 // Outputs      : return value
 
 int deconstruct_fs3_cmdblock(FS3CmdBlk cmdblock, uint8_t *op, uint16_t *sec, uint32_t *trk, uint8_t *ret){
-	
-	uint8_t tempOp = (cmdblock&0xff) >> 60;  // assign the op address to tempOp
-	op = &tempOp;							// derefernce *op
+	*op = (cmdblock >> 60) & 0xf;					// op code is the top 4 bits
+	*sec = (cmdblock >> 44) & 0xffff;				// sector below it
+	*trk = (cmdblock >> 12) & 0xffffffff;			// then the track
+	*ret = (cmdblock >> 11) & 0x1;					// and the return bit
+	return(*ret);							// return the return value
+}
 
-	uint16_t tempSec = (cmdblock&0xffff) >> 44;		// assign the sec address to tempSec
-	sec = &tempSec;									// derefernce *sec
 
-	uint32_t tempTrk = (cmdblock&0xffffffff) >> 12;	// assign the trk address to tempTrk
-	trk = &tempTrk;									// derefernce *trk
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readahead_reset
+// Description  : forgets any stream seen on a file, called on open
+//
+// Inputs       : curFile
+// Outputs      : none
+
+void fs3_readahead_reset(int curFile){
+	FILES[curFile].raNext = 0;
+	FILES[curFile].raEnd = 0;
+	FILES[curFile].raWindow = 0;
+	FILES[curFile].raWasted = fs3_prefetch_wasted();
+}
+////////////////////////////////////////////////////////////////////////////////
 
-	uint8_t tempRet = (cmdblock&0xff) >> 11;		// assign the ret address to tempRet
-	ret = &tempRet;									//// derefernce *ret
-	return(0);							// return the return value
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readahead
+// Description  : watches the reads on a file and, once they run front to
+//				  back, prefetches the sectors after them into the cache.
+//				  The window doubles while the stream continues and halves
+//				  when prefetched sectors are evicted before being read
+//
+// Inputs       : curFile, start - file offset read from, count - bytes read
+// Outputs      : none
+
+void fs3_readahead(int curFile, int start, int count){
+	int last = (start + count - 1) / FS3_SECTOR_SIZE;		// last sector the read touched
+	FS3TrackIndex raTrk;
+	FS3SectorIndex raSec;
+
+	if (count <= 0){return;}
+	if (start != FILES[curFile].raNext){						// not sequential, stop reading ahead
+		FILES[curFile].raNext = start + count;
+		FILES[curFile].raEnd = 0;
+		FILES[curFile].raWindow = 0;
+		return;
+	}
+	FILES[curFile].raNext = start + count;
+
+		//  size the window, never more than half the cache  //
+	int wasted = fs3_prefetch_wasted();
+	int cap = fs3_cache_lines() / 2;
+	if (cap > FS3_RA_MAX){cap = FS3_RA_MAX;}
+	if (cap < 1){return;}
+	boolean shrunk = F;
+	if (wasted > FILES[curFile].raWasted){						// prefetched too far ahead, back off
+		FILES[curFile].raWindow /= 2;
+		if (FILES[curFile].raWindow < 1){FILES[curFile].raWindow = 1;}
+		shrunk = T;
+	}
+	FILES[curFile].raWasted = wasted;
+	if (last + 1 + FILES[curFile].raWindow / 2 < FILES[curFile].raEnd){return;}	// still well inside the last readahead
+	if (FILES[curFile].raWindow == 0){FILES[curFile].raWindow = FS3_RA_MIN;}
+	else if (shrunk == F){FILES[curFile].raWindow *= 2;}
+	if (FILES[curFile].raWindow > cap){FILES[curFile].raWindow = cap;}
+
+		//  prefetch what has not been read ahead already, a run at a time  //
+	int from = (FILES[curFile].raEnd > last + 1) ? FILES[curFile].raEnd : last + 1;
+	int to = last + 1 + FILES[curFile].raWindow;
+	int inFile = (FILES[curFile].length + FS3_SECTOR_SIZE - 1) / FS3_SECTOR_SIZE;
+	if (to > inFile){to = inFile;}
+	for (int i = from; i < to; ){
+		int run = fs3_file_run(curFile, i, &raTrk, &raSec);
+		if (run == -1){break;}
+		if (run > to - i){run = to - i;}
+		for (int k = 0; k < run; k++){
+			if (fs3_prefetch_sector(raTrk, raSec + k) == -1){run = -1; break;}
+		}
+		if (run == -1){break;}
+		i += run;
+	}
+	FILES[curFile].raEnd = to;
 }
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readin_sector
+// Description  : reads a sector from disk, used by the cache to fill
+//				  sectors that are pinned but not cached; the sector's
+//				  checksum is checked here, once, so cache hits pay nothing
+//
+// Inputs       : track, sector, buf
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_readin_sector(FS3TrackIndex track, FS3SectorIndex sector, void *buf){
+	if (diskIsAttached == F){return(-1);}
+	int result = fs3_sched_io(FS3_OP_RDSECT, track, sector, buf);
+	if (result == -1){return(-1);}
+	if (result == 1){return(0);}								// a queued write, checksummed once it is on the disk
+	return(fs3_crc_sector_read(track, sector, buf));			// corrupt or torn sectors never enter the cache
+}
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_writeback_sector
+// Description  : writes a sector to disk, used by the cache to write back
+//				  dirty lines; the scheduler records the sector's checksum
+//				  once the write succeeds
+//
+// Inputs       : track, sector, buf
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_writeback_sector(FS3TrackIndex track, FS3SectorIndex sector, void *buf){
+	if (diskIsAttached == F){return(-1);}
+	return(fs3_sched_io(FS3_OP_WRSECT, track, sector, buf));
+}
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_mount_undo
+// Description  : backs out a mount that failed part way, freeing the file
+//				  table and unmounting the controller again
+//
+// Inputs       : none
+// Outputs      : none
+
+void fs3_mount_undo(void){
+	fs3_crc_unmount();
+	free(META);
+	free(NAMES);
+	free(FILES);
+	META = NULL;
+	NAMES = NULL;
+	FILES = NULL;
+	fs3_sched_close();
+	fs3_sched_command(construct_fs3_cmdblock(FS3_OP_UMOUNT,0,0,0), NULL);
+	diskIsAttached = F;
+}
 ////////////////////////////////////////////////////////////////////////////////
 
 
@@ -361,23 +649,49 @@ int deconstruct_fs3_cmdblock(FS3CmdBlk cmdblock, uint8_t *op, uint16_t *sec, uin
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_mount_disk
-// Description  : FS3 interface, mount/initialize filesystem
+// Description  : FS3 interface, mount/initialize filesystem; not to be
+//				  called while any other driver call is running.  The disk
+//				  only counts as mounted once every step has succeeded
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
 int32_t fs3_mount_disk(void) {
+	uint8_t op, ret;
+	uint16_t sec;
+	uint32_t trk;
+
 	if (diskIsMounted == T){  // check if disk is already mounted (global variable)
 		return(-1);
 	}
-	else{
-		command = fs3_syscall(construct_fs3_cmdblock(0,0,0,0), calls);
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-		diskIsMounted = T;										// set diskIsMounted to TRUE
-		
+	FS3CmdBlk command = fs3_sched_command(construct_fs3_cmdblock(FS3_OP_MOUNT,0,0,0), NULL);	// whichever controller the scheduler drives
+	if (deconstruct_fs3_cmdblock(command, &op, &sec, &trk, &ret) != 0){return(-1);}
+	diskIsAttached = T;											// sectors can be moved, no filesystem yet
+	fs3_sched_init();										// head position unknown after mount
+	fs3_sched_set_written(fs3_crc_sector_written);			// checksum sectors as they reach the disk
+	fs3_set_cache_reader(fs3_readin_sector);				// let the cache read in pinned sectors
+	fs3_set_cache_writer(fs3_writeback_sector);				// let the cache write back dirty sectors
+	if (fs3_meta_mount() == -1){							// superblock and free-space bitmap, files load on open
+		logMessage(LOG_ERROR_LEVEL, "cannot read the filesystem metadata");
+		fs3_mount_undo();
+		return(-1);
+	}
+	FILES = (struct fileParts *)malloc(FS3_MAX_TOTAL_FILES * sizeof(struct fileParts));	// room for every file up front
+	NAMES = (struct fileNames *)malloc(FS3_MAX_TOTAL_FILES * sizeof(struct fileNames));
+	META = (struct metaData *)malloc(FS3_MAX_TOTAL_FILES * sizeof(struct metaData));
+	if ((FILES == NULL) || (NAMES == NULL) || (META == NULL)){
+		logMessage(LOG_ERROR_LEVEL, "cannot allocate the file table");
+		fs3_mount_undo();
+		return(-1);
+	}
+	memset(pathIndex, 0xff, sizeof(pathIndex));					// every bucket empty (-1)
+	fileCount = 0;
+	if (fs3_aio_start(fs3_io_execute) == -1){					// reads and writes go through the queue
+		logMessage(LOG_ERROR_LEVEL, "cannot start the I/O dispatchers");
+		fs3_mount_undo();
+		return(-1);
 	}
-	FILES = (struct fileParts *)malloc(fileCount * sizeof(struct fileParts));	// initialize FILES struct
-	//META = (struct metaData *)malloc(fileCount * sizeof(struct metaData));	// initialize FILES struct
+	diskIsMounted = T;										// set diskIsMounted to TRUE
 	return(0);
 }
 
@@ -387,23 +701,50 @@ int32_t fs3_mount_disk(void) {
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_unmount_disk
-// Description  : FS3 interface, unmount the disk, close all files
+// Description  : FS3 interface, unmount the disk, close all files; not to
+//				  be called while any other driver call is running.  The
+//				  disk is unmounted even if writing something back fails
 //
 // Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
+// Outputs      : 0 if successful, -1 if any metadata or sector could not
+//				  be written back
 
 int32_t fs3_unmount_disk(void) {
+	int result = 0;
+	uint8_t op, ret;
+	uint16_t sec;
+	uint32_t trk;
+
 	if (diskIsMounted == F){return(-1);}									// test to make sure the disk is mounted
-	for (int i=0; i<fileCount-1; i++){												// loop through all the files
-		if (FILES[i].isOpen == T){
-		fs3_close(i+3);														// if file is open close it
-		}														
+	fs3_aio_stop();															// finish the requests still queued
+	fs3_sched_plug();
+	if (fs3_save_meta() == -1){result = -1;}								// directory, extent maps and bitmap
+	if (fs3_flush_cache() == -1){result = -1;}								// write back dirty sectors before unmount
+	if (fs3_sched_unplug() == -1){result = -1;}
+	if (fs3_crc_flush() == -1){result = -1;}								// then the checksums of what was written
+	fs3_crc_unmount();
+	for (int i=0; i<fileCount; i++){										// close every file, already written back above
+		FILES[i].isOpen = F;
+		pthread_rwlock_destroy(&FILES[i].lock);
+		pthread_mutex_destroy(&FILES[i].posLock);
+		free(META[i].ext);													// drop the extent maps
+		fs3_digest_free(&META[i].digest);
+		free(NAMES[i].path);
 	}
+	free(META);
+	free(NAMES);
 	free(FILES);
-	command = fs3_syscall(construct_fs3_cmdblock(4,0,0,0),calls);				// call the unmount syscall
-	deconstruct_fs3_cmdblock(command, op, sec, trk, ret);					// deconstruct the command block
+	META = NULL;
+	NAMES = NULL;
+	FILES = NULL;
+	fileCount = 0;
+	if (fs3_sched_close() == -1){result = -1;}								// dispatch anything still queued
+	FS3CmdBlk command = fs3_sched_command(construct_fs3_cmdblock(FS3_OP_UMOUNT,0,0,0), NULL);	// call the unmount syscall
+	if (deconstruct_fs3_cmdblock(command, &op, &sec, &trk, &ret) != 0){result = -1;}
 	diskIsMounted = F;														// set diskIsMounted to false
-	return(0);																// return 0 if successful
+	diskIsAttached = F;
+	if (result == -1){logMessage(LOG_ERROR_LEVEL, "unmount could not write everything back");}
+	return(result);
 
 }
 
@@ -419,67 +760,85 @@ int32_t fs3_unmount_disk(void) {
 // Outputs      : file handle if successful, -1 if failure
 
 int16_t fs3_open(char *path) {
-	int fh=0;
-
 	logMessage(FS3DriverLLevel,"start open function");
-	boolean fileExists = F;												// local variable to see if file exists
-	
-
-	
-	if (fileCount > 0){
-		for(int i =0; i<=fileCount-1; i++){
-			if((FILES[i].path == path) && (FILES[i].isOpen == F)){
-				fh = FILES[i].fileHandle;
-				FILES[i].isOpen = T;
-				FILES[i].position = 0;
-				FILES[i].globalPos=0;
-				FILES[i].track = i+1;
-				FILES[i].sector=0;
-				fileExists = T;
-			}
-			else if((FILES[i].path == path) && (FILES[i].isOpen == T)){return(-1);}
-			if(fileExists == T){break;}
+	if ((diskIsMounted == F) || (path == NULL)){return(-1);}
+	if (strnlen(path, FS3_MAX_PATH_LENGTH + 1) > FS3_MAX_PATH_LENGTH){return(-1);}
+	uint32_t hash = fs3_path_hash(path);
+	pthread_mutex_lock(&tableLock);
+	int fileIdx = fs3_path_lookup(path, hash);					// O(1) by path hash
+
+	if (fileIdx != -1){											// file already loaded
+		pthread_rwlock_wrlock(&FILES[fileIdx].lock);
+		if (FILES[fileIdx].isOpen == T){
+			pthread_rwlock_unlock(&FILES[fileIdx].lock);
+			pthread_mutex_unlock(&tableLock);
+			return(-1);
 		}
-	}	
-	
-	if (fileExists == F){											// if file doesn't already exist
-		fileCount +=1;
-		int fileIdx = fileCount -1;
-		FILES = realloc(FILES, fileCount*sizeof(struct fileParts));	// increse size of FILES struct
-		META = realloc(META, fileCount*sizeof(struct metaData)); // increase size of META struct
-		fh = fileCount+2;
-		FILES[fileIdx].path = path;
+	}
+	else {														// first open since mount, take the next slot
+		if (fileCount == FS3_MAX_TOTAL_FILES){
+			logMessage(LOG_ERROR_LEVEL, "cannot open %s, %d files already exist", path, fileCount);
+			pthread_mutex_unlock(&tableLock);
+			return(-1);
+		}
+		fileIdx = fileCount;
+		NAMES[fileIdx].path = strdup(path);					// intern our own copy
+		if (NAMES[fileIdx].path == NULL){pthread_mutex_unlock(&tableLock); return(-1);}
 		FILES[fileIdx].length = 0;
-		FILES[fileIdx].position = 0;
-		FILES[fileIdx].globalPos = 0;
-		FILES[fileIdx].isOpen = T;
-		FILES[fileIdx].fileHandle = fh;
-		
-		META[fileIdx].secLen=1;	// increase total sector length
-		META[fileIdx].trkLen=1;	// increase track length
-		
-		META[fileIdx].secArr = (int *)malloc(sizeof(int));	// allocate space for secArr 
-		META[fileIdx].secArr[0] = 0;		// assign the first sector as sector 0 to the first track 
-		
-		META[fileIdx].trkArr = (int *)malloc(sizeof(int));     // allocate space for trkArr
-		META[fileIdx].trkArr[0]=0;			// assign the first track as track 0
-
-		META[fileIdx].secAccess = (int **)malloc(sizeof(int *));		// allocate space for 2d array
-		if(META[fileIdx].secAccess){
-			for(int i=0; i<META[fileIdx].trkLen; i++){
-				META[fileIdx].secAccess[i] = (int *)malloc(sizeof(int));
+		FILES[fileIdx].generation = 1;
+		META[fileIdx].secLen=0;	// no sectors until the first write
+		META[fileIdx].extLen=0;
+		META[fileIdx].extMax=0;
+		META[fileIdx].ext=NULL;
+		META[fileIdx].mapSectors=0;
+		META[fileIdx].dirty=F;
+		META[fileIdx].mapDirty=F;
+		META[fileIdx].mapReserve=0;
+		META[fileIdx].digest.node=NULL;
+		META[fileIdx].digest.leaves=0;
+		META[fileIdx].digestBuilt=F;	// built on first use if the file is on disk
+
+		FS3DirEntry entry;
+		NAMES[fileIdx].dirSlot = fs3_meta_find(path, hash, &entry);	// on disk from an earlier mount?
+		if (NAMES[fileIdx].dirSlot != -1){
+			if (fs3_load_file(fileIdx, &entry) == -1){
+				logMessage(LOG_ERROR_LEVEL, "cannot load the extent map of %s", path);
+				free(META[fileIdx].ext);
+				free(NAMES[fileIdx].path);
+				pthread_mutex_unlock(&tableLock);
+				return(-1);
 			}
 		}
-		META[fileIdx].secAccess[0][0]= fileIdx;		// assign first sector
-
-		FILES[fileIdx].sector = META[fileIdx].secAccess[0][0]; // set the current sector
-		FILES[fileIdx].track = META[fileIdx].trkArr[0];		// set the current track
-		fileExists = T;
+		else if ((NAMES[fileIdx].dirSlot = fs3_meta_claim(hash)) != -1){
+			META[fileIdx].dirty = T;							// new file, no entry written yet
+			META[fileIdx].digestBuilt = T;						// empty, every write keeps it current
+		}
+		else {
+			logMessage(LOG_ERROR_LEVEL, "cannot create %s, the directory is full", path);
+			free(NAMES[fileIdx].path);
+			pthread_mutex_unlock(&tableLock);
+			return(-1);
+		}
+		NAMES[fileIdx].hash = hash;
+		NAMES[fileIdx].next = pathIndex[hash % FS3_PATH_BUCKETS];
+		pathIndex[hash % FS3_PATH_BUCKETS] = fileIdx;
+		pthread_rwlock_init(&FILES[fileIdx].lock, NULL);
+		pthread_mutex_init(&FILES[fileIdx].posLock, NULL);
+		pthread_rwlock_wrlock(&FILES[fileIdx].lock);
+		__atomic_store_n(&fileCount, fileCount + 1, __ATOMIC_RELEASE);	// handles to it resolve from here
 	}
+
+	FILES[fileIdx].isOpen = T;
+	FILES[fileIdx].track = 0;
+	FILES[fileIdx].sector = 0;
+	fs3_set_position(fileIdx, 0);							// start of the file, if it has any sectors
+	fs3_readahead_reset(fileIdx);
 	
-	
-	logMessage(FS3DriverLLevel,"file handle given: %d",fh);// FILES.fileHandle[x]);
-	return(fh); // if it hits here it fails so i guess -1
+	int fh = (FILES[fileIdx].generation << FS3_FD_SLOT_BITS) | fileIdx;
+	pthread_rwlock_unlock(&FILES[fileIdx].lock);
+	pthread_mutex_unlock(&tableLock);
+	logMessage(FS3DriverLLevel,"file handle given: %d",fh);
+	return(fh);
 }
 
 
@@ -489,7 +848,8 @@ int16_t fs3_open(char *path) {
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_close
-// Description  : This function closes the file
+// Description  : This function closes the file, writing back the file's
+//				  dirty sectors; the handle is closed even if that fails
 //
 // Inputs       : fd - the file descriptor
 // Outputs      : 0 if successful, -1 if failure
@@ -498,28 +858,24 @@ int16_t fs3_open(char *path) {
 
 
 int16_t fs3_close(int16_t fd) {
-	
-	
-	boolean fileExists =F;										// determine if the file exists
-	int fileIdx = fileCount -1;
-	for (int i = 0; i<fileIdx; i++){
-		if (FILES[i].fileHandle == fd){							// validate the file handle
-			fileExists = T;
-			if (FILES[i].isOpen==F){return(-1);}				// fail if the file is NOT open
-
-			else if (FILES[i].isOpen==T){
-			FILES[i].isOpen = F;								// set the file to closed
-			logMessage(FS3DriverLLevel, "this is %s close", FILES[i].path);
-			FILES[i].position =0;								// set the file position to 0
-			FILES[i].sector =0;
-			return(0);
-			}
-		}
+	int curFile = fs3_file_acquire(fd, T);					// validate the file handle, fail if not open
+	int result = 0;
+
+	if (curFile == -1){return(-1);}
+	fs3_sched_plug();
+	for (int e = 0; e < META[curFile].extLen; e++){			// write back only this file's sectors
+		if (fs3_flush_cache_run(META[curFile].ext[e].track, META[curFile].ext[e].start, META[curFile].ext[e].length) == -1){result = -1;}
 	}
-	if (fileExists == F){return(-1);}							// fail if file does not exist
-	
-	
-	return(-1);			// if it gets here it fails so i guess -1
+	if (fs3_sched_unplug() == -1){result = -1;}
+	if (fs3_crc_flush() == -1){result = -1;}					// checksums of the sectors just written
+	FILES[curFile].isOpen = F;								// set the file to closed
+	__atomic_store_n(&FILES[curFile].generation, FILES[curFile].generation % FS3_FD_GENERATIONS + 1, __ATOMIC_RELAXED);	// old handle goes stale
+	FILES[curFile].position =0;								// set the file position to 0
+	FILES[curFile].sector =0;
+	pthread_rwlock_unlock(&FILES[curFile].lock);
+	if (result == -1){logMessage(LOG_ERROR_LEVEL, "cannot write back %s on close", NAMES[curFile].path);}
+	logMessage(FS3DriverLLevel, "this is %s close", NAMES[curFile].path);
+	return(result);
 }
 
 	
@@ -529,505 +885,377 @@ int16_t fs3_close(int16_t fd) {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_read
-// Description  : Reads "count" bytes from the file handle "fh" into the 
-//                buffer "buf"
+// Function     : fs3_iov_total
+// Description  : adds up the lengths of an iovec list
+//
+// Inputs       : iov - the buffers, iovcnt - number of buffers
+// Outputs      : total bytes if valid, -1 if the list is bad or too long
+
+int32_t fs3_iov_total(const struct iovec *iov, int iovcnt){
+	int64_t total = 0;
+	if (((iov == NULL) && (iovcnt > 0)) || (iovcnt < 0) || (iovcnt > IOV_MAX)){return(-1);}
+	for (int i = 0; i < iovcnt; i++){
+		total += iov[i].iov_len;
+		if (total > INT32_MAX){return(-1);}
+	}
+	return((int32_t)total);
+}
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_iov_copy
+// Description  : copies between a run of bytes in a sector and the iovec
+//				  list, advancing the list cursor past what was copied
+//
+// Inputs       : sector - bytes in the sector, span - how many
+//				  iov, idx, off - the buffers and the cursor into them
+//				  toSector - copy from the buffers into the sector
+// Outputs      : none
+
+void fs3_iov_copy(char *sector, int span, const struct iovec *iov, int *idx, size_t *off, boolean toSector){
+	int copied = 0;
+	while (copied < span){
+		size_t piece = iov[*idx].iov_len - *off;
+		if (piece > (size_t)(span - copied)){piece = span - copied;}
+		if (piece == 0){}											// empty buffer, nothing to copy
+		else if (toSector == T){memcpy(sector + copied, (char *)iov[*idx].iov_base + *off, piece);}
+		else {memcpy((char *)iov[*idx].iov_base + *off, sector + copied, piece);}
+		copied += piece;
+		*off += piece;
+		if (*off == iov[*idx].iov_len){(*idx)++; *off = 0;}		// on to the next buffer
+	}
+}
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_file_readv
+// Description  : Reads into several buffers in one pass over the file,
+//				  each sector is pinned once however many buffers it fills;
+//				  run by the I/O dispatchers
 //
 // Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
+//                iov - the buffers to read into
+//                iovcnt - number of buffers
 // Outputs      : bytes read if successful, -1 if failure
 
-int32_t fs3_read(int16_t fd, void *buf, int32_t count) {	 
+int32_t fs3_file_readv(int16_t fd, const struct iovec *iov, int iovcnt) {
 
 	   ////     Files Tests     ////
-	int curFile = fs3_fileLocation(fd);
+	int32_t count = fs3_iov_total(iov, iovcnt);
+	if(count == -1){return(-1);}
+	int curFile = fs3_file_acquire(fd, F);						// shared, other readers run alongside
 	if(curFile == -1){return(-1);}
-	if(FILES[curFile].isOpen==F){return(-1);}
-	  
-	  ////	   call seek syscall    ////
-	curTrk = FILES[curFile].track;
-	curSec = FILES[curFile].sector;
-	readBuffer = fs3_get_cache(curTrk, curSec);
-	if(readBuffer == NULL){
-		readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-		fs3_put_cache(curTrk,curSec,readBuffer); 
-	}
-
 
-	command = fs3_syscall(construct_fs3_cmdblock(1, 0, FILES[curFile].track, 0), readBuffer);	// call the strk syscall
-	deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-	
-	////	Requires only 1 sector     ////
-
-	if ((FS3_SECTOR_SIZE - FILES[curFile].position)>=count){			// test to see if count < the space between position and end of sec
-
-				////    create buffers    ////
-		
-		curTrk = FILES[curFile].track;
-		curSec = FILES[curFile].sector;
-		readBuffer = fs3_get_cache(curTrk, curSec);
-		if(readBuffer == NULL){
-			readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-			fs3_put_cache(curTrk,curSec,readBuffer); 
-		}
-		command = fs3_syscall(construct_fs3_cmdblock(2, FILES[curFile].sector,0,0), readBuffer);			// perform read
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-		
-		char *localBuf0 = (char *)malloc(FS3_SECTOR_SIZE);		// create char buf to store read data
-
-		memcpy(localBuf0, readBuffer, (FS3_SECTOR_SIZE));			// copy read data into char buffer
-		char *newBuf = (char *)malloc((count));	// create a buffer the size of count
-
-		int staticPos= FILES[curFile].position;		// set var for loop
-		int counter =0;
-
-		for(int pos = staticPos; pos<staticPos+count; pos++){				// collect wanted data
-			newBuf[counter]=localBuf0[pos];						// read localBuf0 and write to newBuf
-			
-				counter+=1;
-			
-		}
-		free(localBuf0);
-		localBuf0 = NULL;
-		memcpy(buf, newBuf, (count));//*sizeof(char)); //copy read data into buf
-		free(newBuf);		// free newBuf
-		newBuf=NULL;
-			//  update position  //
-		int fPos = fs3_total_pos(curFile, FILES[curFile].sector, FILES[curFile].track) + count;
-		
-		fs3_seek(fd, fPos);
-		logMessage(FS3DriverLLevel, "end of single read");
-		
-	}	
-
-	////	Multiple Sectors    ////
-
-	else{
-		logMessage(FS3DriverLLevel,"begin multi sector read");
-					////    create counts     ////
-		int count1 = FS3_SECTOR_SIZE - FILES[curFile].position;		//first count
-		int count2 = (count- count1)% FS3_SECTOR_SIZE;				// last count	
-		int loopCount = (count-count1)/FS3_SECTOR_SIZE;				// number of sector counts
-		int bufTracker =0;											// keep track of location inside merge buf
-
-					////    create buffers    ////
-		char *mergeBuf=(char *)malloc((count));		// allocate space of count*sizeof(char) to hold all read data
-		
-		
-					////   start of count1 read    ////
-		
-		curTrk = FILES[curFile].track;
-		curSec = FILES[curFile].sector;
-		readBuffer = fs3_get_cache(curTrk, curSec);
-		if(readBuffer == NULL){
-			readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-			fs3_put_cache(curTrk,curSec,readBuffer); 
+	////	Claim the bytes to read by moving the position past them    ////
+	pthread_mutex_lock(&FILES[curFile].posLock);
+	int start = FILES[curFile].globalPos;
+	if (count > FILES[curFile].length - start){count = FILES[curFile].length - start;}	// stop at end of file
+	fs3_set_position(curFile, start + count);
+	pthread_mutex_unlock(&FILES[curFile].posLock);
+
+	////	Copy each sector straight out of its pinned buffer    ////
+	int done = 0, iovIdx = 0, runLeft = 0;
+	size_t iovOff = 0;
+	FS3TrackIndex curTrk;
+	FS3SectorIndex curSec;
+	int owner = fs3_set_cache_owner(curFile);						// count the references against the file
+	fs3_sched_plug();												// batch write-backs from evictions
+	while (done < count){
+		int secIdx = (start + done) / FS3_SECTOR_SIZE;
+		int secOff = (start + done) % FS3_SECTOR_SIZE;
+		int span = FS3_SECTOR_SIZE - secOff;						// bytes left in the current sector
+		if (span > count - done){span = count - done;}
+
+		if (runLeft == 0){											// look up the next run of sectors
+			runLeft = fs3_file_run(curFile, secIdx, &curTrk, &curSec);
+			if (runLeft == -1){break;}
 		}
+		char *sector = fs3_pin_sector(curTrk, curSec, FS3_PIN_READ);
+		if (sector == NULL){break;}
+		fs3_iov_copy(sector + secOff, span, iov, &iovIdx, &iovOff, F);
+		fs3_unpin_sector(curTrk, curSec);
+		done += span;
+		if (secOff + span == FS3_SECTOR_SIZE){runLeft--; curSec++;}	// on to the next sector of the run
+	}
+	fs3_set_cache_owner(owner);
+	pthread_mutex_lock(&FILES[curFile].posLock);
+	if (done < count){												// failed, give back what was not read
+		if (FILES[curFile].globalPos == start + count){fs3_set_position(curFile, start);}
+		count = -1;
+	}
+	else {fs3_readahead(curFile, start, count);}
+	pthread_mutex_unlock(&FILES[curFile].posLock);
+	pthread_rwlock_unlock(&FILES[curFile].lock);
+	if ((fs3_sched_unplug() == -1) || (count == -1)){return(-1);}
 
-		command = fs3_syscall(construct_fs3_cmdblock(2,FILES[curFile].sector, 0, 0), readBuffer);		// perform read
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);		
+	////	return     ////
+	logMessage(FS3DriverLLevel,"value returned: %d", count);
+	return(count);
+}
+////////////////////////////////////////////////////////////////////////////////
 
-					// create local buffer and copy data //
-		char *localBuf = (char *)malloc(FS3_SECTOR_SIZE);		// allocate char buffer for read data
 
-		memcpy(localBuf, readBuffer, FS3_SECTOR_SIZE);					// copy read data over to char buffer
-					//    copy wanted data into merge   //
-		int staticPos = FILES[curFile].position;
-		for(int pos = staticPos; pos<staticPos+count1;pos++){
-			mergeBuf[bufTracker] = localBuf[pos];
-			if(pos<staticPos+count1){
-			bufTracker+=1;
-			}
-		}
-		free(localBuf);		// free localBuf
-		localBuf=NULL;
-					//    update file position    //
-		int fPos = fs3_total_pos(curFile, FILES[curFile].sector, FILES[curFile].track) + count1;
-		//FILES[curFile].position=0;
-		//FILES[curFile].sector+=1;
-		fs3_seek(fd, fPos);
-				////     Loop for Multi read     ////
-		if(loopCount>0){
-			logMessage(FS3DriverLLevel, "start loop for multi read");
-			for(int i=1; i<=loopCount;i++){				// loop for number of whole sectors
-				
-				curTrk = FILES[curFile].track;
-				curSec = FILES[curFile].sector;
-				readBuffer = fs3_get_cache(curTrk, curSec);
-				if(readBuffer == NULL){
-					readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-					fs3_put_cache(curTrk,curSec,readBuffer); 
-				}
-
-				command = fs3_syscall(construct_fs3_cmdblock(2, FILES[curFile].sector, 0,0),readBuffer);
-				deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-				char *tempLoc = (char *)malloc(FS3_SECTOR_SIZE);			// allocate space to store read data
-
-				memcpy(tempLoc, readBuffer, FS3_SECTOR_SIZE);	//copy read data into char buffer
-				for(int pos=0; pos<FS3_SECTOR_SIZE;pos++){
-					mergeBuf[bufTracker] = tempLoc[pos];
-					
-						bufTracker+=1;
-					
-				}
-				fPos = fs3_total_pos(curFile, FILES[curFile].sector, FILES[curFile].track) + FS3_SECTOR_SIZE;
-				//FILES[curFile].sector+=1;
-				fs3_seek(fd, fPos);
-				free(tempLoc);
-				tempLoc = NULL;
-			}
-							// fill in later if needed  //
-		}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_read
+// Description  : Reads "count" bytes from the file handle "fh" into the 
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
 
-				//// start of count2 read   ////
-		logMessage(FS3DriverLLevel,"begin count2 read");
+int32_t fs3_read(int16_t fd, void *buf, int32_t count) {
+	FS3IoRequest req = { .op = FS3_IO_READ, .fd = fd, .buf = buf, .count = count };
+	return(fs3_submit_wait(&req));							// queue it and wait for a dispatcher
+}
+////////////////////////////////////////////////////////////////////////////////
 
-		curTrk = FILES[curFile].track;
-		curSec = FILES[curFile].sector;
-		readBuffer = fs3_get_cache(curTrk, curSec);
-		if(readBuffer == NULL){
-			readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-			fs3_put_cache(curTrk,curSec,readBuffer); 
-		}
-		command = fs3_syscall(construct_fs3_cmdblock(2, FILES[curFile].sector, 0,0), readBuffer);		// perform read
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-
-		logMessage(FS3DriverLLevel,"before localBuf2");
-		char *localBuf2 = (char *)malloc(FS3_SECTOR_SIZE);		// allocate char buffer to store read data
-		logMessage(FS3DriverLLevel,"before memcpy");
-		memcpy(localBuf2, readBuffer, FS3_SECTOR_SIZE);						// copy read data over to char buffer
-				
-				// copy wanted data into merge  //
-		staticPos = FILES[curFile].position;
-		logMessage(FS3DriverLLevel,"before loop");
-		for(int pos = staticPos ; pos<staticPos + count2;pos++){
-			mergeBuf[bufTracker] = localBuf2[pos];
-			if(pos<staticPos+count2){
-			bufTracker+=1;
-			}
-		}
-		logMessage(FS3DriverLLevel,"before free");
-		free(localBuf2);	// free localBuf2
-		localBuf2 = NULL;
-		logMessage(FS3DriverLLevel,"before log");
-		
-			//  update file position  //
-		fPos = fs3_total_pos(curFile, FILES[curFile].sector, FILES[curFile].track) + count2;
-		fs3_seek(fd, fPos);
-		//FILES[curFile].position+=count2;
-			//// 	Ending Process for Multi read    ////
-		logMessage(FS3DriverLLevel,"before last memcpy");
-		memcpy(buf, mergeBuf, (count));//*sizeof(char));//*sizeof(char));							//copy all read data into buffer
-		logMessage(FS3DriverLLevel,"sector Quantity: %d ,data read:\n%s",FILES[curFile].sector,buf);
-		free(mergeBuf);			// free mergeBuf
-		mergeBuf = NULL;
-		
-		logMessage(FS3DriverLLevel,"end of multi read");
-		return(count);
-	}
 
-	////	return     ////
-	logMessage(FS3DriverLLevel,"value returned: %d", count);
-	return(count);
-	
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readv
+// Description  : Reads into several buffers in one pass over the file
+//
+// Inputs       : fd - filename of the file to read from
+//                iov - the buffers to read into
+//                iovcnt - number of buffers
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_readv(int16_t fd, const struct iovec *iov, int iovcnt) {
+	FS3IoRequest req = { .op = FS3_IO_READV, .fd = fd, .iov = iov, .iovcnt = iovcnt };
+	return(fs3_submit_wait(&req));
 }
-	 
-	
-	
-	
 ////////////////////////////////////////////////////////////////////////////////
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_write
-// Description  : Writes "count" bytes to the file handle "fd" from the 
-//                buffer  "buf"
+// Function     : fs3_file_writev
+// Description  : Writes from several buffers in one pass over the file,
+//				  each sector is pinned (and written) once however many
+//				  buffers it takes data from; run by the I/O dispatchers
 //
 // Inputs       : fd - filename of the file to write to
-//                buf - pointer to buffer to write from
-//                count - number of bytes to write
+//                iov - the buffers to write from
+//                iovcnt - number of buffers
 // Outputs      : bytes written if successful, -1 if failure
 
-int32_t fs3_write(int16_t fd, void *buf, int32_t count) {
+int32_t fs3_file_writev(int16_t fd, const struct iovec *iov, int iovcnt) {
 	logMessage(FS3DriverLLevel, "called write function");
 
 		////    Files Tests    ////
-	int curFile = fs3_fileLocation(fd);
+	int32_t count = fs3_iov_total(iov, iovcnt);
+	if(count == -1){return(-1);}
+	int curFile = fs3_file_acquire(fd, T);						// exclusive, the layout may change
 	if(curFile == -1){return(-1);}
-	if(FILES[curFile].isOpen!=T){return(-1);}
-	int totalPosition = fs3_total_pos(curFile, FILES[curFile].sector, FILES[curFile].track);
+	int totalPosition = FILES[curFile].globalPos;
+	int oldLength = FILES[curFile].length;						// sectors past this hold nothing of ours
+	int oldSecLen = META[curFile].secLen;						// given back if the write fails
 	logMessage(FS3DriverLLevel,"current length: %d, total position: %d, count: %d", FILES[curFile].length, totalPosition, count);
 	
 		//// INCREASE FILE LENGTH ////
 	if ((FILES[curFile].length-totalPosition)<count)
 	{
-		FILES[curFile].length+=count - (FILES[curFile].length-totalPosition);
-		logMessage(FS3DriverLLevel, "length added: %d", (FILES[curFile].length-totalPosition));
-		int totalSpace = META[curFile].secLen * FS3_SECTOR_SIZE;
-		logMessage(FS3DriverLLevel, "length: %d\ntotal space: %d", FILES[curFile].length, totalSpace);
-		if(FILES[curFile].length > totalSpace){
-			int foundSec = fs3_find_sector(curFile, FILES[curFile].track, FILES[curFile].sector);
-			if (foundSec == -1){
-				logMessage(FS3DriverLLevel, "no sector was found exiting.");
-				exit(0);	// exit because we haven't implemented adding a new track yet
+		int newLength = totalPosition + count;
+		int needed = (newLength + FS3_SECTOR_SIZE - 1) / FS3_SECTOR_SIZE;	// sectors the new length takes
+		while(META[curFile].secLen < needed){							// add sectors until the data fits
+			if (fs3_find_sector(curFile, needed - META[curFile].secLen) == -1){
+				logMessage(LOG_ERROR_LEVEL, "disk full, cannot grow %s to %d bytes", NAMES[curFile].path, newLength);
+				fs3_extent_truncate(curFile, oldSecLen);
+				pthread_rwlock_unlock(&FILES[curFile].lock);
+				return(-1);
 			}
 		}
+		logMessage(FS3DriverLLevel, "length added: %d", newLength - FILES[curFile].length);
+		FILES[curFile].length = newLength;
+		META[curFile].dirty = T;									// directory entry is out of date
+		if ((META[curFile].digestBuilt == T) && (fs3_digest_resize(&META[curFile].digest, needed) == -1)){
+			fs3_digest_free(&META[curFile].digest);					// no room, rebuild when asked for
+			META[curFile].digestBuilt = F;
+		}
 	}
 	logMessage(FS3DriverLLevel,"length after increase: %d", FILES[curFile].length);
-		////    Call Seek syscall    ////
-	
-	curTrk = FILES[curFile].track;
-	curSec = FILES[curFile].sector;
-	readBuffer = fs3_get_cache(curTrk, curSec);
-	if(readBuffer == NULL){
-		readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-		fs3_put_cache(curTrk,curSec,readBuffer); 
+
+	////	Copy each sector straight into its pinned buffer    ////
+	int done = 0, iovIdx = 0, runLeft = 0;
+	size_t iovOff = 0;
+	FS3TrackIndex curTrk;
+	FS3SectorIndex curSec;
+	int owner = fs3_set_cache_owner(curFile);						// count the references against the file
+	fs3_sched_plug();												// sector writes go out as one sweep
+	while (done < count){
+		int secIdx = (totalPosition + done) / FS3_SECTOR_SIZE;
+		int secOff = (totalPosition + done) % FS3_SECTOR_SIZE;
+		int span = FS3_SECTOR_SIZE - secOff;						// bytes left in the current sector
+		if (span > count - done){span = count - done;}
+
+		if (runLeft == 0){											// look up the next run of sectors
+			runLeft = fs3_file_run(curFile, secIdx, &curTrk, &curSec);
+			if (runLeft == -1){break;}
+		}
+
+			//  only read in a sector we keep part of  //
+		FS3PinMode pinMode = FS3_PIN_WRITE;
+		if ((span == FS3_SECTOR_SIZE) || (secIdx * FS3_SECTOR_SIZE >= oldLength)){pinMode = FS3_PIN_OVERWRITE;}
+		char *sector = fs3_pin_sector(curTrk, curSec, pinMode);
+		if (sector == NULL){break;}
+		fs3_iov_copy(sector + secOff, span, iov, &iovIdx, &iovOff, T);
+		if (META[curFile].digestBuilt == T){						// checksum the file's bytes in the sector
+			int held = FILES[curFile].length - secIdx * FS3_SECTOR_SIZE;
+			fs3_digest_set(&META[curFile].digest, secIdx, fs3_digest_sector(sector, (held < FS3_SECTOR_SIZE) ? held : FS3_SECTOR_SIZE));
+		}
+		if (fs3_unpin_sector(curTrk, curSec) == -1){break;}		// writes (or dirties) the sector
+		done += span;
+		if (secOff + span == FS3_SECTOR_SIZE){runLeft--; curSec++;}	// on to the next sector of the run
 	}
+	fs3_set_cache_owner(owner);
+	if (fs3_sched_unplug() == -1){done = -1;}						// a queued sector write failed
+	if (done < count){												// failed, the file keeps its old length
+		FILES[curFile].length = oldLength;
+		fs3_extent_truncate(curFile, oldSecLen);
+		META[curFile].digestBuilt = F;								// sectors not written, rebuild from the disk
+		pthread_rwlock_unlock(&FILES[curFile].lock);
+		return(-1);
+	}
+	fs3_set_position(curFile, totalPosition + done);				// update file position
+	if ((META[curFile].digestBuilt == T) && (count > 0)){			// rehash the tree above the sectors written
+		fs3_digest_rehash(&META[curFile].digest, totalPosition / FS3_SECTOR_SIZE, (totalPosition + count - 1) / FS3_SECTOR_SIZE);
+	}
+	logMessage(FS3DriverLLevel,"\n\nfile position: %d\n file sector: %d\n count: %d", FILES[curFile].position, FILES[curFile].sector,count);
+	pthread_rwlock_unlock(&FILES[curFile].lock);
+	return(count);
+}
+////////////////////////////////////////////////////////////////////////////////
 
-	command = fs3_syscall(construct_fs3_cmdblock(1, 0, FILES[curFile].track, 0), readBuffer);
-	deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-	
 
-		////    Single Sector Write    ////
-	if ((FILES[curFile].position+count)<=FS3_SECTOR_SIZE){
-		logMessage(FS3DriverLLevel, "begin single sector write");
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_write
+// Description  : Writes "count" bytes to the file handle "fd" from the 
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
 
+int32_t fs3_write(int16_t fd, void *buf, int32_t count) {
+	FS3IoRequest req = { .op = FS3_IO_WRITE, .fd = fd, .buf = buf, .count = count };
+	return(fs3_submit_wait(&req));							// queue it and wait for a dispatcher
+}
+////////////////////////////////////////////////////////////////////////////////
 
-			// create and assign inputBuf  //
-		char *inputBuf=(char *)malloc((count)); 
-		memcpy(inputBuf, buf, (count));//*sizeof(char));
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_writev
+// Description  : Writes from several buffers in one pass over the file
+//
+// Inputs       : fd - filename of the file to write to
+//                iov - the buffers to write from
+//                iovcnt - number of buffers
+// Outputs      : bytes written if successful, -1 if failure
 
-			//  perform read  //
-		curTrk = FILES[curFile].track;
-		curSec = FILES[curFile].sector;
-		readBuffer = fs3_get_cache(curTrk, curSec);
-		if(readBuffer == NULL){
-			readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-			fs3_put_cache(curTrk,curSec,readBuffer); 
-		}
-		command = fs3_syscall(construct_fs3_cmdblock(2, FILES[curFile].sector, 0, 0), readBuffer);
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-	
-		char *tempBuf = (char *)malloc(FS3_SECTOR_SIZE);
-
-			//  assign secBuf  //
-		memcpy(tempBuf, readBuffer, FS3_SECTOR_SIZE);
-
-			//  loop to write data into buffer  //
-		int staticPos = FILES[curFile].position;
-		int Counter =0;
-		for(int pos = staticPos; pos<staticPos+count; pos++){
-			tempBuf[pos] = inputBuf[Counter];
-			
-				Counter+=1;
-			
-		}
-		free(inputBuf);
-		inputBuf = NULL;
-			//  copy altered data in wrBuf  //
-		memcpy(readBuffer, tempBuf, FS3_SECTOR_SIZE);
-		logMessage(FS3DriverLLevel,"Data written: %s", readBuffer);
-		free(tempBuf);
-			//  perform write syscall  //
-		curTrk = FILES[curFile].track;
-		curSec = FILES[curFile].sector;
-		readBuffer = fs3_get_cache(curTrk, curSec);
-		if(readBuffer == NULL){
-			readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-			fs3_put_cache(curTrk,curSec,readBuffer); 
-		}
-		
-		command = fs3_syscall(construct_fs3_cmdblock(3, FILES[curFile].sector, 0, 0), readBuffer);
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-		
-			//  update file position  //
-		int fPos = fs3_total_pos(curFile, FILES[curFile].sector, FILES[curFile].track) + count;
-		fs3_seek(fd, fPos);
-		//FILES[curFile].position+=count;
-		logMessage(FS3DriverLLevel,"\n\nfile position: %d\n file sector: %d\n count: %d", FILES[curFile].position, FILES[curFile].sector,count);
-		
-	}
-	
+int32_t fs3_writev(int16_t fd, const struct iovec *iov, int iovcnt) {
+	FS3IoRequest req = { .op = FS3_IO_WRITEV, .fd = fd, .iov = iov, .iovcnt = iovcnt };
+	return(fs3_submit_wait(&req));
+}
+////////////////////////////////////////////////////////////////////////////////
 
-		////    Multi Sector Write    ////							////////////////			ERROR WITH MEMORY VALGRIND   SAYS LINES :717->729  & 655->729
-	else{
-		logMessage(FS3DriverLLevel,"begin multi sector write");
-
-			//  create counts  //
-		int count1 = FS3_SECTOR_SIZE - FILES[curFile].position;
-		int count2 = (count - count1) % FS3_SECTOR_SIZE;
-		int loopCount = (count - count1)/FS3_SECTOR_SIZE;
-		int bufTracker = 0;
-			//  allocate buffer space  //
-		char *inputBuf = (char *)malloc(count);
-			//  assign inputBuf data  //
-		memcpy(inputBuf, buf, (count));
-
-			//  perform first read  //
-		curTrk = FILES[curFile].track;
-		curSec = FILES[curFile].sector;
-		readBuffer = fs3_get_cache(curTrk, curSec);
-		if(readBuffer == NULL){
-			readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-			fs3_put_cache(curTrk,curSec,readBuffer); 
-		}
-		command = fs3_syscall(construct_fs3_cmdblock(2, FILES[curFile].sector, 0, 0), readBuffer);
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-	
-			// create tempBuf  //
-		char *tempBuf = (char *)malloc(FS3_SECTOR_SIZE);
-			//  assign secBuf data  //
-		memcpy(tempBuf, readBuffer, FS3_SECTOR_SIZE);
-		
-			//  write data into secBuf  //
-
-		int staticPos = FILES[curFile].position;
-		
-		
-		for(int pos = staticPos; pos<staticPos+count1; pos++){
-			tempBuf[pos] = inputBuf[bufTracker];
-			
-				bufTracker+=1;
-			
-		}
-			//  assign wrBuf new data  //
-		memcpy(readBuffer, tempBuf, FS3_SECTOR_SIZE);
-		free(tempBuf);
-		tempBuf = NULL;
-			//  perform the first write  //
-		curTrk = FILES[curFile].track;
-		curSec = FILES[curFile].sector;
-		readBuffer = fs3_get_cache(curTrk, curSec);
-		if(readBuffer == NULL){
-			readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-			fs3_put_cache(curTrk,curSec,readBuffer); 
-		}
-		command = fs3_syscall(construct_fs3_cmdblock(3, FILES[curFile].sector, 0, 0), readBuffer);
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-			//  update file position  //
-		int fPos = fs3_total_pos(curFile, FILES[curFile].sector, FILES[curFile].track) + count1;
-		fs3_seek(fd, fPos);
-		//FILES[curFile].position=0;
-		//FILES[curFile].sector+=1;
-		logMessage(FS3DriverLLevel,"\n\nfile position: %d\n file sector: %d\n count: %d", FILES[curFile].position, FILES[curFile].sector,count1);
-
-
-			////    BEGIN LOOP FOR MULTI SECTOR WRITE    ////
-		if(loopCount>0){
-		
-					
-			for(int i=1; i<=loopCount; i++){
-				
-				curTrk = FILES[curFile].track;
-				curSec = FILES[curFile].sector;
-				readBuffer = fs3_get_cache(curTrk, curSec);
-				if(readBuffer == NULL){
-					readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-					fs3_put_cache(curTrk,curSec,readBuffer); 
-				}
-				command = fs3_syscall(construct_fs3_cmdblock(2, FILES[curFile].sector, 0, 0), readBuffer);
-				deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-		
-				char *tempLoc = (char *)malloc(FS3_SECTOR_SIZE);
-				memcpy(tempLoc, readBuffer,FS3_SECTOR_SIZE);
-				staticPos = FILES[curFile].position;
-				for(int pos=staticPos; pos<FS3_SECTOR_SIZE; pos++){
-					tempLoc[pos] = inputBuf[bufTracker];
-					
-						bufTracker+=1;
-					
-				}
-				memcpy(readBuffer, tempLoc, FS3_SECTOR_SIZE);
-				free(tempLoc);
-				tempLoc = NULL;
-				
-				curTrk = FILES[curFile].track;
-				curSec = FILES[curFile].sector;
-				readBuffer = fs3_get_cache(curTrk, curSec);
-				if(readBuffer == NULL){
-					readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-					fs3_put_cache(curTrk,curSec,readBuffer); 
-				}
-				command = fs3_syscall(construct_fs3_cmdblock(3, FILES[curFile].sector, 0,0),readBuffer);
-				deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-				
-				fPos = fs3_total_pos(curFile, FILES[curFile].sector, FILES[curFile].track) + FS3_SECTOR_SIZE;
-				fs3_seek(fd, fPos);
-				//FILES[curFile].sector+=1;
-				logMessage(FS3DriverLLevel,"\n\nfile position: %d\n file sector: %d\n count: %d", FILES[curFile].position, FILES[curFile].sector,count1);
 
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_io_execute
+// Description  : Carries out a queued read or write, called on an I/O
+//				  dispatcher thread
+//
+// Inputs       : req - the request
+// Outputs      : bytes moved if successful, -1 if failure
+
+int32_t fs3_io_execute(FS3IoRequest *req) {
+	struct iovec one = { req->buf, (size_t)req->count };
+	if (((req->op == FS3_IO_READ) || (req->op == FS3_IO_WRITE)) && (req->count < 0)){return(-1);}
+	switch (req->op){
+	case FS3_IO_READ:	return(fs3_file_readv(req->fd, &one, 1));
+	case FS3_IO_WRITE:	return(fs3_file_writev(req->fd, &one, 1));
+	case FS3_IO_READV:	return(fs3_file_readv(req->fd, req->iov, req->iovcnt));
+	case FS3_IO_WRITEV:	return(fs3_file_writev(req->fd, req->iov, req->iovcnt));
+	}
+	return(-1);
+}
+////////////////////////////////////////////////////////////////////////////////
 
-		}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_digest_build
+// Description  : checksums every sector of a file the tree does not cover
+//				  yet, reading them through the cache; caller holds the
+//				  file's lock exclusive
+//
+// Inputs       : curFile
+// Outputs      : 0 if successful, -1 if failure
 
-			////    START FINAL WRITE    ////
-		
-		
-
-			// perform read (Final) //
-		
-		curTrk = FILES[curFile].track;
-		curSec = FILES[curFile].sector;
-		readBuffer = fs3_get_cache(curTrk, curSec);
-		if(readBuffer == NULL){
-			readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-			fs3_put_cache(curTrk,curSec,readBuffer); 
-		}	
-		command = fs3_syscall(construct_fs3_cmdblock(2, FILES[curFile].sector, 0, 0), readBuffer);
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
-		tempBuf = (char *)malloc(FS3_SECTOR_SIZE);
-		
-			//  assign data to secBuf (Final)  //
-		memcpy(tempBuf,readBuffer, FS3_SECTOR_SIZE);
-
-			//  write data into secBuf  //
-		staticPos = FILES[curFile].position;
-		logMessage(FS3DriverLLevel, "start loop");
-		for(int pos = staticPos; pos<staticPos+count2;pos++){
-			tempBuf[pos] = inputBuf[bufTracker];			
-			
-				bufTracker+=1;
-			
-		}
-		free(inputBuf);
-		inputBuf = NULL;
-			//  copy new data into wrBuf  //
-		memcpy(readBuffer, tempBuf, FS3_SECTOR_SIZE);
-		free(tempBuf);
-		tempBuf = NULL;
-
-			//  perform last write  //
-		
-		curTrk = FILES[curFile].track;
-		curSec = FILES[curFile].sector;
-		readBuffer = fs3_get_cache(curTrk, curSec);
-		if(readBuffer == NULL){
-			readBuffer = (void *)malloc(FS3_SECTOR_SIZE);
-			fs3_put_cache(curTrk,curSec,readBuffer); 
+int fs3_digest_build(int curFile){
+	int sectors = (FILES[curFile].length + FS3_SECTOR_SIZE - 1) / FS3_SECTOR_SIZE;
+	FS3TrackIndex trk;
+	FS3SectorIndex sct;
+	fs3_digest_free(&META[curFile].digest);
+	if (fs3_digest_resize(&META[curFile].digest, sectors) == -1){return(-1);}
+	int owner = fs3_set_cache_owner(curFile);
+	fs3_sched_plug();
+	for (int secIdx = 0; secIdx < sectors; secIdx++){
+		int held = FILES[curFile].length - secIdx * FS3_SECTOR_SIZE;
+		char *sector;
+		if ((fs3_file_run(curFile, secIdx, &trk, &sct) == -1) || ((sector = fs3_pin_sector(trk, sct, FS3_PIN_READ)) == NULL)){
+			fs3_set_cache_owner(owner);
+			fs3_sched_unplug();
+			return(-1);
 		}
-		command = fs3_syscall(construct_fs3_cmdblock(3,FILES[curFile].sector,0, 0), readBuffer);
-		deconstruct_fs3_cmdblock(command, op, sec, trk, ret);
+		fs3_digest_set(&META[curFile].digest, secIdx, fs3_digest_sector(sector, (held < FS3_SECTOR_SIZE) ? held : FS3_SECTOR_SIZE));
+		fs3_unpin_sector(trk, sct);
+	}
+	fs3_set_cache_owner(owner);
+	fs3_digest_rehash(&META[curFile].digest, 0, sectors - 1);
+	META[curFile].digestBuilt = T;
+	return(fs3_sched_unplug());
+}
+////////////////////////////////////////////////////////////////////////////////
 
-		fPos = fs3_total_pos(curFile, FILES[curFile].sector, FILES[curFile].track) + count2;
-		fs3_seek(fd, fPos);
-		//FILES[curFile].position+=count2;
-	
-		logMessage(FS3DriverLLevel,"\n\nfile position: %d\n file sector: %d\n count: %d", FILES[curFile].position, FILES[curFile].sector,count1);
 
-		
-		logMessage(FS3DriverLLevel, "end of multi sector write");
-		
-	
-	}	
-	
-	int stop = 0;
-	if(stop == 0){stop =1;}
-	return(count);
-	
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_file_digest
+// Description  : Get the digest of a file's contents, kept current by
+//				  every write so it costs nothing to read; a file loaded
+//				  from disk is read once, on the first call
+//
+// Inputs       : fd - the file handle
+//                digest - where to put the digest
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_file_digest(int16_t fd, uint64_t *digest) {
+	int curFile = fs3_file_acquire(fd, F);					// shared, the tree only changes under exclusive
+	if ((curFile == -1) || (digest == NULL)){
+		if (curFile != -1){pthread_rwlock_unlock(&FILES[curFile].lock);}
+		return(-1);
+	}
+	if (META[curFile].digestBuilt == F){					// build it, exclusive
+		pthread_rwlock_unlock(&FILES[curFile].lock);
+		if ((curFile = fs3_file_acquire(fd, T)) == -1){return(-1);}
+		if ((META[curFile].digestBuilt == F) && (fs3_digest_build(curFile) == -1)){
+			logMessage(LOG_ERROR_LEVEL, "cannot checksum %s", NAMES[curFile].path);
+			pthread_rwlock_unlock(&FILES[curFile].lock);
+			return(-1);
+		}
+	}
+	*digest = fs3_digest_final(&META[curFile].digest, FILES[curFile].length);
+	pthread_rwlock_unlock(&FILES[curFile].lock);
+	return(0);
 }
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -1044,36 +1272,38 @@ int32_t fs3_write(int16_t fd, void *buf, int32_t count) {
 
 
 int32_t fs3_seek(int16_t fd, uint32_t loc) {
-
-	/////   NOT FULLY IMPLEMENTED FOR MULTIPLE TRACKS    //////
-	int curFile;											// create current file variable
-
-	int newPos = loc % FS3_SECTOR_SIZE;						// gets the remainder of the location wanted divided by sector size to determine position in given sector
-	int newSec = loc / FS3_SECTOR_SIZE;						// gets the quoteint of the loc wanted divided by sector size 
-	int secIdx = newSec;
-	
-	curFile = fs3_fileLocation(fd);
-	if (curFile != -1){										// if file does exist
-		if (FILES[curFile].length < loc){return(-1);}		// if loc is OUT of range for the file fail
-
-		if (FILES[curFile].isOpen != T){return(-1);}		// if file is not open fail
-
-		
-		else if (FILES[curFile].length >= loc){				// if loc is IN range of the file
-		//int secIdx = fs3_sector_index(curFile, newSec, FILES[curFile].track);
-		 
-		FILES[curFile].position = newPos; //loc % FS3_SECTOR_SIZE;						// set the position of the file equal to loc
-		FILES[curFile].sector = META[curFile].secAccess[0][secIdx]; //loc / FS3_SECTOR_SIZE;								// assign the sector needed
-		FILES[curFile].track = FILES[curFile].track;
-		return(0);											// return 0
-		}
+	int curFile = fs3_file_acquire(fd, F);					// fail if the file does not exist or is not open
+	if (curFile == -1){return(-1);}
+	int result = -1;
+	pthread_mutex_lock(&FILES[curFile].posLock);
+	if (loc <= (uint32_t)FILES[curFile].length){			// if loc is OUT of range for the file fail
+		fs3_set_position(curFile, loc);
+		result = 0;
 	}
-	else if (curFile == -1){return(-1);}					// if file does NOT exist fail
-	
-	
-	return(-1);												// if it gets here something went wrong so i guess return -1
+	pthread_mutex_unlock(&FILES[curFile].posLock);
+	pthread_rwlock_unlock(&FILES[curFile].lock);
+	return(result);
+}
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sync
+// Description  : Write back the filesystem metadata and every dirty
+//				  cached sector to the disk
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_sync(void) {
+	if (diskIsMounted == F){return(-1);}
+	fs3_sched_plug();
+	int result = fs3_save_meta();								// checkpoint the metadata with the data
+	if (fs3_flush_cache() == -1){result = -1;}
+	if (fs3_sched_unplug() == -1){result = -1;}
+	if (fs3_sched_stuck() > 0){result = -1;}					// earlier writes still not on the disk
+	if (fs3_crc_flush() == -1){result = -1;}					// checksums of the sectors just written
+	return(result);
 }
 
 
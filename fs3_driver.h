@@ -13,6 +13,8 @@
 
 // Include files
 #include <stdint.h>
+#include <sys/uio.h>
+#include <fs3_aio.h>		// fs3_submit/fs3_reap, asynchronous reads and writes
 
 // Defines
 #define FS3_MAX_TOTAL_FILES 1024 // Maximum number of files ever
@@ -39,7 +41,20 @@ int32_t fs3_read(int16_t fd, void *buf, int32_t count);
 int32_t fs3_write(int16_t fd, void *buf, int32_t count);
 	// Writes "count" bytes to the file handle "fh" from the buffer  "buf"
 
+int32_t fs3_readv(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Reads into "iovcnt" buffers in order, touching each sector once
+
+int32_t fs3_writev(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Writes from "iovcnt" buffers in order, touching each sector once
+
 int32_t fs3_seek(int16_t fd, uint32_t loc);
 	// Seek to specific point in the file
 
+int32_t fs3_sync(void);
+	// Write back all modified sectors held in the cache
+
+int32_t fs3_file_digest(int16_t fd, uint64_t *digest);
+	// Get the digest of a file's contents (see fs3_digest.h) without
+	// reading it back, the driver keeps it current on every write
+
 #endif
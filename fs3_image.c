@@ -0,0 +1,1027 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_image.c
+//  Description    : This is the implementation of the FS3 disk-image
+//                   controller.  The whole disk is one mapping of the image
+//                   file, so a sector command is a memcpy; the cost model
+//                   decides what it would have cost on a real disk.  The
+//                   scheduler's lock already keeps callers from sending
+//                   commands at the same time.
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_image.h>
+#ifdef FS3_IMAGE_CONTROLLER
+#include <fs3_driver.h>
+#include <fs3_cache.h>
+#include <fs3_crc.h>
+#endif
+
+//
+// Support Macros/Data
+
+// Unpack a command block (op<<60 | sec<<44 | trk<<12 | ret<<11)
+#define IMAGE_OP(cmd)  ((uint8_t)(((cmd) >> 60) & 0xf))
+#define IMAGE_SEC(cmd) ((uint32_t)(((cmd) >> 44) & 0xffff))
+#define IMAGE_TRK(cmd) ((uint32_t)(((cmd) >> 12) & 0xffffffff))
+#define IMAGE_RET      ((FS3CmdBlk)1 << 11)
+
+#define IMAGE_BYTES ((size_t)FS3_MAX_TRACKS * FS3_TRACK_SIZE * FS3_SECTOR_SIZE)
+#define IMAGE_SECTOR(trk, sct) \
+    (imageDisk + ((size_t)(trk) * FS3_TRACK_SIZE + (sct)) * FS3_SECTOR_SIZE)
+
+char imagePath[PATH_MAX] = FS3_IMAGE_DEFAULT_PATH;
+int imageFresh = 0;                     // empty the image at the next mount
+char *imageDisk = NULL;                 // the mapped image, NULL if unmounted
+FS3TrackIndex imageHead = 0;            // track the head is on
+FS3ImageCosts imageCosts = { FS3_IMAGE_SEEK_NS, FS3_IMAGE_TRACK_NS, FS3_IMAGE_SECTOR_NS };
+FS3ImageCostModel imageModel;           // NULL for the linear model
+FS3ImageStats imageStats;
+uint8_t imageFailOp;                    // opcode being refused
+int imageFailCount = 0;                 // how many more of them to refuse
+int imageBad = 0;                       // writes to the bad sector are refused
+FS3TrackIndex imageBadTrack;
+FS3SectorIndex imageBadSector;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_linear_cost
+// Description  : The default cost model: a fixed settle time plus a cost
+//                per track crossed for a seek, a fixed cost per sector
+//
+// Inputs       : opcode - the command
+//                from - the track the head is on
+//                to - the track the command is for
+// Outputs      : the virtual time taken (ns)
+
+static uint64_t fs3_image_linear_cost(uint8_t opcode, FS3TrackIndex from, FS3TrackIndex to) {
+    switch (opcode) {
+    case FS3_OP_TSEEK:
+        if (from == to) {
+            return(0);
+        }
+        return(imageCosts.seek + imageCosts.perTrack * ((from > to) ? from - to : to - from));
+    case FS3_OP_RDSECT:
+    case FS3_OP_WRSECT:
+        return(imageCosts.transfer);
+    default:
+        return(0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_charge
+// Description  : Advance the virtual clock by what a command costs
+//
+// Inputs       : opcode - the command
+//                to - the track the command is for
+// Outputs      : none
+
+static void fs3_image_charge(uint8_t opcode, FS3TrackIndex to) {
+    uint64_t cost;
+
+    cost = (imageModel != NULL) ? imageModel(opcode, imageHead, to) : fs3_image_linear_cost(opcode, imageHead, to);
+    __atomic_fetch_add(&imageStats.clock, cost, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_mount
+// Description  : Open the image file, growing it to the size of the disk
+//                (new space reads as zeros), and map it
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_mount(void) {
+    struct stat st;
+    int fd;
+
+    if ((fd = open(imagePath, O_RDWR | O_CREAT | (imageFresh ? O_TRUNC : 0), 0644)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Cannot open disk image [%s]: %s", imagePath, strerror(errno));
+        return(-1);
+    }
+    if ((fstat(fd, &st) == -1) ||
+            (((size_t)st.st_size < IMAGE_BYTES) && (ftruncate(fd, IMAGE_BYTES) == -1))) {
+        logMessage(LOG_ERROR_LEVEL, "Cannot size disk image [%s]: %s", imagePath, strerror(errno));
+        close(fd);
+        return(-1);
+    }
+    imageDisk = mmap(NULL, IMAGE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (imageDisk == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Cannot map disk image [%s]: %s", imagePath, strerror(errno));
+        imageDisk = NULL;
+        return(-1);
+    }
+    imageFresh = 0;
+    imageHead = 0;
+    logMessage(FS3ControllerLLevel, "Mounted disk image [%s], %d tracks", imagePath, FS3_MAX_TRACKS);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_set_path
+// Description  : Select the image file used from the next mount
+//
+// Inputs       : path - the image file, created if it does not exist
+//                fresh - non-zero to empty it at the next mount
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_image_set_path(const char *path, int fresh) {
+    if ((path == NULL) || (strlen(path) >= sizeof(imagePath))) {
+        return(-1);
+    }
+    strcpy(imagePath, path);
+    imageFresh = fresh;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_set_costs
+// Description  : Set the parameters of the linear cost model
+//
+// Inputs       : costs - the new parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_image_set_costs(const FS3ImageCosts *costs) {
+    if (costs == NULL) {
+        return(-1);
+    }
+    imageCosts = *costs;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_set_cost_model
+// Description  : Replace the cost model
+//
+// Inputs       : model - the new model, NULL for the linear one
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_image_set_cost_model(FS3ImageCostModel model) {
+    imageModel = model;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_fail
+// Description  : Refuse the next few commands with an opcode
+//
+// Inputs       : opcode - the command to refuse
+//                count - how many to refuse, 0 to stop refusing
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_image_fail(uint8_t opcode, int count) {
+    if (count < 0) {
+        return(-1);
+    }
+    imageFailOp = opcode;
+    imageFailCount = count;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_fail_sector
+// Description  : Make a sector refuse writes, or stop it
+//
+// Inputs       : trk, sct - the sector
+//                fail - non-zero to refuse its writes, 0 to stop
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_image_fail_sector(FS3TrackIndex trk, FS3SectorIndex sct, int fail) {
+    if ((trk >= FS3_MAX_TRACKS) || (sct >= FS3_TRACK_SIZE)) {
+        return(-1);
+    }
+    imageBadTrack = trk;
+    imageBadSector = sct;
+    imageBad = fail;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_syscall
+// Description  : Carry out one controller command against the image
+//
+// Inputs       : cmdblock - the command
+//                buf - the sector data for RDSECT/WRSECT
+// Outputs      : the command block, with the return bit set on failure
+
+FS3CmdBlk fs3_image_syscall(FS3CmdBlk cmdblock, void *buf) {
+    uint8_t opcode = IMAGE_OP(cmdblock);
+    uint32_t sct = IMAGE_SEC(cmdblock), trk = IMAGE_TRK(cmdblock);
+    int failed = 0;
+
+    if ((imageFailCount > 0) && (opcode == imageFailOp)) {
+        imageFailCount--;                   // injected, the image is not touched
+        imageStats.errors++;
+        return(cmdblock | IMAGE_RET);
+    }
+    if (imageBad && (opcode == FS3_OP_WRSECT) && (imageHead == imageBadTrack) && (sct == imageBadSector)) {
+        imageStats.errors++;
+        return(cmdblock | IMAGE_RET);
+    }
+    switch (opcode) {
+    case FS3_OP_MOUNT:
+        failed = (imageDisk != NULL) || (fs3_image_mount() == -1);
+        break;
+
+    case FS3_OP_TSEEK:
+        if ((failed = (imageDisk == NULL) || (trk >= FS3_MAX_TRACKS)) == 0) {
+            fs3_image_charge(opcode, trk);
+            if (imageHead != trk) {
+                imageStats.seeks++;
+                imageStats.tracksCrossed += (imageHead > trk) ? imageHead - trk : trk - imageHead;
+            }
+            imageHead = trk;
+        }
+        break;
+
+    case FS3_OP_RDSECT:
+    case FS3_OP_WRSECT:
+        if ((failed = (imageDisk == NULL) || (sct >= FS3_TRACK_SIZE) || (buf == NULL)) == 0) {
+            fs3_image_charge(opcode, imageHead);
+            if (opcode == FS3_OP_RDSECT) {
+                memcpy(buf, IMAGE_SECTOR(imageHead, sct), FS3_SECTOR_SIZE);
+                imageStats.reads++;
+            } else {
+                memcpy(IMAGE_SECTOR(imageHead, sct), buf, FS3_SECTOR_SIZE);
+                imageStats.writes++;
+            }
+        }
+        break;
+
+    case FS3_OP_UMOUNT:
+        if ((failed = (imageDisk == NULL)) == 0) {
+            munmap(imageDisk, IMAGE_BYTES);
+            imageDisk = NULL;
+        }
+        break;
+
+    default:
+        failed = 1;
+    }
+
+    if (failed) {
+        imageStats.errors++;
+        logMessage(LOG_ERROR_LEVEL, "Disk image refused op %d on [%u/%u]", opcode, trk, sct);
+        return(cmdblock | IMAGE_RET);
+    }
+    return(cmdblock & ~IMAGE_RET);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_clock
+// Description  : Get the virtual time commands have taken so far
+//
+// Inputs       : none
+// Outputs      : the time (ns)
+
+uint64_t fs3_image_clock(void) {
+    return(__atomic_load_n(&imageStats.clock, __ATOMIC_RELAXED));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_stats
+// Description  : Get the controller counters
+//
+// Inputs       : stats - where to store the counters
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_image_stats(FS3ImageStats *stats) {
+    if (stats == NULL) {
+        return(-1);
+    }
+    *stats = imageStats;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_log_image_metrics
+// Description  : Log the controller counters
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_log_image_metrics(void) {
+    logMessage(FS3DriverLLevel, "\nImage seeks: %lu (%lu tracks crossed)\nImage sector reads: %lu\nImage sector writes: %lu\nImage errors: %lu\nVirtual disk time: %.3f ms",
+        (unsigned long)imageStats.seeks, (unsigned long)imageStats.tracksCrossed,
+        (unsigned long)imageStats.reads, (unsigned long)imageStats.writes,
+        (unsigned long)imageStats.errors, imageStats.clock / 1000000.0);
+    return(0);
+}
+
+#ifdef FS3_IMAGE_CONTROLLER
+
+//
+// Built in place of the controller library
+
+unsigned long FS3ControllerLLevel = 0;
+unsigned long FS3DriverLLevel = 0;
+unsigned long FS3SimulatorLLevel = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_syscall
+// Description  : The bus interface, served by the disk image
+//
+// Inputs       : cmdblock - the command
+//                buf - the sector data for RDSECT/WRSECT
+// Outputs      : the command block, with the return bit set on failure
+
+FS3CmdBlk fs3_syscall(FS3CmdBlk cmdblock, void *buf) {
+    return(fs3_image_syscall(cmdblock, buf));
+}
+
+#define IMAGE_TEST_PATH "fs3_unit_test.img"     // scratch image the unit tests use
+#define IMAGE_TEST_CACHE 64                     // cache lines the driver tests run with
+#define IMAGE_TEST_CHUNK 8192                   // bytes per driver read or write
+
+pthread_t imageTestCaller;      // thread running the flusher test
+int imageTestWrites;            // sectors written by the flusher test's writer
+int imageTestCallerWrites;      // how many of them the caller wrote itself
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_fill
+// Description  : Fill a buffer with the test pattern of a file
+//
+// Inputs       : buf - the buffer
+//                offset - where in the file the buffer starts
+//                len - the bytes to fill
+//                seed - picks the file's pattern
+// Outputs      : none
+
+static void fs3_image_test_fill(char *buf, uint32_t offset, int len, int seed) {
+    for (int i = 0; i < len; i++) {
+        uint32_t at = offset + i;
+        buf[i] = (char)(seed * 131 + at * 7 + at / 4093);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_mount
+// Description  : Start the cache and mount the driver on the test image
+//
+// Inputs       : fresh - non-zero to empty the image first
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_test_mount(int fresh) {
+    if ((fs3_image_set_path(IMAGE_TEST_PATH, fresh) == -1) || (fs3_init_cache(IMAGE_TEST_CACHE) == -1)) {
+        return(-1);
+    }
+    if (fs3_mount_disk() == -1) {
+        fs3_close_cache();
+        return(-1);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_unmount
+// Description  : Unmount the driver and stop the cache
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if the unmount failed
+
+static int fs3_image_test_unmount(void) {
+    int result = fs3_unmount_disk();
+
+    fs3_close_cache();
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_write
+// Description  : Write a file's test pattern from the file's position
+//
+// Inputs       : fd - the open file
+//                offset - the file's position
+//                len - the bytes to write
+//                seed - picks the file's pattern
+// Outputs      : the bytes written, short if the disk filled up
+
+static int fs3_image_test_write(int16_t fd, uint32_t offset, int len, int seed) {
+    char buf[IMAGE_TEST_CHUNK];
+    int done = 0, count, wrote;
+
+    while (done < len) {
+        count = (len - done < IMAGE_TEST_CHUNK) ? len - done : IMAGE_TEST_CHUNK;
+        fs3_image_test_fill(buf, offset + done, count, seed);
+        if ((wrote = fs3_write(fd, buf, count)) <= 0) {
+            break;
+        }
+        done += wrote;
+    }
+    return(done);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_check
+// Description  : Read a file back and compare it with its test pattern
+//
+// Inputs       : path - the file
+//                len - the length it should have
+//                seed - picks the file's pattern
+// Outputs      : 0 if it matches, -1 if not
+
+static int fs3_image_test_check(char *path, int len, int seed) {
+    char buf[IMAGE_TEST_CHUNK], expect[IMAGE_TEST_CHUNK];
+    int16_t fd;
+    int done = 0, got, result = 0;
+
+    if ((fd = fs3_open(path)) == -1) {
+        return(-1);
+    }
+    while ((result == 0) && ((got = fs3_read(fd, buf, IMAGE_TEST_CHUNK)) > 0)) {
+        fs3_image_test_fill(expect, done, got, seed);
+        if ((done + got > len) || (memcmp(buf, expect, got) != 0)) {
+            result = -1;
+        }
+        done += got;
+    }
+    if ((got == -1) || (done != len)) {
+        result = -1;
+    }
+    if (fs3_close(fd) == -1) {
+        result = -1;
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_find
+// Description  : Find the sector of the mounted image holding the start of
+//                a file's test pattern
+//
+// Inputs       : seed - picks the file's pattern
+// Outputs      : the sector's offset in the image, IMAGE_BYTES if none
+
+static size_t fs3_image_test_find(int seed) {
+    char sector[FS3_SECTOR_SIZE];
+    size_t at;
+
+    fs3_image_test_fill(sector, 0, FS3_SECTOR_SIZE, seed);
+    for (at = 0; at < IMAGE_BYTES; at += FS3_SECTOR_SIZE) {
+        if (memcmp(imageDisk + at, sector, FS3_SECTOR_SIZE) == 0) {
+            break;
+        }
+    }
+    return(at);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_commands
+// Description  : Check that sectors written to a fresh image read back
+//                and that bad commands are refused
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_test_commands(void) {
+    char out[FS3_SECTOR_SIZE], in[FS3_SECTOR_SIZE];
+    FS3CmdBlk mount = (FS3CmdBlk)FS3_OP_MOUNT << 60, umount = (FS3CmdBlk)FS3_OP_UMOUNT << 60;
+    int result = 0;
+
+    imageFresh = 1;
+    if (fs3_image_syscall(mount, NULL) & IMAGE_RET) {
+        return(-1);
+    }
+    for (int i = 0; (i < 64) && (result == 0); i++) {
+        FS3TrackIndex trk = (i * 37) % FS3_MAX_TRACKS;
+        FS3SectorIndex sct = (i * 101) % FS3_TRACK_SIZE;
+        memset(out, i, sizeof(out));
+        if ((fs3_image_syscall(((FS3CmdBlk)FS3_OP_TSEEK << 60) | ((FS3CmdBlk)trk << 12), NULL) & IMAGE_RET) ||
+            (fs3_image_syscall(((FS3CmdBlk)FS3_OP_WRSECT << 60) | ((FS3CmdBlk)sct << 44), out) & IMAGE_RET) ||
+            (fs3_image_syscall(((FS3CmdBlk)FS3_OP_RDSECT << 60) | ((FS3CmdBlk)sct << 44), in) & IMAGE_RET) ||
+            (memcmp(in, out, sizeof(in)) != 0)) {
+            logMessage(LOG_ERROR_LEVEL, "Disk image unit test failed on [%d/%d]", trk, sct);
+            result = -1;
+        }
+    }
+    if (!(fs3_image_syscall(((FS3CmdBlk)FS3_OP_TSEEK << 60) | ((FS3CmdBlk)FS3_MAX_TRACKS << 12), NULL) & IMAGE_RET) ||
+        !(fs3_image_syscall(mount, NULL) & IMAGE_RET)) {
+        logMessage(LOG_ERROR_LEVEL, "Disk image accepted a bad command");
+        result = -1;
+    }
+    if (fs3_image_syscall(umount, NULL) & IMAGE_RET) {
+        result = -1;
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_remount
+// Description  : Check that files written through the driver are all
+//                there, at their lengths, after unmounting and mounting
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_test_remount(void) {
+    static const int lengths[] = { 1, 5000, 300000 };
+    char path[16];
+    int16_t fd;
+    int result = 0;
+
+    if (fs3_image_test_mount(1) == -1) {
+        return(-1);
+    }
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "remount%d", i);
+        if (((fd = fs3_open(path)) == -1) || (fs3_image_test_write(fd, 0, lengths[i], i) != lengths[i]) ||
+                (fs3_close(fd) == -1)) {
+            result = -1;
+        }
+    }
+    if ((fs3_image_test_unmount() == -1) || (fs3_image_test_mount(0) == -1)) {
+        return(-1);
+    }
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "remount%d", i);
+        if (fs3_image_test_check(path, lengths[i], i) == -1) {
+            result = -1;
+        }
+    }
+    if (fs3_image_test_unmount() == -1) {
+        result = -1;
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_writeback
+// Description  : Check that a write-back cache reports a failed write-back
+//                from close, keeps the data, and writes it at unmount
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_test_writeback(void) {
+    int16_t fd;
+    int result = 0, closed;
+
+    fs3_set_cache_mode(FS3_CACHE_WRITEBACK);
+    if (fs3_image_test_mount(1) == -1) {
+        fs3_set_cache_mode(FS3_CACHE_WRITETHROUGH);
+        return(-1);
+    }
+    if (((fd = fs3_open("writeback")) == -1) || (fs3_image_test_write(fd, 0, 20000, 3) != 20000)) {
+        result = -1;
+    }
+    fs3_image_fail(FS3_OP_WRSECT, INT_MAX);
+    closed = fs3_close(fd);
+    fs3_image_fail(FS3_OP_WRSECT, 0);
+    if (closed != -1) {
+        logMessage(LOG_ERROR_LEVEL, "Close did not report a failed write-back");
+        result = -1;
+    }
+    if (fs3_image_test_unmount() == -1) {
+        result = -1;
+    }
+    fs3_set_cache_mode(FS3_CACHE_WRITETHROUGH);
+    if (fs3_image_test_mount(0) == -1) {
+        return(-1);
+    }
+    if ((fs3_image_test_check("writeback", 20000, 3) == -1) || (fs3_image_test_unmount() == -1)) {
+        result = -1;
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_reader
+// Description  : Cache reader for the write-through test, every sector on
+//                its "disk" holds its own pattern
+//
+// Inputs       : trk, sct - the sector
+//                buf - where to read it
+// Outputs      : 0
+
+static int fs3_image_test_reader(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    fs3_image_test_fill(buf, 0, FS3_SECTOR_SIZE, trk + sct);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_writer
+// Description  : Cache writer for the write-through test, always fails
+//
+// Inputs       : trk, sct - the sector
+//                buf - what to write
+// Outputs      : -1
+
+static int fs3_image_test_writer(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_writethrough
+// Description  : Check that a write-through cache does not keep a sector
+//                whose write failed, the next pin reads the disk again
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_test_writethrough(void) {
+    char expect[FS3_SECTOR_SIZE];
+    char *buf;
+    int result = 0;
+
+    if (fs3_init_cache(IMAGE_TEST_CACHE) == -1) {
+        return(-1);
+    }
+    fs3_set_cache_reader(fs3_image_test_reader);
+    fs3_set_cache_writer(fs3_image_test_writer);
+    fs3_image_test_fill(expect, 0, FS3_SECTOR_SIZE, 3 + 5);
+    for (int mode = FS3_PIN_WRITE; (mode <= FS3_PIN_OVERWRITE) && (result == 0); mode++) {
+        if ((buf = fs3_pin_sector(3, 5, (FS3PinMode)mode)) == NULL) {
+            result = -1;
+            break;
+        }
+        memset(buf, 0xff, FS3_SECTOR_SIZE);
+        if (fs3_unpin_sector(3, 5) != -1) {
+            result = -1;
+        }
+        if ((buf = fs3_pin_sector(3, 5, FS3_PIN_READ)) == NULL) {
+            result = -1;
+            break;
+        }
+        if (memcmp(buf, expect, FS3_SECTOR_SIZE) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Cache kept a sector whose write-through failed");
+            result = -1;
+        }
+        fs3_unpin_sector(3, 5);
+    }
+    fs3_set_cache_reader(NULL);
+    fs3_set_cache_writer(NULL);
+    fs3_close_cache();
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_counter
+// Description  : Cache writer for the flusher test, counts the sectors
+//                written and which of them the test's own thread wrote
+//
+// Inputs       : trk, sct - the sector
+//                buf - what to write
+// Outputs      : 0
+
+static int fs3_image_test_counter(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    __atomic_fetch_add(&imageTestWrites, 1, __ATOMIC_RELAXED);
+    if (pthread_equal(pthread_self(), imageTestCaller)) {
+        __atomic_fetch_add(&imageTestCallerWrites, 1, __ATOMIC_RELAXED);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_flusher
+// Description  : Check that dirtying a write-back cache past the high
+//                watermark has the flusher thread, not the writer, write
+//                it back down to the low watermark
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_test_flusher(void) {
+    struct timespec pause = { 0, 1000000 };
+    int high = (IMAGE_TEST_CACHE * FS3_CACHE_DIRTY_HIGH) / 100 + 1;
+    int flushed = high - (IMAGE_TEST_CACHE * FS3_CACHE_DIRTY_LOW) / 100;
+    int result = 0, waits;
+    char *buf;
+
+    // One shard, so that its watermarks are the whole cache's
+    fs3_set_cache_mode(FS3_CACHE_WRITEBACK);
+    fs3_set_cache_shards(1);
+    if (fs3_init_cache(IMAGE_TEST_CACHE) == -1) {
+        result = -1;
+    }
+    fs3_set_cache_mode(FS3_CACHE_WRITETHROUGH);
+    fs3_set_cache_shards(FS3_DEFAULT_CACHE_SHARDS);
+    if (result == -1) {
+        return(-1);
+    }
+    imageTestCaller = pthread_self();
+    imageTestWrites = 0;
+    imageTestCallerWrites = 0;
+    fs3_set_cache_reader(fs3_image_test_reader);
+    fs3_set_cache_writer(fs3_image_test_counter);
+    for (int s = 0; (s < high) && (result == 0); s++) {
+        if ((buf = fs3_pin_sector(0, s, FS3_PIN_OVERWRITE)) == NULL) {
+            result = -1;
+            break;
+        }
+        fs3_image_test_fill(buf, 0, FS3_SECTOR_SIZE, s);
+        if (fs3_unpin_sector(0, s) == -1) {
+            result = -1;
+        }
+    }
+    for (waits = 0; (waits < 5000) && (__atomic_load_n(&imageTestWrites, __ATOMIC_RELAXED) < flushed); waits++) {
+        nanosleep(&pause, NULL);
+    }
+    if ((__atomic_load_n(&imageTestWrites, __ATOMIC_RELAXED) != flushed) ||
+            (__atomic_load_n(&imageTestCallerWrites, __ATOMIC_RELAXED) != 0)) {
+        logMessage(LOG_ERROR_LEVEL, "Flusher wrote %d of %d sectors, %d by the writer",
+            imageTestWrites, flushed, imageTestCallerWrites);
+        result = -1;
+    }
+    if (fs3_close_cache() == -1) {
+        result = -1;
+    }
+    fs3_set_cache_reader(NULL);
+    fs3_set_cache_writer(NULL);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_maps
+// Description  : Check that extent maps survive a checkpoint that fails,
+//                and still find room once the disk is full
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_test_maps(void) {
+    int16_t fd, big;
+    int result = 0, synced, wrote, total = 0;
+
+    if (fs3_image_test_mount(1) == -1) {
+        return(-1);
+    }
+
+    // A map that cannot be written stays dirty for the next checkpoint
+    if (((fd = fs3_open("maps")) == -1) || (fs3_image_test_write(fd, 0, 3000, 5) != 3000) ||
+            (fs3_close(fd) == -1)) {
+        result = -1;
+    }
+    fs3_image_fail(FS3_OP_WRSECT, INT_MAX);
+    synced = fs3_sync();
+    fs3_image_fail(FS3_OP_WRSECT, 0);
+    if (synced != -1) {
+        logMessage(LOG_ERROR_LEVEL, "Sync did not report a failed checkpoint");
+        result = -1;
+    }
+
+    // Fill the disk, the maps written at unmount need no sectors then
+    if ((big = fs3_open("full")) == -1) {
+        result = -1;
+    } else {
+        while ((wrote = fs3_image_test_write(big, total, IMAGE_TEST_CHUNK * 8, 6)) == IMAGE_TEST_CHUNK * 8) {
+            total += wrote;
+        }
+        total += wrote;
+        while ((wrote = fs3_image_test_write(big, total, FS3_SECTOR_SIZE, 6)) > 0) {
+            total += wrote;
+        }
+    }
+    if ((fs3_image_test_unmount() == -1) || (fs3_image_test_mount(0) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Extent maps of a full disk were not written");
+        return(-1);
+    }
+    if ((fs3_image_test_check("maps", 3000, 5) == -1) || (fs3_image_test_check("full", total, 6) == -1)) {
+        result = -1;
+    }
+    if (fs3_image_test_unmount() == -1) {
+        result = -1;
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_stuck
+// Description  : Check that a write stuck on a bad sector of one file,
+//                retried with every batch, fails no read or write of
+//                another file, and that sync and unmount report it
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_test_stuck(void) {
+    char buf[IMAGE_TEST_CHUNK];
+    int16_t fd, other;
+    int result = 0;
+    size_t at;
+
+    fs3_set_cache_mode(FS3_CACHE_WRITEBACK);
+    if (fs3_image_test_mount(1) == -1) {
+        fs3_set_cache_mode(FS3_CACHE_WRITETHROUGH);
+        return(-1);
+    }
+    if (((fd = fs3_open("stuck")) == -1) || (fs3_image_test_write(fd, 0, 4096, 9) != 4096) ||
+            (fs3_sync() == -1) || ((at = fs3_image_test_find(9)) == IMAGE_BYTES)) {
+        fs3_image_test_unmount();
+        fs3_set_cache_mode(FS3_CACHE_WRITETHROUGH);
+        return(-1);
+    }
+
+    // Rewrite the file with its first sector gone bad, close reports it
+    fs3_image_fail_sector(at / FS3_SECTOR_SIZE / FS3_TRACK_SIZE, (at / FS3_SECTOR_SIZE) % FS3_TRACK_SIZE, 1);
+    fs3_seek(fd, 0);
+    fs3_image_test_write(fd, 0, 4096, 10);
+    if (fs3_close(fd) != -1) {
+        logMessage(LOG_ERROR_LEVEL, "Close did not report a write to a bad sector");
+        result = -1;
+    }
+
+    // Another file's batches retry the stuck write without failing
+    if (((other = fs3_open("other")) == -1) || (fs3_image_test_write(other, 0, 20000, 11) != 20000) ||
+            (fs3_close(other) == -1) || (fs3_image_test_check("other", 20000, 11) == -1) ||
+            ((other = fs3_open("other")) == -1) || (fs3_read(other, buf, IMAGE_TEST_CHUNK) != IMAGE_TEST_CHUNK) ||
+            (fs3_write(other, buf, IMAGE_TEST_CHUNK) != IMAGE_TEST_CHUNK) || (fs3_close(other) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "A stuck write failed another file's I/O");
+        result = -1;
+    }
+    if (fs3_sync() != -1) {
+        logMessage(LOG_ERROR_LEVEL, "Sync did not report a stuck write");
+        result = -1;
+    }
+
+    // Once the sector is good again the retry gets it to the disk
+    fs3_image_fail_sector(0, 0, 0);
+    if ((fs3_sync() == -1) || (fs3_image_test_unmount() == -1)) {
+        result = -1;
+    }
+    fs3_set_cache_mode(FS3_CACHE_WRITETHROUGH);
+    if (fs3_image_test_mount(0) == -1) {
+        return(-1);
+    }
+    if ((fs3_image_test_check("stuck", 4096, 10) == -1) || (fs3_image_test_unmount() == -1)) {
+        result = -1;
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_image_test_crc
+// Description  : Check that formatting writes no sidecars, that a failed
+//                write leaves no checksum behind, and that a corrupted
+//                sector is caught when it is read
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_image_test_crc(void) {
+    char sector[FS3_SECTOR_SIZE];
+    FS3CrcStats stats;
+    int16_t fd;
+    int result = 0, seed = 7, synced;
+    size_t at;
+
+    fs3_set_crc_checking(1);
+    if (fs3_image_test_mount(1) == -1) {
+        fs3_set_crc_checking(0);
+        return(-1);
+    }
+    fs3_crc_stats(&stats);
+    if (stats.sidecarWrites != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Formatting wrote %lu checksum sidecars", (unsigned long)stats.sidecarWrites);
+        result = -1;
+    }
+
+    // Overwrite a synced file with the controller refusing the writes
+    if (((fd = fs3_open("crc")) == -1) || (fs3_image_test_write(fd, 0, 4096, 7) != 4096) || (fs3_sync() == -1)) {
+        result = -1;
+    }
+    fs3_seek(fd, 0);
+    fs3_image_fail(FS3_OP_WRSECT, INT_MAX);
+    fs3_image_test_write(fd, 0, 4096, 8);
+    synced = fs3_sync();
+    fs3_image_fail(FS3_OP_WRSECT, 0);
+    fs3_close(fd);
+    if ((synced != -1) || (fs3_image_test_unmount() == -1) || (fs3_image_test_mount(0) == -1)) {
+        fs3_set_crc_checking(0);
+        return(-1);
+    }
+    if (fs3_image_test_check("crc", 4096, 7) == -1) {
+        seed = 8;                           // the cache wrote the new data later
+        if (fs3_image_test_check("crc", 4096, 8) == -1) {
+            result = -1;
+        }
+    }
+    fs3_crc_stats(&stats);
+    if ((stats.failures != 0) || (stats.verified == 0)) {
+        logMessage(LOG_ERROR_LEVEL, "Checksums after a failed write: verified %lu, failures %lu",
+                   (unsigned long)stats.verified, (unsigned long)stats.failures);
+        result = -1;
+    }
+
+    // Flip a byte of the file's first sector behind the driver's back
+    if ((fs3_image_test_unmount() == -1) || (fs3_image_test_mount(0) == -1)) {
+        fs3_set_crc_checking(0);
+        return(-1);
+    }
+    if ((at = fs3_image_test_find(seed)) < IMAGE_BYTES) {
+        imageDisk[at + 100] ^= 0x1;
+    }
+    if ((at == IMAGE_BYTES) || ((fd = fs3_open("crc")) == -1) || (fs3_read(fd, sector, FS3_SECTOR_SIZE) != -1)) {
+        logMessage(LOG_ERROR_LEVEL, "A corrupted sector was read without error");
+        result = -1;
+    }
+    fs3_close(fd);
+    fs3_crc_stats(&stats);
+    if (stats.failures == 0) {
+        result = -1;
+    }
+    if (fs3_image_test_unmount() == -1) {
+        result = -1;
+    }
+    fs3_set_crc_checking(0);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_unit_test
+// Description  : Run the controller's tests, then the driver's on top of
+//                it, on a scratch image removed afterwards
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_unit_test(void) {
+    static const struct {
+        const char *name;
+        int (*test)(void);
+    } tests[] = {
+        { "commands", fs3_image_test_commands },
+        { "remount", fs3_image_test_remount },
+        { "write-back failure", fs3_image_test_writeback },
+        { "write-through failure", fs3_image_test_writethrough },
+        { "write-back flusher", fs3_image_test_flusher },
+        { "extent maps", fs3_image_test_maps },
+        { "stuck write", fs3_image_test_stuck },
+        { "checksums", fs3_image_test_crc },
+    };
+    char saved[PATH_MAX];
+    int result = 0;
+
+    strcpy(saved, imagePath);
+    fs3_image_set_path(IMAGE_TEST_PATH, 1);
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        if (tests[i].test() == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Unit test [%s] failed", tests[i].name);
+            result = -1;
+        } else {
+            logMessage(LOG_INFO_LEVEL, "Unit test [%s] passed", tests[i].name);
+        }
+    }
+    unlink(IMAGE_TEST_PATH);
+    fs3_image_set_path(saved, 0);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_log_controller_metrics
+// Description  : Log the metrics for the controller
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_log_controller_metrics(void) {
+    return(fs3_log_image_metrics());
+}
+
+#endif
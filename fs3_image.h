@@ -0,0 +1,88 @@
+#ifndef FS3_IMAGE_INCLUDED
+#define FS3_IMAGE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_image.h
+//  Description    : This is the interface for the FS3 disk-image controller,
+//                   an in-tree stand-in for the controller library.  It
+//                   speaks the same command block protocol over a disk
+//                   image file mapped into memory, and charges every command
+//                   to a virtual clock through a cost model instead of
+//                   taking real time, so runs are repeatable.
+//
+//                   Select it at run time with fs3_sched_set_controller(
+//                   fs3_image_syscall), or at build time with
+//                   -DFS3_IMAGE_CONTROLLER (make CONTROLLER=image), which
+//                   makes this file provide fs3_syscall itself.
+//
+
+// Include
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_IMAGE_DEFAULT_PATH "fs3_disk.img"  // Image used if none is set
+#define FS3_IMAGE_SEEK_NS    1000000   // Default settle time of any seek (1 ms)
+#define FS3_IMAGE_TRACK_NS   20000     // Default time per track crossed (20 us)
+#define FS3_IMAGE_SECTOR_NS  10000     // Default time to move one sector (10 us)
+
+// Parameters of the default, linear cost model (virtual nanoseconds)
+typedef struct {
+
+    uint64_t seek;          // Any TSEEK that moves the head
+    uint64_t perTrack;      // Added for each track the head crosses
+    uint64_t transfer;      // Each RDSECT or WRSECT
+
+} FS3ImageCosts;
+
+// A cost model: the virtual time a command takes, given where the head is
+// (from) and the track the command is for (to)
+typedef uint64_t (*FS3ImageCostModel)(uint8_t opcode, FS3TrackIndex from, FS3TrackIndex to);
+
+// Counters kept by the controller
+typedef struct {
+
+    uint64_t seeks;         // TSEEKs that moved the head
+    uint64_t tracksCrossed; // Total seek distance
+    uint64_t reads;         // Sectors read
+    uint64_t writes;        // Sectors written
+    uint64_t errors;        // Commands refused
+    uint64_t clock;         // Virtual time so far (ns)
+
+} FS3ImageStats;
+
+//
+// Image Controller Functions
+
+int fs3_image_set_path(const char *path, int fresh);
+    // Use this image file from the next mount; if fresh is set, the next
+    // mount empties it first
+
+int fs3_image_set_costs(const FS3ImageCosts *costs);
+    // Set the parameters of the linear cost model
+
+int fs3_image_set_cost_model(FS3ImageCostModel model);
+    // Replace the cost model (NULL for the linear one)
+
+int fs3_image_fail(uint8_t opcode, int count);
+    // Refuse the next count commands with this opcode (0 to stop), to
+    // test how the layers above handle controller errors
+
+int fs3_image_fail_sector(FS3TrackIndex trk, FS3SectorIndex sct, int fail);
+    // Refuse every write to this sector while fail is set, a bad sector
+    // (one at a time)
+
+FS3CmdBlk fs3_image_syscall(FS3CmdBlk cmdblock, void *buf);
+    // Carry out one controller command, as fs3_syscall
+
+uint64_t fs3_image_clock(void);
+    // Get the virtual time spent by commands so far (ns)
+
+int fs3_image_stats(FS3ImageStats *stats);
+    // Get the controller counters
+
+int fs3_log_image_metrics(void);
+    // Log the controller counters
+
+#endif
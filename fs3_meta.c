@@ -0,0 +1,297 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_meta.c
+//  Description    : This is the implementation of the FS3 on-disk
+//                   metadata.  Mount reads only the superblock and bitmap;
+//                   a directory entry and its extent map are read when the
+//                   file is first opened, so mounting costs the same
+//                   however many files the disk holds.  All sector I/O
+//                   goes through the cache like file data does.
+//
+
+// Includes
+#include <string.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_meta.h>
+#include <fs3_cache.h>
+#include <fs3_crc.h>
+
+//
+// Support Macros/Data
+
+#define SLOT_WORD(slot) ((slot) / 64)
+#define SLOT_BIT(slot)  (1ULL << ((slot) % 64))
+
+FS3SuperBlock metaSuper;                            // copy of sector 0
+uint64_t metaResident[FS3_META_SLOT_WORDS];         // set bit = slot loaded by the driver
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_meta_read
+// Description  : Copy bytes out of a reserved sector
+//
+// Inputs       : trk, sct - the sector
+//                off, len - the bytes to copy
+//                dst - where to copy them
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_meta_read(FS3TrackIndex trk, FS3SectorIndex sct, int off, int len, void *dst) {
+    char *buf = fs3_pin_sector(trk, sct, FS3_PIN_READ);
+
+    if (buf == NULL) {
+        return(-1);
+    }
+    memcpy(dst, buf + off, len);
+    return(fs3_unpin_sector(trk, sct));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_meta_write
+// Description  : Copy bytes into a sector, replacing the rest of it with
+//                zeros when whole is set instead of reading it in first
+//
+// Inputs       : trk, sct - the sector
+//                off, len - the bytes to copy
+//                src - the bytes
+//                whole - non-zero if the sector holds nothing else
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_meta_write(FS3TrackIndex trk, FS3SectorIndex sct, int off, int len, const void *src, int whole) {
+    char *buf = fs3_pin_sector(trk, sct, whole ? FS3_PIN_OVERWRITE : FS3_PIN_WRITE);
+
+    if (buf == NULL) {
+        return(-1);
+    }
+    if (whole) {
+        memset(buf, 0x0, FS3_SECTOR_SIZE);
+    }
+    memcpy(buf + off, src, len);
+    return(fs3_unpin_sector(trk, sct));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_meta_entry_io
+// Description  : Read or write one directory entry
+//
+// Inputs       : slot - the directory slot
+//                entry - the entry to fill or write
+//                write - non-zero to write
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_meta_entry_io(int slot, FS3DirEntry *entry, int write) {
+    FS3SectorIndex sct = FS3_META_DIR_SECTOR + slot / FS3_META_DIR_PER_SECTOR;
+    int off = (slot % FS3_META_DIR_PER_SECTOR) * sizeof(FS3DirEntry);
+
+    if (write) {
+        return(fs3_meta_write(FS3_META_TRACK, sct, off, sizeof(FS3DirEntry), entry, 0));
+    }
+    return(fs3_meta_read(FS3_META_TRACK, sct, off, sizeof(FS3DirEntry), entry));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_meta_mount
+// Description  : Load the superblock and free-space bitmap, or format an
+//                empty filesystem when the disk does not hold one
+//
+// Inputs       : none
+// Outputs      : 1 if a filesystem was loaded, 0 if formatted, -1 if failure
+
+int fs3_meta_mount(void) {
+    uint64_t map[FS3_META_TRACKS_PER_SECTOR][FS3_ALLOC_TRACK_WORDS];
+
+    memset(metaResident, 0x0, sizeof(metaResident));
+    if (fs3_meta_read(FS3_META_TRACK, FS3_META_SUPER_SECTOR, 0, sizeof(metaSuper), &metaSuper) == -1) {
+        return(-1);
+    }
+    fs3_alloc_init();
+    if ((metaSuper.magic == FS3_META_MAGIC) && (metaSuper.version == FS3_META_VERSION) &&
+        (metaSuper.entrySize == sizeof(FS3DirEntry))) {
+        for (int s = 0; s < FS3_META_BITMAP_SECTORS; s++) {
+            if (fs3_meta_read(FS3_META_TRACK, FS3_META_BITMAP_SECTOR + s, 0, sizeof(map), map) == -1) {
+                return(-1);
+            }
+            for (int t = s * FS3_META_TRACKS_PER_SECTOR; (t < FS3_MAX_TRACKS) && (t < (s + 1) * FS3_META_TRACKS_PER_SECTOR); t++) {
+                fs3_alloc_load(t, map[t % FS3_META_TRACKS_PER_SECTOR]);
+            }
+        }
+        logMessage(FS3DriverLLevel, "Mounted FS3 filesystem, %u files, checkpoint %u",
+                   metaSuper.files, metaSuper.checkpoints);
+        fs3_crc_mount((metaSuper.features & FS3_META_FEATURE_CRC) != 0, 0);
+        return(1);
+    }
+
+    // No filesystem, start an empty one with the reserved sectors taken
+    memset(&metaSuper, 0x0, sizeof(metaSuper));
+    metaSuper.magic = FS3_META_MAGIC;
+    metaSuper.version = FS3_META_VERSION;
+    metaSuper.entrySize = sizeof(FS3DirEntry);
+    fs3_alloc_mark(FS3_META_TRACK, 0, FS3_META_RESERVED);
+    if (fs3_crc_checking()) {
+        metaSuper.features |= FS3_META_FEATURE_CRC;
+        for (int t = 0; t < FS3_MAX_TRACKS; t++) {
+            fs3_alloc_mark(t, FS3_CRC_FIRST_SECTOR, FS3_CRC_SECTORS);
+        }
+    }
+    fs3_crc_mount(fs3_crc_checking(), 1);
+    logMessage(FS3DriverLLevel, "Formatted empty FS3 filesystem");
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_meta_find
+// Description  : Look a path up in the directory by linear probing from
+//                its hash slot.  Slots the driver already has loaded are
+//                skipped, it looks those up in memory first.
+//
+// Inputs       : path - the path
+//                hash - the driver's hash of path
+//                entry - where to store the directory entry
+// Outputs      : the slot, -1 if the path is not on disk
+
+int fs3_meta_find(const char *path, uint32_t hash, FS3DirEntry *entry) {
+    for (int i = 0; i < FS3_MAX_TOTAL_FILES; i++) {
+        int slot = (hash + i) % FS3_MAX_TOTAL_FILES;
+        if (!(metaSuper.slotUsed[SLOT_WORD(slot)] & SLOT_BIT(slot))) {
+            return(-1);                         // end of the probe chain
+        }
+        if (metaResident[SLOT_WORD(slot)] & SLOT_BIT(slot)) {
+            continue;
+        }
+        if (fs3_meta_entry_io(slot, entry, 0) == -1) {
+            return(-1);
+        }
+        if (strncmp(entry->path, path, FS3_MAX_PATH_LENGTH) == 0) {
+            metaResident[SLOT_WORD(slot)] |= SLOT_BIT(slot);
+            return(slot);
+        }
+    }
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_meta_claim
+// Description  : Take the first free directory slot on a hash's probe chain
+//
+// Inputs       : hash - the driver's hash of the new file's path
+// Outputs      : the slot, -1 if the directory is full
+
+int fs3_meta_claim(uint32_t hash) {
+    for (int i = 0; i < FS3_MAX_TOTAL_FILES; i++) {
+        int slot = (hash + i) % FS3_MAX_TOTAL_FILES;
+        if (!(metaSuper.slotUsed[SLOT_WORD(slot)] & SLOT_BIT(slot))) {
+            metaSuper.slotUsed[SLOT_WORD(slot)] |= SLOT_BIT(slot);
+            metaResident[SLOT_WORD(slot)] |= SLOT_BIT(slot);
+            metaSuper.files++;
+            return(slot);
+        }
+    }
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_meta_load_map
+// Description  : Read a file's extent map
+//
+// Inputs       : entry - the file's directory entry
+//                ext - room for entry->extents runs
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_meta_load_map(const FS3DirEntry *entry, FS3DiskExtent *ext) {
+    uint32_t done = 0;
+
+    for (int i = 0; (i < entry->mapSectors) && (done < entry->extents); i++) {
+        uint32_t n = entry->extents - done;
+        if (n > FS3_META_EXTENTS_PER_SECTOR) {
+            n = FS3_META_EXTENTS_PER_SECTOR;
+        }
+        if (fs3_meta_read(entry->mapTrack, entry->mapSector + i, 0, n * sizeof(FS3DiskExtent), &ext[done]) == -1) {
+            return(-1);
+        }
+        done += n;
+    }
+    return((done == entry->extents) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_meta_store
+// Description  : Write a file's extent map to a fresh run of sectors and
+//                its directory entry to its slot, and only then free the
+//                old map; with no map given only the entry is written
+//
+// Inputs       : slot - the file's directory slot
+//                entry - the entry, its map location is updated
+//                ext - entry->extents runs, NULL to keep the current map
+// Outputs      : 0 if successful, -1 if failure (the old map is kept)
+
+int fs3_meta_store(int slot, FS3DirEntry *entry, const FS3DiskExtent *ext) {
+    int sectors = (entry->extents + FS3_META_EXTENTS_PER_SECTOR - 1) / FS3_META_EXTENTS_PER_SECTOR;
+    FS3DirEntry old = *entry;
+    FS3TrackIndex trk = 0;
+    FS3SectorIndex sct = 0;
+
+    if ((slot < 0) || (slot >= FS3_MAX_TOTAL_FILES)) {
+        return(-1);
+    }
+    if (ext == NULL) {
+        return(fs3_meta_entry_io(slot, entry, 1));
+    }
+    if ((sectors > 0) && (fs3_alloc_exact(sectors, &trk, &sct) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "No room for a %d sector extent map", sectors);
+        return(-1);
+    }
+    for (int i = 0; i < sectors; i++) {
+        uint32_t n = entry->extents - i * FS3_META_EXTENTS_PER_SECTOR;
+        if (n > FS3_META_EXTENTS_PER_SECTOR) {
+            n = FS3_META_EXTENTS_PER_SECTOR;
+        }
+        if (fs3_meta_write(trk, sct + i, 0, n * sizeof(FS3DiskExtent),
+                           &ext[i * FS3_META_EXTENTS_PER_SECTOR], 1) == -1) {
+            fs3_alloc_free(trk, sct, sectors);
+            return(-1);
+        }
+    }
+    entry->mapTrack = trk;
+    entry->mapSector = sct;
+    entry->mapSectors = sectors;
+    if (fs3_meta_entry_io(slot, entry, 1) == -1) {
+        fs3_alloc_free(trk, sct, sectors);
+        *entry = old;
+        return(-1);
+    }
+    if (old.mapSectors > 0) {
+        fs3_alloc_free(old.mapTrack, old.mapSector, old.mapSectors);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_meta_checkpoint
+// Description  : Write the free-space bitmap and then the superblock
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_meta_checkpoint(void) {
+    for (int s = 0; s < FS3_META_BITMAP_SECTORS; s++) {
+        uint64_t map[FS3_META_TRACKS_PER_SECTOR][FS3_ALLOC_TRACK_WORDS];
+        memset(map, 0x0, sizeof(map));
+        for (int t = s * FS3_META_TRACKS_PER_SECTOR; (t < FS3_MAX_TRACKS) && (t < (s + 1) * FS3_META_TRACKS_PER_SECTOR); t++) {
+            fs3_alloc_map(t, map[t % FS3_META_TRACKS_PER_SECTOR]);
+        }
+        if (fs3_meta_write(FS3_META_TRACK, FS3_META_BITMAP_SECTOR + s, 0, sizeof(map), map, 1) == -1) {
+            return(-1);
+        }
+    }
+    metaSuper.checkpoints++;
+    return(fs3_meta_write(FS3_META_TRACK, FS3_META_SUPER_SECTOR, 0, sizeof(metaSuper), &metaSuper, 1));
+}
@@ -0,0 +1,109 @@
+#ifndef FS3_META_INCLUDED
+#define FS3_META_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_meta.h
+//  Description    : This is the interface for the FS3 on-disk metadata.
+//                   The first sectors of track 0 are reserved for a
+//                   superblock, the free-space bitmap and a directory of
+//                   FS3_MAX_TOTAL_FILES slots hashed by path.  Each file's
+//                   extent map lives in a run of sectors of its own that
+//                   its directory entry points at.
+//
+//                   Layout of track 0:
+//                     sector 0                 superblock
+//                     sectors 1 .. 8           bitmap, 8 tracks per sector
+//                     sectors 9 .. 155         directory, 7 entries per sector
+//
+//                   A disk formatted with sector checksums also keeps the
+//                   last FS3_CRC_SECTORS sectors of every track for them
+//                   (see fs3_crc.h).
+//
+//                   Everything is stored in host byte order.  Callers
+//                   serialize these functions (the driver holds its file
+//                   table lock).
+//
+
+// Include
+#include <stdint.h>
+#include <fs3_controller.h>
+#include <fs3_driver.h>
+#include <fs3_alloc.h>
+
+// Defines
+#define FS3_META_MAGIC 0x46533344           // "FS3D"
+#define FS3_META_VERSION 1
+#define FS3_META_TRACK 0                    // Track holding the reserved sectors
+#define FS3_META_SUPER_SECTOR 0
+#define FS3_META_BITMAP_SECTOR 1
+#define FS3_META_TRACKS_PER_SECTOR (FS3_SECTOR_SIZE / (FS3_ALLOC_TRACK_WORDS * 8))
+#define FS3_META_BITMAP_SECTORS ((FS3_MAX_TRACKS + FS3_META_TRACKS_PER_SECTOR - 1) / FS3_META_TRACKS_PER_SECTOR)
+#define FS3_META_DIR_SECTOR (FS3_META_BITMAP_SECTOR + FS3_META_BITMAP_SECTORS)
+#define FS3_META_DIR_PER_SECTOR (FS3_SECTOR_SIZE / sizeof(FS3DirEntry))
+#define FS3_META_DIR_SECTORS ((FS3_MAX_TOTAL_FILES + FS3_META_DIR_PER_SECTOR - 1) / FS3_META_DIR_PER_SECTOR)
+#define FS3_META_RESERVED (FS3_META_DIR_SECTOR + FS3_META_DIR_SECTORS)     // Sectors never given to files
+#define FS3_META_EXTENTS_PER_SECTOR (FS3_SECTOR_SIZE / sizeof(FS3DiskExtent))
+#define FS3_META_SLOT_WORDS (FS3_MAX_TOTAL_FILES / 64)
+#define FS3_META_FEATURE_CRC 0x1            // Sectors have CRC32C checksums
+
+// One run of a file's sectors in its on-disk extent map
+typedef struct {
+
+    uint16_t track;         // Track the run is on
+    uint16_t start;         // First sector of the run
+    uint16_t length;        // Sectors in the run
+    uint16_t reserved;
+
+} FS3DiskExtent;
+
+// One file in the directory
+typedef struct {
+
+    char path[FS3_MAX_PATH_LENGTH];     // Not terminated when it fills the field
+    uint32_t length;                    // File length in bytes
+    uint32_t extents;                   // Runs in the extent map
+    uint16_t mapTrack;                  // Where the extent map is
+    uint16_t mapSector;
+    uint16_t mapSectors;                // 0 when the file has no sectors
+    uint16_t reserved;
+
+} FS3DirEntry;
+
+// Sector 0 of the disk
+typedef struct {
+
+    uint32_t magic;                     // FS3_META_MAGIC once formatted
+    uint16_t version;                   // FS3_META_VERSION
+    uint16_t entrySize;                 // sizeof(FS3DirEntry), catches layout changes
+    uint32_t files;                     // Directory slots in use
+    uint32_t checkpoints;               // Times the metadata has been written
+    uint64_t slotUsed[FS3_META_SLOT_WORDS];     // Set bit = directory slot in use
+    uint32_t features;                  // FS3_META_FEATURE_ flags, 0 on older disks
+
+} FS3SuperBlock;
+
+//
+// Metadata Functions
+
+int fs3_meta_mount(void);
+    // Read the superblock and bitmap, formatting an empty filesystem if the
+    // disk has none; returns 1 if one was found, 0 if formatted, -1 on error
+
+int fs3_meta_find(const char *path, uint32_t hash, FS3DirEntry *entry);
+    // Look a path up in the on-disk directory, skipping slots already
+    // loaded; returns its slot and entry, -1 if it is not there
+
+int fs3_meta_claim(uint32_t hash);
+    // Take a directory slot for a new file, -1 if the directory is full
+
+int fs3_meta_load_map(const FS3DirEntry *entry, FS3DiskExtent *ext);
+    // Read a file's extent map into ext (room for entry->extents runs)
+
+int fs3_meta_store(int slot, FS3DirEntry *entry, const FS3DiskExtent *ext);
+    // Write a file's extent map (to new sectors) and directory entry, then
+    // free the entry's old map; ext NULL writes only the entry
+
+int fs3_meta_checkpoint(void);
+    // Write the bitmap and superblock
+#endif
@@ -0,0 +1,456 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_sched.c
+//  Description    : This is the implementation of the FS3 request queue.
+//                   The controller only moves one sector per command and
+//                   needs a TSEEK first, so the scheduler's job is to make
+//                   as few seeks as possible: it remembers the track the
+//                   head is on, coalesces repeated writes to a sector and
+//                   sends queued writes in a single C-LOOK sweep.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_sched.h>
+#include <fs3_slab.h>
+#include <fs3_controller.h>
+
+//
+// Support Macros/Data
+
+#define SCHED_NO_TRACK (-1)             // head position not known
+
+// Pack a command block (op<<60 | sec<<44 | trk<<12) and get its return bit
+#define SCHED_CMD(op, sec, trk) \
+    (((FS3CmdBlk)(op) << 60) | ((FS3CmdBlk)(sec) << 44) | ((FS3CmdBlk)(trk) << 12))
+#define SCHED_RET(cmd) ((int)(((cmd) >> 11) & 0x1))
+
+// Order of requests on the disk
+#define SCHED_KEY(trk, sct) ((((uint32_t)(trk)) << 16) | (uint32_t)(sct))
+
+// A thread's plugging, the queue may hold writes of several threads
+struct schedOwner {
+    int plugs;                          // plug nesting depth
+    int failed;                         // a queued write of the thread failed
+};
+
+// A write held in the queue
+struct schedRequest {
+    FS3TrackIndex track;
+    FS3SectorIndex sector;
+    void *buffer;                       // slab copy of the data to write
+    struct schedOwner *owner;           // plugged thread told if it fails, NULL once told
+};
+
+pthread_mutex_t schedLock = PTHREAD_MUTEX_INITIALIZER;   // the controller and the queue
+FS3SchedController schedController = fs3_syscall;    // carries out commands
+FS3SchedWritten schedWritten = NULL;    // told of each sector written
+struct schedRequest schedQueue[FS3_SCHED_QUEUE_DEPTH];
+int schedCount = 0;                     // writes queued
+static __thread struct schedOwner schedMine;
+int32_t schedTrack = SCHED_NO_TRACK;    // track the head is on
+FS3SchedStats schedStats;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_dispatch
+// Description  : Send one sector command to the controller, seeking first
+//                only if the head is on another track
+//
+// Inputs       : opcode - FS3_OP_RDSECT or FS3_OP_WRSECT
+//                trk - the track of the sector
+//                sct - the sector
+//                buf - the sector data
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_sched_dispatch(uint8_t opcode, FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    FS3CmdBlk command;
+
+    if (schedTrack != (int32_t)trk) {
+        command = schedController(SCHED_CMD(FS3_OP_TSEEK, 0, trk), NULL);
+        schedStats.seeks++;
+        if (SCHED_RET(command)) {
+            logMessage(LOG_ERROR_LEVEL, "seek to track %d failed", trk);
+            schedTrack = SCHED_NO_TRACK;
+            return(-1);
+        }
+        schedTrack = trk;
+    } else {
+        schedStats.seeksElided++;
+    }
+    command = schedController(SCHED_CMD(opcode, sct, 0), buf);
+    if (opcode == FS3_OP_RDSECT) {
+        schedStats.reads++;
+    } else {
+        schedStats.writes++;
+    }
+    if (SCHED_RET(command)) {
+        logMessage(LOG_ERROR_LEVEL, "sector op %d on [%d/%d] failed", opcode, trk, sct);
+        return(-1);
+    }
+    if ((opcode == FS3_OP_WRSECT) && (schedWritten != NULL)) {
+        schedWritten(trk, sct, buf);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_key_order
+// Description  : qsort comparison putting requests in (track, sector) order
+//
+// Inputs       : a, b - pointers to the requests to compare
+// Outputs      : <0, 0, >0 as a sorts before, with or after b
+
+static int fs3_sched_key_order(const void *a, const void *b) {
+    const struct schedRequest *ra = (const struct schedRequest *)a;
+    const struct schedRequest *rb = (const struct schedRequest *)b;
+    uint32_t ka = SCHED_KEY(ra->track, ra->sector);
+    uint32_t kb = SCHED_KEY(rb->track, rb->sector);
+
+    return((ka > kb) - (ka < kb));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_run
+// Description  : Dispatch every queued write in one C-LOOK sweep, from the
+//                head's track upwards and then wrapping to the lowest track.
+//                A write that fails is reported to the thread that queued
+//                it, which is still plugged, and stays queued: the cache
+//                took it as written, so the queue holds the only copy.  A
+//                retry that fails again is only logged and counted, it is
+//                not the fault of whoever runs the batch; fs3_sync and the
+//                unmount report it
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if any write failed
+
+static int fs3_sched_run(void) {
+    int start = 0, kept = 0, result = 0;
+
+    if (schedCount == 0) {
+        return(0);
+    }
+    qsort(schedQueue, schedCount, sizeof(struct schedRequest), fs3_sched_key_order);
+    while ((start < schedCount) && ((int32_t)schedQueue[start].track < schedTrack)) {
+        start++;
+    }
+    for (int i = 0; i < schedCount; i++) {
+        struct schedRequest *req = &schedQueue[(start + i) % schedCount];
+        if (fs3_sched_dispatch(FS3_OP_WRSECT, req->track, req->sector, req->buffer) == -1) {
+            if (req->owner != NULL) {
+                req->owner->failed = 1;
+                req->owner = NULL;
+            } else {
+                logMessage(LOG_ERROR_LEVEL, "retried write of sector [%d/%d] failed again", req->track, req->sector);
+                schedStats.stuck++;
+            }
+            result = -1;
+            continue;
+        }
+        fs3_slab_free(req->buffer);
+        req->buffer = NULL;
+    }
+    for (int i = 0; i < schedCount; i++) {
+        if (schedQueue[i].buffer != NULL) {
+            schedQueue[kept++] = schedQueue[i];
+        }
+    }
+    schedCount = kept;
+    schedStats.batches++;
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_find
+// Description  : Find a queued write to a sector
+//
+// Inputs       : trk - the track of the sector
+//                sct - the sector
+// Outputs      : the queued request, NULL if there is none
+
+static struct schedRequest *fs3_sched_find(FS3TrackIndex trk, FS3SectorIndex sct) {
+    for (int i = 0; i < schedCount; i++) {
+        if ((schedQueue[i].track == trk) && (schedQueue[i].sector == sct)) {
+            return(&schedQueue[i]);
+        }
+    }
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_set_controller
+// Description  : Select the controller commands are sent to
+//
+// Inputs       : controller - the controller, NULL for fs3_syscall
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_sched_set_controller(FS3SchedController controller) {
+    pthread_mutex_lock(&schedLock);
+    schedController = (controller != NULL) ? controller : fs3_syscall;
+    schedTrack = SCHED_NO_TRACK;
+    pthread_mutex_unlock(&schedLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_set_written
+// Description  : Select the function told of each sector once written
+//
+// Inputs       : written - the function, NULL for none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_sched_set_written(FS3SchedWritten written) {
+    pthread_mutex_lock(&schedLock);
+    schedWritten = written;
+    pthread_mutex_unlock(&schedLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_command
+// Description  : Send a command to the controller as is
+//
+// Inputs       : cmdblock - the command
+//                buf - the command's data, if any
+// Outputs      : the command block the controller returned
+
+FS3CmdBlk fs3_sched_command(FS3CmdBlk cmdblock, void *buf) {
+    FS3CmdBlk command;
+
+    pthread_mutex_lock(&schedLock);
+    command = schedController(cmdblock, buf);
+    pthread_mutex_unlock(&schedLock);
+    return(command);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_init
+// Description  : Start scheduling on a freshly mounted disk
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_sched_init(void) {
+    pthread_mutex_lock(&schedLock);
+    schedCount = 0;
+    schedTrack = SCHED_NO_TRACK;
+    pthread_mutex_unlock(&schedLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_close
+// Description  : Dispatch anything still queued and forget the head; a
+//                write that fails now is given up on
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_sched_close(void) {
+    int result;
+
+    pthread_mutex_lock(&schedLock);
+    result = fs3_sched_run();
+    for (int i = 0; i < schedCount; i++) {
+        logMessage(LOG_ERROR_LEVEL, "giving up on the write of sector [%d/%d]",
+                   schedQueue[i].track, schedQueue[i].sector);
+        fs3_slab_free(schedQueue[i].buffer);
+    }
+    schedCount = 0;
+    schedTrack = SCHED_NO_TRACK;
+    pthread_mutex_unlock(&schedLock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_queue_io
+// Description  : Read or write a sector.  While the calling thread is
+//                plugged a write is copied into the queue (replacing any
+//                queued write to the same sector, which it then owns) and
+//                a read of a queued sector is served from it.  An unplugged
+//                write to a queued sector is sent at once with the queued
+//                copy, which is done with if it succeeds.  Called with
+//                schedLock held
+//
+// Inputs       : opcode - FS3_OP_RDSECT or FS3_OP_WRSECT
+//                trk - the track of the sector
+//                sct - the sector
+//                buf - the sector data, free to reuse once this returns
+// Outputs      : 0 if successful, 1 if a read was served from the queue,
+//                -1 if failure
+
+static int fs3_sched_queue_io(uint8_t opcode, FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    struct schedRequest *req = fs3_sched_find(trk, sct);
+    void *copy;
+
+    if ((opcode != FS3_OP_RDSECT) && (opcode != FS3_OP_WRSECT)) {
+        return(-1);
+    }
+    if (req != NULL) {
+        schedStats.merged++;
+        if (opcode == FS3_OP_RDSECT) {
+            memcpy(buf, req->buffer, FS3_SECTOR_SIZE);
+            return(1);
+        }
+        memcpy(req->buffer, buf, FS3_SECTOR_SIZE);
+        if (schedMine.plugs > 0) {
+            req->owner = &schedMine;
+            return(0);
+        }
+        if (fs3_sched_dispatch(opcode, trk, sct, req->buffer) == -1) {
+            return(-1);
+        }
+        fs3_slab_free(req->buffer);
+        *req = schedQueue[--schedCount];
+        return(0);
+    }
+    if ((opcode == FS3_OP_RDSECT) || (schedMine.plugs == 0)) {
+        return(fs3_sched_dispatch(opcode, trk, sct, buf));
+    }
+
+    // Queue the write, running the batch first if the queue is full (it
+    // may still be, with writes that keep failing)
+    if (schedCount == FS3_SCHED_QUEUE_DEPTH) {
+        fs3_sched_run();
+    }
+    if ((schedCount == FS3_SCHED_QUEUE_DEPTH) || ((copy = fs3_slab_alloc()) == NULL)) {
+        return(fs3_sched_dispatch(opcode, trk, sct, buf));
+    }
+    memcpy(copy, buf, FS3_SECTOR_SIZE);
+    schedQueue[schedCount].track = trk;
+    schedQueue[schedCount].sector = sct;
+    schedQueue[schedCount].buffer = copy;
+    schedQueue[schedCount].owner = &schedMine;
+    schedCount++;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_io
+// Description  : Read or write a sector, one caller at a time reaching the
+//                controller
+//
+// Inputs       : as fs3_sched_queue_io
+// Outputs      : as fs3_sched_queue_io
+
+int fs3_sched_io(uint8_t opcode, FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    int result;
+
+    pthread_mutex_lock(&schedLock);
+    result = fs3_sched_queue_io(opcode, trk, sct, buf);
+    pthread_mutex_unlock(&schedLock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_plug
+// Description  : Start holding the calling thread's writes back until its
+//                matching unplug
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_sched_plug(void) {
+    if (schedMine.plugs++ == 0) {
+        schedMine.failed = 0;
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_unplug
+// Description  : Release one of the calling thread's plugs; the outermost
+//                dispatches the queue, other threads' writes included
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure or one of the thread's
+//                queued writes failed
+
+int fs3_sched_unplug(void) {
+    if (schedMine.plugs == 0) {
+        return(-1);
+    }
+    if (--schedMine.plugs > 0) {
+        return(0);
+    }
+    pthread_mutex_lock(&schedLock);
+    fs3_sched_run();
+    pthread_mutex_unlock(&schedLock);
+    return(schedMine.failed ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_stuck
+// Description  : Count the queued writes that failed and wait for a retry
+//
+// Inputs       : none
+// Outputs      : the number of them
+
+int fs3_sched_stuck(void) {
+    int count = 0;
+
+    pthread_mutex_lock(&schedLock);
+    for (int i = 0; i < schedCount; i++) {
+        if (schedQueue[i].owner == NULL) {
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&schedLock);
+    return(count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_stats
+// Description  : Get the scheduler counters
+//
+// Inputs       : stats - where to store the counters
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_sched_stats(FS3SchedStats *stats) {
+    if (stats == NULL) {
+        return(-1);
+    }
+    pthread_mutex_lock(&schedLock);
+    *stats = schedStats;
+    pthread_mutex_unlock(&schedLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_log_sched_metrics
+// Description  : Log the scheduler counters
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_log_sched_metrics(void) {
+    FS3SchedStats stats;
+
+    fs3_sched_stats(&stats);
+    logMessage(FS3DriverLLevel, "\nSeeks: %lu (%lu elided)\nSector reads: %lu\nSector writes: %lu\nMerged requests: %lu\nWrite batches: %lu\nFailed retries: %lu",
+        (unsigned long)stats.seeks, (unsigned long)stats.seeksElided,
+        (unsigned long)stats.reads, (unsigned long)stats.writes,
+        (unsigned long)stats.merged, (unsigned long)stats.batches,
+        (unsigned long)stats.stuck);
+    return(0);
+}
@@ -0,0 +1,87 @@
+#ifndef FS3_SCHED_INCLUDED
+#define FS3_SCHED_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_sched.h
+//  Description    : This is the interface for the request queue that sits
+//                   between the FS3 driver and the controller.  It tracks
+//                   the head position so a TSEEK is only issued when the
+//                   track changes, and while plugged it holds writes back
+//                   and dispatches them as one C-LOOK ordered batch.
+//                   A lock keeps callers on several threads from reaching
+//                   the controller at once.
+//
+
+// Include
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_SCHED_QUEUE_DEPTH 64    // Writes held before a plugged queue is run
+
+// Function that carries out a controller command, fs3_syscall by default
+typedef FS3CmdBlk (*FS3SchedController)(FS3CmdBlk cmdblock, void *buf);
+
+// Function told of each sector the controller has written, with the data
+typedef int (*FS3SchedWritten)(FS3TrackIndex trk, FS3SectorIndex sct, const void *buf);
+
+// Counters kept by the scheduler
+typedef struct {
+
+    uint64_t seeks;         // TSEEKs sent to the controller
+    uint64_t seeksElided;   // TSEEKs skipped, head already on the track
+    uint64_t reads;         // Sector reads sent to the controller
+    uint64_t writes;        // Sector writes sent to the controller
+    uint64_t merged;        // Requests satisfied by a queued write
+    uint64_t batches;       // Plugged queues dispatched
+    uint64_t stuck;         // Retries of failed writes that failed again
+
+} FS3SchedStats;
+
+//
+// Scheduler Functions
+
+int fs3_sched_set_controller(FS3SchedController controller);
+    // Send commands to another controller (NULL for fs3_syscall), set
+    // before mounting
+
+int fs3_sched_set_written(FS3SchedWritten written);
+    // Call written (NULL for none) after every successful sector write,
+    // queued ones when they are dispatched; it runs with the scheduler
+    // locked and must not call back into it
+
+FS3CmdBlk fs3_sched_command(FS3CmdBlk cmdblock, void *buf);
+    // Send a command as is (MOUNT, UMOUNT) to the controller
+
+int fs3_sched_init(void);
+    // Start scheduling on a freshly mounted disk, head position unknown
+
+int fs3_sched_close(void);
+    // Dispatch anything queued, giving up on writes that fail again, and
+    // forget the head position
+
+int fs3_sched_io(uint8_t opcode, FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+    // Read or write a sector; writes are queued (buffer copied) while the
+    // calling thread is plugged.  A read served from a queued write,
+    // which is not on the disk yet, returns 1
+
+int fs3_sched_plug(void);
+    // Start holding the calling thread's writes back, calls nest
+
+int fs3_sched_unplug(void);
+    // Stop holding the thread's writes back, the outermost call dispatches
+    // the queue; -1 if any write the thread queued failed (it stays queued
+    // and is tried again with the next batch)
+
+int fs3_sched_stuck(void);
+    // Count the failed writes still queued for a retry, which no thread
+    // is told of when they fail again
+
+int fs3_sched_stats(FS3SchedStats *stats);
+    // Get the scheduler counters
+
+int fs3_log_sched_metrics(void);
+    // Log the scheduler counters
+
+#endif
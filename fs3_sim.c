@@ -10,32 +10,66 @@
 
 // Include Files
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Project Includes
 #include <fs3_driver.h>
 #include <fs3_controller.h>
 #include <fs3_cache.h>
+#include <fs3_slab.h>
+#include <fs3_sched.h>
+#include <fs3_image.h>
+#include <fs3_workload.h>
+#include <fs3_digest.h>
+#include <fs3_crc.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
 #define FS3_WORKLOAD_DIR "workload"
-#define FS3_SIM_MAX_OPEN_FILES 128
-#define FS3_ARGUMENTS "huvc:l:"
+#define FS3_SIM_MAX_OPEN_FILES FS3_MAX_TOTAL_FILES
+#define FS3_SIM_MAX_LINE 2048      // A path, a command and up to 1023 bytes of text
+#define FS3_SIM_MAX_TEXT 1024      // Text of a write is shorter than this
+#define FS3_SIM_RING_SIZE 256      // Commands the parser may run ahead (power of two)
+#define FS3_SIM_MAX_VALIDATORS 64  // Most threads validating files
+#define FS3_ARGUMENTS "huvwgc:l:p:s:i:b:Pt:dqCS:"
 #define USAGE \
-	"USAGE: fs3_sim [-h] [-v] [-c <cache size>] [-l <logfile>] <workload-file>\n" \
+	"USAGE: fs3_sim [-h] [-v] [-w] [-g] [-c <cache size>] [-p <policy>] [-s <shards>] [-i <image>] [-b <log>] [-P] [-t <threads>] [-d] [-q] [-C] [-S <stats>] [-l <logfile>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
+	"    -w - use a write-back cache (default is write-through)\n" \
+	"    -g - back sector buffers with huge pages where available\n" \
 	"    -c - set the cache size (in number of sectors)\n" \
+	"    -p - set the cache replacement policy (lru, fifo, direct, clock, 2q, arc)\n" \
+	"    -s - split the cache into this many locked shards (power of two)\n" \
+	"    -i - run on a fresh disk image file <image> instead of the controller\n" \
+	"    -b - compile the workload into the binary op log <log> and exit;\n" \
+	"         a compiled log can be run in place of the text workload\n" \
+	"    -P - parse a text workload on a thread of its own, ahead of the\n" \
+	"         commands being run (pipelined replay)\n" \
+	"    -t - validate files on this many threads (default is one per CPU)\n" \
+	"    -d - dump every file to a .cmm copy, not just those that fail\n" \
+	"    -q - quick validation, trust a file whose digest matches rather\n" \
+	"         than read it back\n" \
+	"    -C - format the disk with CRC32C sector checksums, checked as\n" \
+	"         sectors are read into the cache\n" \
+	"    -S - keep detailed cache statistics and write them to <stats> as\n" \
+	"         JSON (\"-\" for stdout) once the cache is closed\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
 	"\n" \
 	"    <workload-file> - file contain the workload to simulate\n" \
@@ -47,16 +81,63 @@ typedef struct {
 	int16_t   fhandle;   // This is a file handle for the opened file
 } FS3SimulationTable;
 
+// A decoded workload command, as the parser hands it to the executor
+typedef struct {
+	FS3WorkloadCommand command;	// What to do
+	int       slot;      // File table entry of the file
+	int       open;      // First command on the file, open it
+	int32_t   len;       // Bytes to read or write
+	int32_t   off;       // Position for SEEK and WRITEAT
+	char      text[FS3_SIM_MAX_TEXT];	// Text to write, decoded
+} FS3SimulationOp;
+
+// The ring between the stages of a pipelined replay; one thread fills
+// slots and the other empties them, so the counters need no lock
+typedef struct {
+	FS3SimulationOp ring[FS3_SIM_RING_SIZE];
+	uint64_t  head __attribute__((aligned(64)));	// Commands published by the parser
+	uint64_t  tail __attribute__((aligned(64)));	// Commands run by the executor
+	int       parsed;    // 1 when the parser is done, -1 if it failed
+	int       failed;    // Set when the executor fails, stops the parser
+	FILE     *fhandle;   // The workload
+	FS3SimulationTable *ftable;
+} FS3SimulationPipe;
+
+// Work shared by the validation threads
+typedef struct {
+	FS3SimulationTable *ftable;
+	int       next;      // Next file table entry to check
+	int       failed;    // Files that did not validate
+} FS3SimulationCheck;
+
 //
 // Global Data
 int verbose;
 uint16_t fs3CacheSize = FS3_DEFAULT_CACHE_SIZE; 
+int fs3ImageController = 0;   // running on a disk image (-i)
+int fs3Pipelined = 0;         // parse text workloads on a thread of their own (-P)
+int fs3Validators = 0;        // threads validating files, 0 is one per CPU (-t)
+int fs3DumpFiles = 0;         // dump files that validate too (-d)
+int fs3DigestOnly = 0;        // skip the read-back when the digests match (-q)
+char *fs3CacheStats = NULL;   // where to write the detailed cache statistics (-S)
 
 //
 // Functional Prototypes
 
 int simulate_FS3( char *wload );              // control loop of the FS3 simulation
+int parse_FS3_line( char *line, int linecount, FS3SimulationTable *ftable, FS3SimulationOp *op );   // decode a line
+int execute_FS3_op( FS3SimulationOp *op, FS3SimulationTable *ftable );  // run a decoded command
+int replay_FS3_text( FILE *fhandle, FS3SimulationTable *ftable );   // run a text workload
+void *parse_FS3_thread( void *arg );                                // parser stage of a pipelined replay
+int replay_FS3_pipelined( FILE *fhandle, FS3SimulationTable *ftable );  // run a text workload pipelined
+int replay_FS3_log( FS3Workload *log, FS3SimulationTable *ftable ); // run a compiled workload
+void close_workload( FILE *fhandle, FS3Workload *log );             // close either kind
+int validate_FS3_files( FS3SimulationTable *ftable );               // validate every file, in parallel
+void *validate_FS3_thread( void *arg );                             // a validation worker
 int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesystem
+int digest_file(int fh, int32_t size, uint64_t *digest);           // digest of a reference file
+size_t fs3_sim_mismatch( const char *a, const char *b, size_t len ); // first differing byte
+int dump_file(char *fname, int16_t mfh, int32_t size);              // write a .cmm copy of a file
 
 //
 // Functions
@@ -73,7 +154,8 @@ int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesyst
 int main( int argc, char *argv[] ) {
 
 	// Local variables
-	int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
+	int ch, verbose = 0, log_initialized = 0, unit_tests = 0, policy, shards;
+	char *compile = NULL;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, FS3_ARGUMENTS)) != -1) {
@@ -87,6 +169,14 @@ int main( int argc, char *argv[] ) {
 			verbose = 1;
 			break;
 
+		case 'w': // Write-back cache flag
+			fs3_set_cache_mode( FS3_CACHE_WRITEBACK );
+			break;
+
+		case 'g': // Huge page sector buffers
+			fs3_set_slab_hugepages( 1 );
+			break;
+
 		case 'u': // Unit test Flag
 			unit_tests = 1;
 			break;
@@ -103,12 +193,77 @@ int main( int argc, char *argv[] ) {
 			}
 			break;
 
+		case 'p': // Set the cache replacement policy
+			if ( (policy = fs3_cache_policy_by_name(optarg)) == -1 ) {
+				fprintf( stderr, "Unknown cache policy [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			fs3_set_cache_policy( policy );
+			break;
+
+		case 's': // Set the number of cache shards
+			if ( (sscanf(optarg, "%d", &shards) != 1) || (fs3_set_cache_shards(shards) == -1) ) {
+				fprintf( stderr, "Bad cache shard count [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'i': // Use a disk image as the controller
+			if ( fs3_image_set_path(optarg, 1) == -1 ) {
+				fprintf( stderr, "Bad disk image path [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			fs3_sched_set_controller( fs3_image_syscall );
+			fs3ImageController = 1;
+			break;
+
+		case 'b': // Compile the workload
+			compile = optarg;
+			break;
+
+		case 'P': // Pipelined replay
+			fs3Pipelined = 1;
+			break;
+
+		case 't': // Set the number of validation threads
+			if ( (sscanf(optarg, "%d", &fs3Validators) != 1) || (fs3Validators < 1) ||
+					(fs3Validators > FS3_SIM_MAX_VALIDATORS) ) {
+				fprintf( stderr, "Bad validation thread count [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'd': // Dump all files
+			fs3DumpFiles = 1;
+			break;
+
+		case 'q': // Quick (digest only) validation
+			fs3DigestOnly = 1;
+			break;
+
+		case 'C': // Sector checksums
+			fs3_set_crc_checking( 1 );
+			break;
+
+		case 'S': // Detailed cache statistics
+			fs3CacheStats = optarg;
+			fs3_set_cache_stats( 1 );
+			break;
+
 		default:  // Default (unknown)
 			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
 			return( -1 );
 		}
 	}
 
+	// Validate on a thread per CPU unless told otherwise
+	if ( fs3Validators == 0 ) {
+		fs3Validators = sysconf( _SC_NPROCESSORS_ONLN );
+		if ( (fs3Validators < 1) || (fs3Validators > FS3_SIM_MAX_VALIDATORS) ) {
+			fs3Validators = (fs3Validators < 1) ? 1 : FS3_SIM_MAX_VALIDATORS;
+		}
+	}
+
 	// Setup the log as needed
 	if ( ! log_initialized ) {
 		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
@@ -131,6 +286,7 @@ int main( int argc, char *argv[] ) {
 			logMessage(LOG_INFO_LEVEL, "Unit tests completed successfully.\n\n");
 		} else {
 			logMessage(LOG_ERROR_LEVEL, "Unit tests failed, aborting.\n\n");
+			return( -1 );
 		}
 
 	} else {
@@ -141,7 +297,10 @@ int main( int argc, char *argv[] ) {
 			return( -1 );
 		}
 
-		// Run the simulation
+		// Compile the workload, or run the simulation
+		if ( compile != NULL ) {
+			return( fs3_workload_compile(argv[optind], compile) );
+		}
 		if ( simulate_FS3(argv[optind]) == 0 ) {
 			logMessage( LOG_INFO_LEVEL, "FS3 simulation completed successfully.\n\n" );
 		} else {
@@ -165,18 +324,20 @@ int main( int argc, char *argv[] ) {
 int simulate_FS3( char *wload ) {
 
 	// Local variables
-	char line[1024], fname[128], command[128], text[1025], *sep, *rbuf;
 	FILE *fhandle = NULL;
-	int32_t err=0, len, off, fields, linecount;
 	FS3SimulationTable ftable[FS3_SIM_MAX_OPEN_FILES];
-	int idx, i;
+	FS3Workload log;
+	struct timeval start, end;
+	int i, mapped, replayed;
 
 	// Setup the file table
 	memset(ftable, 0x0, sizeof(FS3SimulationTable)*FS3_SIM_MAX_OPEN_FILES);
 
-	// Open the workload file
-	linecount = 0;
-	if ( (fhandle=fopen(wload, "r")) == NULL ) {
+	// Open the workload file, a compiled log is mapped instead
+	if ( (mapped = fs3_workload_map(wload, &log)) == -1 ) {
+		return( -1 );
+	}
+	if ( (! mapped) && ((fhandle=fopen(wload, "r")) == NULL) ) {
 		logMessage( LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n",
 			wload, strerror(errno) );
 		return( -1 );
@@ -185,174 +346,35 @@ int simulate_FS3( char *wload ) {
 	// Startup the interface
 	if ( (fs3_mount_disk() == -1) || (fs3_init_cache(fs3CacheSize) == -1) ){
 		logMessage( LOG_ERROR_LEVEL, "FS3 simulator failed initialization.");
-		fclose( fhandle );
+		close_workload( fhandle, &log );
 		return( -1 );
 	}
 	logMessage(FS3SimulatorLLevel, "FS3 simulator initialization complete.");
 
-	// While file not done
-	while (!feof(fhandle)) {
-
-		// Get the line and bail out on fail
-		if (fgets(line, 1024, fhandle) != NULL) {
-
-			// Parse out the string
-			linecount ++;
-			fields = sscanf(line, "%s %s %d %d", fname, command, &len, &off);
-			sep = strchr(line, ':');
-			if ( (fields != 4) || (sep == NULL) ) {
-				logMessage( LOG_ERROR_LEVEL, "FS3 un-parsable workload string, aborting [%s], line %d",
-						line, linecount );
-				fclose( fhandle );
-				return( -1 );
-			}
-
-			// Just log the contents
-			logMessage(FS3SimulatorLLevel, "File [%s], command [%s], len=%d, offset=%d",
-					fname, command, len, off);
-
-			// Now walk the the table looking for the file
-			idx = -1;
-			i = 0;
-			while ( (i < FS3_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
-				if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
-					idx = i;
-				}
-				i++;
-			}
-
-			// File is not found, open the file
-			if (idx == -1) {
-
-				// Log message, find unused index and save filename for later use
-				logMessage(FS3SimulatorLLevel, "FS3_SIM : Opening file [%s]", fname);
-				idx = 0;
-				while ((ftable[idx].filename != NULL) && (idx < FS3_SIM_MAX_OPEN_FILES)) {
-					idx++;
-				}
-				CMPSC311_ASSERT1(idx<FS3_SIM_MAX_OPEN_FILES, "Too many open files on FS3 sim [%d]", idx);
-				ftable[idx].filename = strdup(fname);
-
-				// Now perform the open
-				ftable[idx].fhandle = fs3_open(ftable[idx].filename);
-				if (ftable[idx].fhandle == -1) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
-					return(-1);
-				}
-
-			}
-
-			// Now execute the specific command
-			if (strncmp(command, "WRITEAT", 7) == 0) {
-
-				// Log the command executed
-				logMessage(FS3SimulatorLLevel, "FS3_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
-
-				// First perform the seek
-				if (fs3_seek(ftable[idx].fhandle, off)) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-
-				// Now see if we need more data to fill, terminate the lines
-				CMPSC311_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-				CMPSC311_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-				strncpy(text, sep+1, len);
-				text[len] = 0x0;
-				for (i=0; i<strlen(text); i++) {
-					if (text[i] == '^') {
-						text[i] = '\n';
-					}
-				}
-
-				// Now perform the write
-				if (fs3_write(ftable[idx].fhandle, text, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
-					return(-1);
-				}
-
-
-			} else if (strncmp(command, "WRITE", 5) == 0) {
-
-				// Now see if we need more data to fill, terminate the lines
-				CMPSC311_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-				CMPSC311_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-				strncpy(text, sep+1, len);
-				text[len] = 0x0;
-				for (i=0; i<strlen(text); i++) {
-					if (text[i] == '^') {
-						text[i] = '\n';
-					}
-				}
-
-				// Log the command executed
-				logMessage(FS3SimulatorLLevel, "FS3_SIM : Writing %d bytes to file [%s]", len, fname);
-
-				// Now perform the write
-				if (fs3_write(ftable[idx].fhandle, text, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, len);
-					return(-1);
-				}
-
-
-			} else if (strncmp(command, "SEEK", 4) == 0) {
-
-				// Log the command executed
-				logMessage(FS3SimulatorLLevel, "FS3_SIM : Seeking to position %d in file [%s]", off, fname);
-
-				// Now perform the seek
-				if (fs3_seek(ftable[idx].fhandle, off) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-
-			} else if (strncmp(command, "READ", 4) == 0) {
-
-				// Log the command executed
-				logMessage(FS3SimulatorLLevel, "FS3_SIM : Reading %d bytes from file [%s]", len, fname);
-
-				// Now perform the read
-				rbuf = malloc(len);
-				if (fs3_read(ftable[idx].fhandle, rbuf, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-				free(rbuf);
-				rbuf = NULL;
-
-			} else {
-
-				// Bomb out, don't understand the command
-				CMPSC311_ASSERT1(0, "FS3_SIM : Failed, unknown command [%s]", command);
-
-			}
-		}
-
-		// Check for the virtual level failing
-		if ( err ) {
-			logMessage( LOG_ERROR_LEVEL, "CRUS system failed, aborting [%d]", err );
-			fclose( fhandle );
-			return( -1 );
-		}
+	// Run the commands, timing the replay
+	gettimeofday(&start, NULL);
+	if ( mapped ) {
+		replayed = replay_FS3_log(&log, ftable);
+	} else if ( fs3Pipelined ) {
+		replayed = replay_FS3_pipelined(fhandle, ftable);
+	} else {
+		replayed = replay_FS3_text(fhandle, ftable);
 	}
+	if ( replayed == -1 ) {
+		close_workload( fhandle, &log );
+		return( -1 );
+	}
+	gettimeofday(&end, NULL);
+	logMessage(LOG_OUTPUT_LEVEL, "Replay took %.3f seconds (%s).", compareTimes(&start, &end) / 1000000.0,
+		mapped ? "compiled log" : (fs3Pipelined ? "pipelined" : "inline"));
 
-	// Now walk the the table looking for the file
+	// Validate the files, then clean up the table
+	if (validate_FS3_files(ftable) != 0) {
+		close_workload( fhandle, &log );
+		return(-1);
+	}
 	for (i=0; i<FS3_SIM_MAX_OPEN_FILES; i++) {
 		if (ftable[i].filename != NULL) {
-			if (validate_file(ftable[i].filename, ftable[i].fhandle) != 0) {
-				logMessage(LOG_ERROR_LEVEL, "FS3 Validation failed on file [%s].", ftable[i].filename,fname);
-				fclose( fhandle );
-				return(-1);
-			}
-
-			// Clean up the file
-			logMessage(FS3SimulatorLLevel, "Contents of file [%s] validated.", ftable[i].filename);
 			fs3_close(ftable[i].fhandle);
 			free(ftable[i].filename);
 			ftable[i].filename = NULL;
@@ -364,24 +386,433 @@ int simulate_FS3( char *wload ) {
 		logMessage(LOG_ERROR_LEVEL, "FS3 simulation failed, controller metrics failed");
 		return(-1);
 	}
-	if ((fs3_unmount_disk() == -1) || (fs3_close_cache() == -1)) {
+	if ((fs3_unmount_disk() == -1) || (fs3_close_cache() == -1) || (fs3_slab_close() == -1)) {
 		logMessage( LOG_ERROR_LEVEL, "FS3 simulator failed shutdown.");
-		fclose( fhandle );
+		close_workload( fhandle, &log );
+		return( -1 );
+	}
+	if ( fs3ImageController ) {
+		fs3_log_image_metrics();
+	} else {
+		fs3_log_controller_metrics();
+	}
+	fs3_log_sched_metrics();
+	if ( fs3_crc_checking() ) {
+		fs3_crc_log_metrics();
+	}
+	if ( (fs3CacheStats != NULL) && (fs3_cache_stats_dump(fs3CacheStats) == -1) ) {
+		close_workload( fhandle, &log );
 		return( -1 );
 	}
-	fs3_log_controller_metrics();
 	logMessage(FS3SimulatorLLevel, "FS3 simulator shutdown complete.");
 	logMessage(LOG_OUTPUT_LEVEL, "FS3 simulation: all tests successful!!!.");
 
 	// Close the workload file, successfully
-	fclose( fhandle );
+	close_workload( fhandle, &log );
 	return( 0 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parse_FS3_line
+// Description  : Decode a workload line into a command, finding the file
+//                it names in the file table (adding it if new)
+//
+// Inputs       : line - the line, decoded in place
+//                linecount - its line number
+//                ftable - the file table
+//                op - where to store the command
+// Outputs      : 0 if successful, -1 if failure
+
+int parse_FS3_line( char *line, int linecount, FS3SimulationTable *ftable, FS3SimulationOp *op ) {
+
+	// Local variables
+	char fname[FS3_MAX_PATH_LENGTH], *text;
+	int idx, i;
+
+	// Parse out the string
+	if ( fs3_workload_parse(line, fname, &op->command, &op->len, &op->off, &text) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "FS3 un-parsable workload string, aborting [%s], line %d",
+				line, linecount );
+		return( -1 );
+	}
+
+	// Just log the contents
+	logMessage(FS3SimulatorLLevel, "File [%s], command [%d], len=%d, offset=%d",
+			fname, op->command, op->len, op->off);
+
+	// Now walk the the table looking for the file
+	idx = -1;
+	i = 0;
+	while ( (i < FS3_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
+		if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
+			idx = i;
+		}
+		i++;
+	}
+
+	// File is not found, save filename for the executor to open
+	op->open = (idx == -1);
+	if (idx == -1) {
+		idx = 0;
+		while ((idx < FS3_SIM_MAX_OPEN_FILES) && (ftable[idx].filename != NULL)) {
+			idx++;
+		}
+		CMPSC311_ASSERT1(idx<FS3_SIM_MAX_OPEN_FILES, "Too many open files on FS3 sim [%d]", idx);
+		ftable[idx].filename = strdup(fname);
+	}
+	op->slot = idx;
+
+	// Keep the text to write, already decoded
+	if ( (op->command == FS3_WORKLOAD_WRITE) || (op->command == FS3_WORKLOAD_WRITEAT) ) {
+		CMPSC311_ASSERT1(op->len<FS3_SIM_MAX_TEXT, "Simulated workload command text too large [%d]", op->len);
+		memcpy(op->text, text, op->len);
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : execute_FS3_op
+// Description  : Run a decoded command against the driver
+//
+// Inputs       : op - the command
+//                ftable - the file table
+// Outputs      : 0 if successful, -1 if failure
+
+int execute_FS3_op( FS3SimulationOp *op, FS3SimulationTable *ftable ) {
+
+	// Local variables
+	FS3SimulationTable *file = &ftable[op->slot];
+	char *rbuf;
+
+	// Open the file on its first command
+	if ( op->open ) {
+		logMessage(FS3SimulatorLLevel, "FS3_SIM : Opening file [%s]", file->filename);
+		file->fhandle = fs3_open(file->filename);
+		if (file->fhandle == -1) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", file->filename);
+			return(-1);
+		}
+	}
+
+	// Now execute the specific command
+	switch (op->command) {
+	case FS3_WORKLOAD_WRITEAT:
+
+		// Log the command executed
+		logMessage(FS3SimulatorLLevel, "FS3_SIM : Writing %d bytes at position %d from file [%s]", op->len, op->off, file->filename);
+
+		// First perform the seek, then the write
+		if (fs3_seek(file->fhandle, op->off)) {
+			logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", file->filename, op->off);
+			return(-1);
+		}
+		if (fs3_write(file->fhandle, op->text, op->len) != op->len) {
+			logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", file->filename, op->len);
+			return(-1);
+		}
+		break;
+
+	case FS3_WORKLOAD_WRITE:
+
+		// Log the command executed, perform the write
+		logMessage(FS3SimulatorLLevel, "FS3_SIM : Writing %d bytes to file [%s]", op->len, file->filename);
+		if (fs3_write(file->fhandle, op->text, op->len) != op->len) {
+			logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", file->filename, op->len);
+			return(-1);
+		}
+		break;
+
+	case FS3_WORKLOAD_SEEK:
+
+		// Log the command executed, perform the seek
+		logMessage(FS3SimulatorLLevel, "FS3_SIM : Seeking to position %d in file [%s]", op->off, file->filename);
+		if (fs3_seek(file->fhandle, op->off) != op->len) {
+			logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", file->filename, op->off);
+			return(-1);
+		}
+		break;
+
+	default:
+
+		// Log the command executed, perform the read
+		logMessage(FS3SimulatorLLevel, "FS3_SIM : Reading %d bytes from file [%s]", op->len, file->filename);
+		rbuf = malloc(op->len);
+		if (fs3_read(file->fhandle, rbuf, op->len) != op->len) {
+			logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", file->filename, op->len);
+			free(rbuf);
+			return(-1);
+		}
+		free(rbuf);
+		break;
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_FS3_text
+// Description  : Run the commands of a text workload, each line decoded
+//                and then run before the next is read
+//
+// Inputs       : fhandle - the workload file
+//                ftable - the file table
+// Outputs      : 0 if successful, -1 if failure
+
+int replay_FS3_text( FILE *fhandle, FS3SimulationTable *ftable ) {
+
+	// Local variables
+	char line[FS3_SIM_MAX_LINE];
+	FS3SimulationOp op;
+	int linecount = 0;
+
+	// While file not done
+	while (fgets(line, FS3_SIM_MAX_LINE, fhandle) != NULL) {
+		linecount ++;
+		if ( (parse_FS3_line(line, linecount, ftable, &op) == -1) || (execute_FS3_op(&op, ftable) == -1) ) {
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parse_FS3_thread
+// Description  : Parser stage of a pipelined replay, decodes lines into the
+//                ring until the workload ends or the executor fails
+//
+// Inputs       : arg - the FS3SimulationPipe
+// Outputs      : NULL
+
+void *parse_FS3_thread( void *arg ) {
+
+	// Local variables
+	FS3SimulationPipe *pipe = (FS3SimulationPipe *)arg;
+	char line[FS3_SIM_MAX_LINE];
+	uint64_t head = 0;
+	int linecount = 0, state = 1;
+
+	while (fgets(line, FS3_SIM_MAX_LINE, pipe->fhandle) != NULL) {
+
+		// Wait for a free slot, the executor frees them in order
+		while ( head - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) == FS3_SIM_RING_SIZE ) {
+			if ( __atomic_load_n(&pipe->failed, __ATOMIC_ACQUIRE) ) {
+				return( NULL );
+			}
+			sched_yield();
+		}
+		linecount ++;
+		if ( parse_FS3_line(line, linecount, pipe->ftable, &pipe->ring[head & (FS3_SIM_RING_SIZE - 1)]) == -1 ) {
+			state = -1;
+			break;
+		}
+		__atomic_store_n(&pipe->head, ++head, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&pipe->parsed, state, __ATOMIC_RELEASE);
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_FS3_pipelined
+// Description  : Run the commands of a text workload with a parser thread
+//                decoding lines ahead of this one, which runs them
+//
+// Inputs       : fhandle - the workload file
+//                ftable - the file table
+// Outputs      : 0 if successful, -1 if failure
+
+int replay_FS3_pipelined( FILE *fhandle, FS3SimulationTable *ftable ) {
+
+	// Local variables
+	FS3SimulationPipe *pipe;
+	pthread_t parser;
+	uint64_t tail = 0;
+	int parsed = 0, result = 0;
+
+	if ( (pipe = aligned_alloc(64, sizeof(FS3SimulationPipe))) == NULL ) {
+		return( -1 );
+	}
+	memset(pipe, 0x0, sizeof(FS3SimulationPipe));
+	pipe->fhandle = fhandle;
+	pipe->ftable = ftable;
+	if ( pthread_create(&parser, NULL, parse_FS3_thread, pipe) != 0 ) {
+		logMessage(LOG_ERROR_LEVEL, "Failed starting the workload parser thread.");
+		free( pipe );
+		return( -1 );
+	}
+
+	// Run each command as it is published, until the parser is done
+	while ( result == 0 ) {
+		if ( tail == __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) ) {
+			parsed = __atomic_load_n(&pipe->parsed, __ATOMIC_ACQUIRE);
+			if ( (parsed != 0) && (tail == __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE)) ) {
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+		if ( execute_FS3_op(&pipe->ring[tail & (FS3_SIM_RING_SIZE - 1)], ftable) == -1 ) {
+			__atomic_store_n(&pipe->failed, 1, __ATOMIC_RELEASE);
+			result = -1;
+		}
+		__atomic_store_n(&pipe->tail, ++tail, __ATOMIC_RELEASE);
+	}
+	pthread_join( parser, NULL );
+	free( pipe );
+	return( ((result == -1) || (parsed == -1)) ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_FS3_log
+// Description  : Run the commands of a compiled workload log straight from
+//                its mapping; file i of the log is slot i of the table
+//
+// Inputs       : log - the mapped log
+//                ftable - the file table
+// Outputs      : 0 if successful, -1 if failure
+
+int replay_FS3_log( FS3Workload *log, FS3SimulationTable *ftable ) {
+
+	// Local variables
+	const FS3WorkloadOp *op, *end = log->ops + log->header->ops;
+	FS3SimulationTable *file;
+	char *rbuf, *text;
+	int32_t done;
+
+	if ( (rbuf = malloc(log->header->maxRead + 1)) == NULL ) {
+		return( -1 );
+	}
+	for (op = log->ops; op < end; op++) {
+
+		// Open the file the first time it is used
+		file = &ftable[op->file];
+		if ( (file->filename == NULL) &&
+				(((file->filename = strdup(log->names[op->file])) == NULL) ||
+				((file->fhandle = fs3_open(file->filename)) == -1)) ) {
+			logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", log->names[op->file]);
+			free( rbuf );
+			return( -1 );
+		}
+
+		// The text is already decoded in the payload
+		text = (char *)&log->payload[op->payload];
+		switch (op->command) {
+		case FS3_WORKLOAD_WRITEAT:
+			done = (fs3_seek(file->fhandle, op->offset) == 0) ? fs3_write(file->fhandle, text, op->length) : -1;
+			break;
+		case FS3_WORKLOAD_WRITE:
+			done = fs3_write(file->fhandle, text, op->length);
+			break;
+		case FS3_WORKLOAD_SEEK:
+			done = (fs3_seek(file->fhandle, op->offset) == 0) ? (int32_t)op->length : -1;
+			break;
+		default:
+			done = fs3_read(file->fhandle, rbuf, op->length);
+			break;
+		}
+		if ( done != (int32_t)op->length ) {
+			logMessage(LOG_ERROR_LEVEL, "Command %d on file [%s], length %u offset %u failed, aborting simulation.",
+				op->command, file->filename, op->length, op->offset);
+			free( rbuf );
+			return( -1 );
+		}
+	}
+	free( rbuf );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_workload
+// Description  : Close a text workload or unmap a compiled one
+//
+// Inputs       : fhandle - the text workload, NULL if it was compiled
+//                log - the compiled workload
+// Outputs      : none
+
+void close_workload( FILE *fhandle, FS3Workload *log ) {
+	if ( fhandle != NULL ) {
+		fclose( fhandle );
+	} else {
+		fs3_workload_unmap( log );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_FS3_files
+// Description  : Validate every file in the table on a pool of threads
+//
+// Inputs       : ftable - the file table
+// Outputs      : 0 if all files are valid, -1 if any is not
+
+int validate_FS3_files( FS3SimulationTable *ftable ) {
+
+	// Local variables
+	FS3SimulationCheck check;
+	pthread_t workers[FS3_SIM_MAX_VALIDATORS];
+	int i, started;
+
+	// Each worker takes the next file in the table until none remain
+	check.ftable = ftable;
+	check.next = 0;
+	check.failed = 0;
+	for (started=0; started<fs3Validators; started++) {
+		if (pthread_create(&workers[started], NULL, validate_FS3_thread, &check) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		validate_FS3_thread( &check );
+	}
+	for (i=0; i<started; i++) {
+		pthread_join( workers[i], NULL );
+	}
+
+	if (check.failed > 0) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 Validation failed on %d files.", check.failed);
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_FS3_thread
+// Description  : A validation worker, checks files until the table is done
+//
+// Inputs       : arg - the FS3SimulationCheck
+// Outputs      : NULL
+
+void *validate_FS3_thread( void *arg ) {
+
+	// Local variables
+	FS3SimulationCheck *check = (FS3SimulationCheck *)arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&check->next, 1, __ATOMIC_RELAXED)) < FS3_SIM_MAX_OPEN_FILES) {
+		if (check->ftable[i].filename == NULL) {
+			continue;
+		}
+		if (validate_file(check->ftable[i].filename, check->ftable[i].fhandle) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "FS3 Validation failed on file [%s].", check->ftable[i].filename);
+			__atomic_fetch_add(&check->failed, 1, __ATOMIC_RELAXED);
+		} else {
+			logMessage(FS3SimulatorLLevel, "Contents of file [%s] validated.", check->ftable[i].filename);
+		}
+	}
+	return( NULL );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : validate_file
-// Description  : Vadliate a file in the filesystem
+// Description  : Vadliate a file in the filesystem, a sector at a time
 //
 // Inputs       : fname - the name of the file to validate
 //                mfh - the disk file handle
@@ -390,71 +821,194 @@ int simulate_FS3( char *wload ) {
 int validate_file(char *fname, int16_t mfh) {
 
 	// Local variables
-	char filename[256], bkfile[256], *filbuf, *membuf;
+	char filename[256], filbuf[FS3_SECTOR_SIZE], membuf[FS3_SECTOR_SIZE];
 	struct stat stats;
-	int idx, fh;
+	uint64_t refDigest, memDigest;
+	int32_t pos, len;
+	size_t idx;
+	int fh, result = 0;
 
-	// First figure out how big the file is, setup buffer
+	// First figure out how big the file is
 	snprintf(filename, 256, "%s/%s", FS3_WORKLOAD_DIR, fname);
 	if ((stat(filename, &stats) != 0) || (stats.st_size == 0)) {
 		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], missing or "
 			"unknown source.", filename);
 		return(-1);		
 	}
-	if ( ((filbuf = malloc(stats.st_size)) == NULL) || ((membuf = malloc(stats.st_size)) == NULL) ) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], failed "
-			"buffer allocation.", filename);
-		return(-1);		
-	}
 
-	// Now open the file and read the contents
+	// Now open the file
 	if ((fh=open(filename, O_RDONLY)) == -1) {
 		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], open failed ", filename);
 		return(-1);		
 	}
-	if ((read(fh, filbuf, stats.st_size)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], read failed ", filename);
-		return(-1);
+
+	// The driver keeps a digest of the disk file, if asked to trust it a match needs no read back
+	if ( fs3DigestOnly && (digest_file(fh, stats.st_size, &refDigest) == 0) &&
+			(fs3_file_digest(mfh, &memDigest) == 0) && (refDigest == memDigest) ) {
+		close(fh);
+		if (fs3DumpFiles) {
+			dump_file( fname, mfh, stats.st_size );
+		}
+		logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful (digest %016llx).", fname,
+			stats.st_size, (unsigned long long)memDigest);
+		return( 0 );
 	}
-	close(fh);
 
-	// Seek to the beginning of the disk file, read the contents
-	if (fs3_seek(mfh, 0) == -1) {
+	// Otherwise compare them, seek to the beginning of both files
+	if ((lseek(fh, 0, SEEK_SET) == -1) || (fs3_seek(mfh, 0) == -1)) {
 		// Failed, error out
 		logMessage(LOG_ERROR_LEVEL, "Read fs3 file [%s] see to zero failed.", fname);
+		close(fh);
 		return(-1);
 	}
-	if (fs3_read(mfh, membuf, stats.st_size) != stats.st_size) {
-		// Failed, error out
-		logMessage(LOG_ERROR_LEVEL, "Read fs3 file [%s] of length %d failed.", fname, stats.st_size);
+
+	// Walk both files a sector at a time, stopping at the first difference
+	for (pos=0; (result == 0) && (pos<stats.st_size); pos+=len) {
+		len = (stats.st_size - pos < FS3_SECTOR_SIZE) ? stats.st_size - pos : FS3_SECTOR_SIZE;
+		if (read(fh, filbuf, len) != len) {
+			logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], read failed ", filename);
+			result = -1;
+		} else if (fs3_read(mfh, membuf, len) != len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Read fs3 file [%s] of length %d failed.", fname, stats.st_size);
+			result = -1;
+		} else if ((idx = fs3_sim_mismatch(membuf, filbuf, len)) < (size_t)len) {
+			logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed at offset %d (mem %x/'%c' "
+				"!= fil %x/'%c')", fname, pos+idx, membuf[idx], membuf[idx], filbuf[idx], filbuf[idx]);
+			result = -1;
+		}
+	}
+	close(fh);
+
+	// Dump the disk file so people can debug
+	if ((result == -1) || fs3DumpFiles) {
+		dump_file( fname, mfh, stats.st_size );
+	}
+
+	// Log success, and return
+	if (result == 0) {
+		logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
+	}
+	return( result );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : digest_file
+// Description  : Compute the digest a reference file would have in FS3
+//
+// Inputs       : fh - the open reference file, read from its start
+//                size - its length
+//                digest - where to put the digest
+// Outputs      : 0 if successful, -1 if failure
+
+int digest_file(int fh, int32_t size, uint64_t *digest) {
+
+	// Local variables
+	char filbuf[FS3_SECTOR_SIZE];
+	FS3DigestTree tree = { NULL, 0 };
+	int32_t pos, len;
+
+	if ( (lseek(fh, 0, SEEK_SET) == -1) ||
+			(fs3_digest_resize(&tree, (size + FS3_SECTOR_SIZE - 1) / FS3_SECTOR_SIZE) == -1) ) {
 		return(-1);
 	}
+	for (pos=0; pos<size; pos+=len) {
+		len = (size - pos < FS3_SECTOR_SIZE) ? size - pos : FS3_SECTOR_SIZE;
+		if (read(fh, filbuf, len) != len) {
+			fs3_digest_free( &tree );
+			return(-1);
+		}
+		fs3_digest_set(&tree, pos / FS3_SECTOR_SIZE, fs3_digest_sector(filbuf, len));
+	}
+	fs3_digest_rehash(&tree, 0, tree.leaves - 1);
+	*digest = fs3_digest_final(&tree, size);
+	fs3_digest_free( &tree );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sim_mismatch
+// Description  : Find the first byte at which two buffers differ
+//
+// Inputs       : a, b - the buffers
+//                len - their length
+// Outputs      : offset of the first difference, len if they are equal
+
+size_t fs3_sim_mismatch( const char *a, const char *b, size_t len ) {
+
+	// Local variables
+	size_t idx = 0;
+#ifdef __SSE2__
+	unsigned mask;
+
+	// Compare 16 bytes at a time, the mask has a zero bit where they differ
+	for (; idx+16<=len; idx+=16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a+idx)),
+			_mm_loadu_si128((const __m128i *)(b+idx))));
+		if (mask != 0xffff) {
+			return( idx + __builtin_ctz(~mask) );
+		}
+	}
+#else
+	uint64_t wa, wb;
+
+	// Compare a word at a time, then find the byte within it
+	for (; idx+8<=len; idx+=8) {
+		memcpy(&wa, a+idx, 8);
+		memcpy(&wb, b+idx, 8);
+		if (wa != wb) {
+			break;
+		}
+	}
+#endif
+	while ((idx < len) && (a[idx] == b[idx])) {
+		idx++;
+	}
+	return( idx );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_file
+// Description  : Write a copy of a disk file next to its reference file
+//
+// Inputs       : fname - the name of the file
+//                mfh - the disk file handle
+//                size - the bytes to copy
+// Outputs      : 0 if successful, -1 if failure
+
+int dump_file(char *fname, int16_t mfh, int32_t size) {
+
+	// Local variables
+	char bkfile[256], membuf[FS3_SECTOR_SIZE];
+	int32_t pos, len;
+	int fh;
 
-	// Now create a backup of the disk file so people can debug
 	snprintf(bkfile, 256, "%s/%s.cmm", FS3_WORKLOAD_DIR, fname);
 	if ((fh=open(bkfile, O_RDWR|O_CREAT|O_TRUNC, S_IRWXU)) == -1) {
 		logMessage(LOG_ERROR_LEVEL, "Failure creating backup file [%s], open failed (%s) ", 
 			bkfile, strerror(errno));
 		return(-1);		
 	}
-	if ((write(fh, membuf, stats.st_size)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure writing backup file [%s].", bkfile);
+	if (fs3_seek(mfh, 0) == -1) {
+		close(fh);
 		return(-1);
 	}
-	close(fh);
 
-	// Now walk the buffers and compare byte for byte
-	for (idx=0; idx<stats.st_size; idx++) {
-		if (membuf[idx] != filbuf[idx]) {
-			logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed at offset %d (mem %x/'%c' "
-				"!= fil %x/'%c')", fname, idx, membuf[idx], membuf[idx], filbuf[idx], filbuf[idx]);
+	// Copy a sector at a time, stopping where the disk file ends
+	for (pos=0; pos<size; pos+=len) {
+		len = (size - pos < FS3_SECTOR_SIZE) ? size - pos : FS3_SECTOR_SIZE;
+		if ((len = fs3_read(mfh, membuf, len)) <= 0) {
+			break;
+		}
+		if (write(fh, membuf, len) != len) {
+			logMessage(LOG_ERROR_LEVEL, "Failure writing backup file [%s].", bkfile);
+			close(fh);
 			return(-1);
 		}
 	}
-
-	// Free the buffers, log success, and return successfully
-	free(filbuf);
-	free(membuf);
-	logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
+	close(fh);
 	return( 0 );
 }
@@ -0,0 +1,357 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_slab.c
+//  Description    : This is the implementation of the sector buffer
+//                   allocator for the FS3 filesystem.  Slabs are mapped
+//                   whole and split into FS3_SECTOR_SIZE buffers that are
+//                   never returned to the system until fs3_slab_close.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_slab.h>
+#include <fs3_controller.h>
+
+//
+// Support Macros/Data
+
+// Free buffers are chained through their first word
+#define NEXT_FREE(buf) (*(void **)(buf))
+
+// One mapped region of buffers
+struct slabChunk {
+    void *base;
+    size_t bytes;
+    uint8_t huge;                   // mapped with MAP_HUGETLB
+};
+
+// Buffers a thread recycles without taking the lock
+struct slabLocal {
+    void *head;
+    int count;
+    uint32_t generation;            // slabGeneration the buffers belong to
+};
+
+pthread_mutex_t slabLock = PTHREAD_MUTEX_INITIALIZER;
+int slabHuge = 0;                   // back new slabs with huge pages
+struct slabChunk *slabChunks;       // every slab mapped
+int slabChunkMax;                   // room in slabChunks
+void *slabFree;                     // shared free list
+uint32_t slabGeneration = 1;        // bumped by close, stales thread lists
+FS3SlabStats slabStats;
+static __thread struct slabLocal slabMine;
+pthread_once_t slabKeyOnce = PTHREAD_ONCE_INIT;
+pthread_key_t slabKey;              // runs fs3_slab_thread_exit for threads with a list
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_slab_grow
+// Description  : Map one more slab and put its buffers on the shared free
+//                list, called with slabLock held
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fs3_slab_grow(void) {
+    size_t bytes = slabHuge ? FS3_SLAB_HUGE_SIZE : (FS3_SLAB_SECTORS * FS3_SECTOR_SIZE);
+    uint32_t buffers = bytes / FS3_SECTOR_SIZE;
+    uint8_t huge = 0;
+    void *base = MAP_FAILED;
+    char *buf;
+
+    if (slabStats.slabs == (uint32_t)slabChunkMax) {
+        int max = (slabChunkMax == 0) ? 16 : slabChunkMax * 2;
+        struct slabChunk *chunks = (struct slabChunk *)realloc(slabChunks, max * sizeof(struct slabChunk));
+        if (chunks == NULL) {
+            return(-1);
+        }
+        slabChunks = chunks;
+        slabChunkMax = max;
+    }
+
+    // Huge pages if asked and available, transparent ones as a fallback
+#ifdef MAP_HUGETLB
+    if (slabHuge) {
+        base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = (base != MAP_FAILED);
+    }
+#endif
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            logMessage(LOG_ERROR_LEVEL, "Failed mapping sector slab of %lu bytes", (unsigned long)bytes);
+            return(-1);
+        }
+#ifdef MADV_HUGEPAGE
+        if (slabHuge) {
+            madvise(base, bytes, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    slabChunks[slabStats.slabs].base = base;
+    slabChunks[slabStats.slabs].bytes = bytes;
+    slabChunks[slabStats.slabs].huge = huge;
+    slabStats.slabs++;
+    slabStats.hugeSlabs += huge;
+    slabStats.capacity += buffers;
+
+    // Chain from the top down so buffers are handed out in address order
+    for (buf = (char *)base + (buffers - 1) * FS3_SECTOR_SIZE; buf >= (char *)base; buf -= FS3_SECTOR_SIZE) {
+        NEXT_FREE(buf) = slabFree;
+        slabFree = buf;
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_slab_thread_exit
+// Description  : Give an exiting thread's free list back to the shared one,
+//                unless its buffers belong to slabs since closed
+//
+// Inputs       : arg - the thread's free list
+// Outputs      : none
+
+static void fs3_slab_thread_exit(void *arg) {
+    struct slabLocal *mine = (struct slabLocal *)arg;
+    void *tail = mine->head;
+
+    pthread_mutex_lock(&slabLock);
+    if ((tail != NULL) && (mine->generation == slabGeneration)) {
+        while (NEXT_FREE(tail) != NULL) {
+            tail = NEXT_FREE(tail);
+        }
+        NEXT_FREE(tail) = slabFree;
+        slabFree = mine->head;
+    }
+    pthread_mutex_unlock(&slabLock);
+    mine->head = NULL;
+    mine->count = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_slab_key_create
+// Description  : Create the key whose destructor returns thread free lists
+//
+// Inputs       : none
+// Outputs      : none
+
+static void fs3_slab_key_create(void) {
+    pthread_key_create(&slabKey, fs3_slab_thread_exit);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_slab_local
+// Description  : Get the calling thread's free list, emptied if it holds
+//                buffers from slabs since closed; the first call on a
+//                thread arranges for the list to be given back at exit
+//
+// Inputs       : none
+// Outputs      : the thread's free list
+
+static struct slabLocal *fs3_slab_local(void) {
+    uint32_t generation = __atomic_load_n(&slabGeneration, __ATOMIC_ACQUIRE);
+
+    if (slabMine.generation != generation) {
+        if (slabMine.generation == 0) {
+            pthread_once(&slabKeyOnce, fs3_slab_key_create);
+            pthread_setspecific(slabKey, &slabMine);
+        }
+        slabMine.head = NULL;
+        slabMine.count = 0;
+        slabMine.generation = generation;
+    }
+    return(&slabMine);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_slab_init
+// Description  : Map enough slabs for a number of buffers up front, more
+//                are mapped as they are needed
+//
+// Inputs       : reserve - buffers to map now
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_slab_init(uint32_t reserve) {
+    int result = 0;
+
+    pthread_mutex_lock(&slabLock);
+    while ((slabStats.capacity < reserve) && (result == 0)) {
+        result = fs3_slab_grow();
+    }
+    pthread_mutex_unlock(&slabLock);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_slab_close
+// Description  : Unmap every slab, buffers still handed out are lost
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_slab_close(void) {
+    pthread_mutex_lock(&slabLock);
+    if (slabStats.inUse > 0) {
+        logMessage(LOG_ERROR_LEVEL, "Closing sector slabs with %u buffers in use", slabStats.inUse);
+    }
+    for (uint32_t i = 0; i < slabStats.slabs; i++) {
+        munmap(slabChunks[i].base, slabChunks[i].bytes);
+    }
+    free(slabChunks);
+    slabChunks = NULL;
+    slabChunkMax = 0;
+    slabFree = NULL;
+    memset(&slabStats, 0x0, sizeof(slabStats));
+    __atomic_add_fetch(&slabGeneration, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&slabLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_slab_hugepages
+// Description  : Select whether slabs mapped from now on use huge pages
+//
+// Inputs       : enable - non-zero to use huge pages
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_slab_hugepages(int enable) {
+    pthread_mutex_lock(&slabLock);
+    slabHuge = (enable != 0);
+    pthread_mutex_unlock(&slabLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_slab_alloc
+// Description  : Get a sector buffer, from this thread's free list if it
+//                has one and otherwise a batch from the shared list
+//
+// Inputs       : none
+// Outputs      : pointer to a FS3_SECTOR_SIZE buffer, NULL if failure
+
+void * fs3_slab_alloc(void) {
+    struct slabLocal *mine = fs3_slab_local();
+    uint32_t used, peak;
+    void *buf;
+
+    // Refill half the local list so the lock is taken once per batch
+    if (mine->head == NULL) {
+        pthread_mutex_lock(&slabLock);
+        while (mine->count < FS3_SLAB_LOCAL_MAX / 2) {
+            if ((slabFree == NULL) && (fs3_slab_grow() == -1)) {
+                break;
+            }
+            buf = slabFree;
+            slabFree = NEXT_FREE(buf);
+            NEXT_FREE(buf) = mine->head;
+            mine->head = buf;
+            mine->count++;
+        }
+        pthread_mutex_unlock(&slabLock);
+        if (mine->head == NULL) {
+            return(NULL);
+        }
+    }
+    buf = mine->head;
+    mine->head = NEXT_FREE(buf);
+    mine->count--;
+
+    // Occupancy
+    __atomic_add_fetch(&slabStats.allocs, 1, __ATOMIC_RELAXED);
+    used = __atomic_add_fetch(&slabStats.inUse, 1, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&slabStats.peak, __ATOMIC_RELAXED);
+    while ((used > peak) && !__atomic_compare_exchange_n(&slabStats.peak, &peak, used, 1,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return(buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_slab_free
+// Description  : Give a sector buffer back, spilling half of this thread's
+//                free list to the shared one when it is full
+//
+// Inputs       : buf - a buffer from fs3_slab_alloc, or NULL
+// Outputs      : none
+
+void fs3_slab_free(void *buf) {
+    struct slabLocal *mine;
+
+    if (buf == NULL) {
+        return;
+    }
+    mine = fs3_slab_local();
+    NEXT_FREE(buf) = mine->head;
+    mine->head = buf;
+    mine->count++;
+    __atomic_add_fetch(&slabStats.frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&slabStats.inUse, 1, __ATOMIC_RELAXED);
+
+    if (mine->count >= FS3_SLAB_LOCAL_MAX) {
+        pthread_mutex_lock(&slabLock);
+        while (mine->count > FS3_SLAB_LOCAL_MAX / 2) {
+            buf = mine->head;
+            mine->head = NEXT_FREE(buf);
+            mine->count--;
+            NEXT_FREE(buf) = slabFree;
+            slabFree = buf;
+        }
+        pthread_mutex_unlock(&slabLock);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_slab_stats
+// Description  : Get the current occupancy of the allocator
+//
+// Inputs       : stats - where to store the occupancy
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_slab_stats(FS3SlabStats *stats) {
+    if (stats == NULL) {
+        return(-1);
+    }
+    pthread_mutex_lock(&slabLock);
+    stats->slabs = slabStats.slabs;
+    stats->hugeSlabs = slabStats.hugeSlabs;
+    stats->capacity = slabStats.capacity;
+    pthread_mutex_unlock(&slabLock);
+    stats->inUse = __atomic_load_n(&slabStats.inUse, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&slabStats.peak, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&slabStats.allocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&slabStats.frees, __ATOMIC_RELAXED);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_log_slab_metrics
+// Description  : Log the occupancy of the allocator
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_log_slab_metrics(void) {
+    FS3SlabStats stats;
+
+    fs3_slab_stats(&stats);
+    logMessage(FS3DriverLLevel, "\nSector slabs: %u (%u huge)\nSector buffers: %u of %u in use (peak %u)\nSlab memory: %lu KB",
+        stats.slabs, stats.hugeSlabs, stats.inUse, stats.capacity, stats.peak,
+        (unsigned long)stats.capacity * FS3_SECTOR_SIZE / 1024);
+    return(0);
+}
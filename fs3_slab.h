@@ -0,0 +1,61 @@
+#ifndef FS3_SLAB_INCLUDED
+#define FS3_SLAB_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_slab.h
+//  Description    : This is the interface for the fixed-size allocator that
+//                   hands out FS3_SECTOR_SIZE buffers for the FS3 cache and
+//                   driver.  Buffers are carved out of large mapped slabs,
+//                   are cache-line aligned and are recycled through a
+//                   per-thread free list before falling back to a shared one.
+//
+
+// Include
+#include <stdint.h>
+#include <fs3_controller.h>
+
+// Defines
+#define FS3_SLAB_ALIGN      64      // Buffer alignment (a cache line)
+#define FS3_SLAB_SECTORS    64      // Buffers per slab, normal pages
+#define FS3_SLAB_HUGE_SIZE  (2 * 1024 * 1024)   // Size of a huge page slab
+#define FS3_SLAB_LOCAL_MAX  32      // Buffers a thread keeps to itself
+
+// Occupancy of the allocator
+typedef struct {
+
+    uint32_t slabs;         // Slabs mapped
+    uint32_t hugeSlabs;     // Of those, backed by huge pages
+    uint32_t capacity;      // Buffers the slabs hold
+    uint32_t inUse;         // Buffers handed out and not yet freed
+    uint32_t peak;          // Most buffers ever in use at once
+    uint64_t allocs;        // Buffers handed out
+    uint64_t frees;         // Buffers given back
+
+} FS3SlabStats;
+
+//
+// Slab Functions
+
+int fs3_slab_init(uint32_t reserve);
+    // Map slabs for at least reserve buffers, more are mapped on demand
+
+int fs3_slab_close(void);
+    // Unmap all slabs, every buffer handed out becomes invalid
+
+int fs3_set_slab_hugepages(int enable);
+    // Back new slabs with huge pages where the system has them
+
+void * fs3_slab_alloc(void);
+    // Get a sector buffer (NULL if out of memory)
+
+void fs3_slab_free(void *buf);
+    // Give a sector buffer back (NULL is ignored)
+
+int fs3_slab_stats(FS3SlabStats *stats);
+    // Get the current occupancy of the allocator
+
+int fs3_log_slab_metrics(void);
+    // Log the occupancy of the allocator
+
+#endif
@@ -0,0 +1,642 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_wlgen.c
+//  Description    : This is the workload generator for the FS3 simulator.
+//                   It writes a workload in the format fs3_sim and fs3_bench
+//                   replay, together with the reference copy of every file
+//                   that fs3_sim validates the disk against.
+//
+//                   Files are first filled to a size drawn from a range
+//                   (one write per file in turn, so their sectors are
+//                   interleaved on disk), then a mix of reads, writes and
+//                   seeks is made over them.  Which file, and where in it,
+//                   each operation touches follows an access pattern:
+//                   sequential, uniform, Zipfian or a shifting hot set.
+//                   The same seed always gives the same workload.
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Project Include Files
+#include <fs3_controller.h>
+#include <fs3_driver.h>
+
+// Defines
+#define FS3_WLGEN_ARGUMENTS "ho:d:P:f:z:n:m:a:s:t:H:k:r:"
+#define FS3_WLGEN_MAX_WRITE 1023        // fs3_sim takes less than 1024 bytes a line
+#define FS3_WLGEN_REFERENCE_DIR "workload"     // Where fs3_sim looks for reference files
+#define FS3_WLGEN_BLOCK FS3_SECTOR_SIZE // Unit the access pattern picks within a file
+#define FS3_WLGEN_DISK_BYTES ((uint64_t)(FS3_MAX_TRACKS - 1) * FS3_TRACK_SIZE * FS3_SECTOR_SIZE)
+#define USAGE \
+    "USAGE: fs3_wlgen [-h] [-o <workload>] [-d <dir>] [-P <prefix>] [-f <files>] [-z <min>-<max>]\n" \
+    "                 [-n <ops>] [-m <r>,<w>,<wa>,<s>] [-a <pattern>] [-s <sizes>] [-t <theta>]\n" \
+    "                 [-H <fraction>,<probability>] [-k <ops>] [-r <seed>]\n" \
+    "\n" \
+    "where:\n" \
+    "    -h - help mode (display this message)\n" \
+    "    -o - workload file to write (default generated-workload.txt)\n" \
+    "    -d - directory for the reference files (default workload, as fs3_sim)\n" \
+    "    -P - path prefix of the generated file names (default gen)\n" \
+    "    -f - number of files, up to FS3_MAX_TOTAL_FILES (default 32)\n" \
+    "    -z - range of initial file sizes in bytes, drawn log-uniformly\n" \
+    "         (default 1024-1048576)\n" \
+    "    -n - operations after the files are filled (default 100000)\n" \
+    "    -m - percent of READ, WRITE, WRITEAT and SEEK operations (default 40,20,30,10)\n" \
+    "    -a - access pattern: seq, uniform, zipf or hotset (default uniform)\n" \
+    "    -s - read/write sizes: fixed:<n>, uniform:<min>-<max> or exp:<mean>\n" \
+    "         (default uniform:1-1023, writes are capped at 1023)\n" \
+    "    -t - Zipfian skew theta, 0 < theta < 1 (default 0.99)\n" \
+    "    -H - hot set fraction of files/blocks and probability of hitting it\n" \
+    "         (default 0.1,0.9)\n" \
+    "    -k - operations between hot set shifts (default 10000)\n" \
+    "    -r - random seed (default 1)\n" \
+    "\n" \
+
+// Access patterns
+typedef enum {
+
+    WLGEN_SEQUENTIAL = 0,   // Each file front to back, then the next
+    WLGEN_UNIFORM    = 1,   // Any file and block equally likely
+    WLGEN_ZIPF       = 2,   // Low-numbered files and blocks much more likely
+    WLGEN_HOTSET     = 3    // A window of files and blocks that moves
+
+} FS3WlgenPattern;
+
+// Size distributions
+typedef enum {
+
+    WLGEN_FIXED       = 0,
+    WLGEN_SIZEUNIFORM = 1,
+    WLGEN_EXPONENTIAL = 2
+
+} FS3WlgenSizes;
+
+// Operations of the mix, in -m order
+typedef enum {
+
+    WLGEN_READ    = 0,
+    WLGEN_WRITE   = 1,
+    WLGEN_WRITEAT = 2,
+    WLGEN_SEEK    = 3,
+    WLGEN_OPS     = 4
+
+} FS3WlgenOp;
+
+// Zipfian distribution over n items (Gray et al., "Quickly generating
+// billion-record synthetic databases")
+typedef struct {
+
+    uint32_t n;
+    double zetan;
+    double eta;
+    double alpha;
+    double half;            // 1 + 0.5^theta
+
+} FS3WlgenZipf;
+
+// One generated file
+typedef struct {
+
+    char *path;             // Name in the workload
+    char *data;             // Reference contents
+    uint32_t length;
+    uint32_t size;          // Room in data
+    uint32_t target;        // Size to fill to
+    uint32_t position;      // Where the simulator's handle is
+    uint32_t blocks;        // Blocks the pattern picks from
+    FS3WlgenZipf zipf;      // Over blocks, for WLGEN_ZIPF
+
+} FS3WlgenFile;
+
+//
+// Global Data
+
+const char *wlgenPatternNames[] = { "seq", "uniform", "zipf", "hotset" };
+uint64_t wlgenState = 1;                // Generator state (xorshift64*)
+FS3WlgenPattern wlgenPattern = WLGEN_UNIFORM;
+FS3WlgenSizes wlgenSizes = WLGEN_SIZEUNIFORM;
+uint32_t wlgenSizeA = 1, wlgenSizeB = FS3_WLGEN_MAX_WRITE;     // Size distribution parameters
+double wlgenTheta = 0.99;
+double wlgenHotFraction = 0.1, wlgenHotProbability = 0.9;
+uint64_t wlgenShiftEvery = 10000;
+FS3WlgenFile *wlgenFiles;
+int wlgenFileCount = 32;
+FS3WlgenZipf wlgenFileZipf;             // Over files, for WLGEN_ZIPF
+int wlgenCursor = 0;                    // File WLGEN_SEQUENTIAL is in
+FILE *wlgenOut;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_random
+// Description  : Get the next pseudo-random number (xorshift64*)
+//
+// Inputs       : none
+// Outputs      : the number
+
+static uint64_t wlgen_random(void) {
+    wlgenState ^= wlgenState >> 12;
+    wlgenState ^= wlgenState << 25;
+    wlgenState ^= wlgenState >> 27;
+    return(wlgenState * 0x2545f4914f6cdd1dULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_uniform
+// Description  : Get a pseudo-random number in [0, 1)
+//
+// Inputs       : none
+// Outputs      : the number
+
+static double wlgen_uniform(void) {
+    return((wlgen_random() >> 11) * (1.0 / 9007199254740992.0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_below
+// Description  : Get a pseudo-random integer in [0, n)
+//
+// Inputs       : n - the bound, at least 1
+// Outputs      : the number
+
+static uint32_t wlgen_below(uint32_t n) {
+    return((uint32_t)(wlgen_uniform() * n));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_zipf_init
+// Description  : Set up a Zipfian distribution
+//
+// Inputs       : zipf - the distribution
+//                n - number of items
+// Outputs      : none
+
+static void wlgen_zipf_init(FS3WlgenZipf *zipf, uint32_t n) {
+    double zeta2 = 1.0 + pow(0.5, wlgenTheta);
+
+    zipf->n = n;
+    zipf->zetan = 0.0;
+    for (uint32_t i = 1; i <= n; i++) {
+        zipf->zetan += 1.0 / pow((double)i, wlgenTheta);
+    }
+    zipf->alpha = 1.0 / (1.0 - wlgenTheta);
+    zipf->eta = (n > 1) ? (1.0 - pow(2.0 / n, 1.0 - wlgenTheta)) / (1.0 - zeta2 / zipf->zetan) : 0.0;
+    zipf->half = zeta2;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_zipf
+// Description  : Draw from a Zipfian distribution
+//
+// Inputs       : zipf - the distribution
+// Outputs      : the item, 0 the most likely
+
+static uint32_t wlgen_zipf(FS3WlgenZipf *zipf) {
+    double u = wlgen_uniform(), uz = u * zipf->zetan;
+    uint32_t item;
+
+    if ((uz < 1.0) || (zipf->n == 1)) {
+        return(0);
+    }
+    if (uz < zipf->half) {
+        return(1);
+    }
+    item = (uint32_t)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    return((item < zipf->n) ? item : zipf->n - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_hot
+// Description  : Draw from n items, most often from a hot window that moves
+//                along by its own width every wlgenShiftEvery operations
+//
+// Inputs       : n - number of items
+//                op - the operation being made
+// Outputs      : the item
+
+static uint32_t wlgen_hot(uint32_t n, uint64_t op) {
+    uint32_t width = (uint32_t)(n * wlgenHotFraction), start;
+
+    if ((width == 0) || (width >= n)) {
+        return(wlgen_below(n));
+    }
+    start = (uint32_t)(((op / wlgenShiftEvery) * width) % n);
+    if (wlgen_uniform() < wlgenHotProbability) {
+        return((start + wlgen_below(width)) % n);
+    }
+    return((start + width + wlgen_below(n - width)) % n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_size
+// Description  : Draw a read or write size
+//
+// Inputs       : none
+// Outputs      : the size, at least 1
+
+static uint32_t wlgen_size(void) {
+    uint32_t size;
+
+    switch (wlgenSizes) {
+    case WLGEN_FIXED:
+        size = wlgenSizeA;
+        break;
+    case WLGEN_SIZEUNIFORM:
+        size = wlgenSizeA + wlgen_below(wlgenSizeB - wlgenSizeA + 1);
+        break;
+    default:
+        size = (uint32_t)(-log(1.0 - wlgen_uniform()) * wlgenSizeA) + 1;
+        break;
+    }
+    return((size < 1) ? 1 : size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_text
+// Description  : Fill text to write, letters, digits and spaces with the
+//                odd newline
+//
+// Inputs       : buf - where to put the text
+//                len - how much
+// Outputs      : none
+
+static void wlgen_text(char *buf, uint32_t len) {
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789     ";
+    uint64_t bits = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if ((i & 7) == 0) {
+            bits = wlgen_random();
+        }
+        buf[i] = ((bits & 0x3f) == 0) ? '\n' : chars[(bits >> 6) % (sizeof(chars) - 1)];
+        bits >>= 8;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_seek
+// Description  : Move a file's handle, writing a SEEK if it is elsewhere
+//
+// Inputs       : file - the file
+//                offset - where to, at most its length
+// Outputs      : none
+
+static void wlgen_seek(FS3WlgenFile *file, uint32_t offset) {
+    if (file->position != offset) {
+        fprintf(wlgenOut, "%s SEEK 0 %u :\n", file->path, offset);
+        file->position = offset;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_write
+// Description  : Write text at an offset of a file, updating its reference
+//                copy and writing the WRITE or WRITEAT
+//
+// Inputs       : file - the file
+//                offset - where, at most its length
+//                len - bytes to write
+//                at - write a WRITEAT rather than SEEK and WRITE
+// Outputs      : 0 if successful, -1 if failure
+
+static int wlgen_write(FS3WlgenFile *file, uint32_t offset, uint32_t len, int at) {
+    char *grown;
+
+    len = (len > FS3_WLGEN_MAX_WRITE) ? FS3_WLGEN_MAX_WRITE : len;
+    if (offset + len > file->size) {
+        file->size = (offset + len) * 2;
+        if ((grown = realloc(file->data, file->size)) == NULL) {
+            fprintf(stderr, "Out of memory for reference file [%s].\n", file->path);
+            return(-1);
+        }
+        file->data = grown;
+    }
+    wlgen_text(&file->data[offset], len);
+    if (at) {
+        fprintf(wlgenOut, "%s WRITEAT %u %u :", file->path, len, offset);
+    } else {
+        wlgen_seek(file, offset);
+        fprintf(wlgenOut, "%s WRITE %u 0 :", file->path, len);
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        fputc((file->data[offset + i] == '\n') ? '^' : file->data[offset + i], wlgenOut);
+    }
+    fputc('\n', wlgenOut);
+    file->length = (offset + len > file->length) ? offset + len : file->length;
+    file->position = offset + len;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_choose
+// Description  : Pick the file and offset for an operation by the access
+//                pattern
+//
+// Inputs       : op - the operation being made
+//                offset - where to store the offset, at most the length
+// Outputs      : the file
+
+static FS3WlgenFile *wlgen_choose(uint64_t op, uint32_t *offset) {
+    FS3WlgenFile *file;
+    uint32_t block;
+
+    switch (wlgenPattern) {
+    case WLGEN_SEQUENTIAL:
+        file = &wlgenFiles[wlgenCursor];
+        if (file->position >= file->length) {
+            wlgenCursor = (wlgenCursor + 1) % wlgenFileCount;
+            file = &wlgenFiles[wlgenCursor];
+            *offset = 0;
+        } else {
+            *offset = file->position;
+        }
+        return(file);
+    case WLGEN_ZIPF:
+        file = &wlgenFiles[wlgen_zipf(&wlgenFileZipf)];
+        block = wlgen_zipf(&file->zipf);
+        break;
+    case WLGEN_HOTSET:
+        file = &wlgenFiles[wlgen_hot(wlgenFileCount, op)];
+        block = wlgen_hot(file->blocks, op);
+        break;
+    default:
+        file = &wlgenFiles[wlgen_below(wlgenFileCount)];
+        block = wlgen_below(file->blocks);
+        break;
+    }
+    *offset = block * FS3_WLGEN_BLOCK + wlgen_below(FS3_WLGEN_BLOCK);
+    *offset = (*offset > file->length) ? file->length : *offset;
+    return(file);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_reference
+// Description  : Write the reference copy of every file
+//
+// Inputs       : dir - the reference directory
+// Outputs      : 0 if successful, -1 if failure
+
+static int wlgen_reference(const char *dir) {
+    char path[PATH_MAX];
+    FILE *fh;
+
+    for (int i = 0; i < wlgenFileCount; i++) {
+
+        // Make the directories in the file's path
+        snprintf(path, sizeof(path), "%s/%s", dir, wlgenFiles[i].path);
+        for (char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+            *slash = 0x0;
+            if ((mkdir(path, 0755) == -1) && (errno != EEXIST)) {
+                fprintf(stderr, "Cannot create directory [%s]: %s\n", path, strerror(errno));
+                return(-1);
+            }
+            *slash = '/';
+        }
+        if (((fh = fopen(path, "w")) == NULL) ||
+                (fwrite(wlgenFiles[i].data, 1, wlgenFiles[i].length, fh) != wlgenFiles[i].length) ||
+                (fclose(fh) != 0)) {
+            fprintf(stderr, "Cannot write reference file [%s]: %s\n", path, strerror(errno));
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the FS3 workload generator
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char *argv[]) {
+
+    // Local variables
+    char *output = "generated-workload.txt", *dir = FS3_WLGEN_REFERENCE_DIR, *prefix = "gen", kind[16];
+    uint32_t minSize = 1024, maxSize = 1048576, len, offset;
+    int mix[WLGEN_OPS] = { 40, 20, 30, 10 }, ch, filling, i, pick;
+    uint64_t ops = 100000, total = 0, seed = 1;
+    FS3WlgenFile *file;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, FS3_WLGEN_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return(-1);
+
+        case 'o': // Workload file
+            output = optarg;
+            break;
+
+        case 'd': // Reference directory
+            dir = optarg;
+            break;
+
+        case 'P': // File name prefix
+            prefix = optarg;
+            break;
+
+        case 'f': // Number of files
+            if ((sscanf(optarg, "%d", &wlgenFileCount) != 1) || (wlgenFileCount < 1) ||
+                    (wlgenFileCount > FS3_MAX_TOTAL_FILES)) {
+                fprintf(stderr, "Bad file count [%s], 1 to %d, aborting.\n", optarg, FS3_MAX_TOTAL_FILES);
+                return(-1);
+            }
+            break;
+
+        case 'z': // Range of file sizes
+            if ((sscanf(optarg, "%u-%u", &minSize, &maxSize) != 2) || (minSize < 1) || (maxSize < minSize)) {
+                fprintf(stderr, "Bad file size range [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        case 'n': // Operations
+            if (sscanf(optarg, "%lu", (unsigned long *)&ops) != 1) {
+                fprintf(stderr, "Bad operation count [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        case 'm': // Operation mix
+            if ((sscanf(optarg, "%d,%d,%d,%d", &mix[0], &mix[1], &mix[2], &mix[3]) != 4) ||
+                    (mix[0] < 0) || (mix[1] < 0) || (mix[2] < 0) || (mix[3] < 0) ||
+                    (mix[0] + mix[1] + mix[2] + mix[3] != 100)) {
+                fprintf(stderr, "Bad operation mix [%s], four percentages adding to 100, aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        case 'a': // Access pattern
+            for (pick = 0; (pick <= WLGEN_HOTSET) && (strcmp(optarg, wlgenPatternNames[pick]) != 0); pick++);
+            if (pick > WLGEN_HOTSET) {
+                fprintf(stderr, "Unknown access pattern [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            wlgenPattern = pick;
+            break;
+
+        case 's': // Size distribution
+            if ((sscanf(optarg, "%15[a-z]:%u-%u", kind, &wlgenSizeA, &wlgenSizeB) == 3) && (strcmp(kind, "uniform") == 0) &&
+                    (wlgenSizeA >= 1) && (wlgenSizeB >= wlgenSizeA)) {
+                wlgenSizes = WLGEN_SIZEUNIFORM;
+            } else if ((sscanf(optarg, "%15[a-z]:%u", kind, &wlgenSizeA) == 2) && (wlgenSizeA >= 1) &&
+                    ((strcmp(kind, "fixed") == 0) || (strcmp(kind, "exp") == 0))) {
+                wlgenSizes = (kind[0] == 'f') ? WLGEN_FIXED : WLGEN_EXPONENTIAL;
+            } else {
+                fprintf(stderr, "Bad size distribution [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        case 't': // Zipfian theta
+            if ((sscanf(optarg, "%lf", &wlgenTheta) != 1) || (wlgenTheta <= 0.0) || (wlgenTheta >= 1.0)) {
+                fprintf(stderr, "Bad Zipfian theta [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        case 'H': // Hot set
+            if ((sscanf(optarg, "%lf,%lf", &wlgenHotFraction, &wlgenHotProbability) != 2) ||
+                    (wlgenHotFraction <= 0.0) || (wlgenHotFraction > 1.0) ||
+                    (wlgenHotProbability < 0.0) || (wlgenHotProbability > 1.0)) {
+                fprintf(stderr, "Bad hot set [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        case 'k': // Hot set shift period
+            if ((sscanf(optarg, "%lu", (unsigned long *)&wlgenShiftEvery) != 1) || (wlgenShiftEvery < 1)) {
+                fprintf(stderr, "Bad hot set shift period [%s], aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        case 'r': // Seed
+            if ((sscanf(optarg, "%lu", (unsigned long *)&seed) != 1) || (seed == 0)) {
+                fprintf(stderr, "Bad seed [%s], must be non-zero, aborting.\n", optarg);
+                return(-1);
+            }
+            break;
+
+        default:  // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return(-1);
+        }
+    }
+    wlgenState = seed;
+
+    // Draw the file sizes, they have to fit on the disk
+    if ((wlgenFiles = calloc(wlgenFileCount, sizeof(FS3WlgenFile))) == NULL) {
+        return(-1);
+    }
+    for (i = 0; i < wlgenFileCount; i++) {
+        file = &wlgenFiles[i];
+        file->target = (uint32_t)(minSize * exp(wlgen_uniform() * log((double)maxSize / minSize)));
+        file->target = (file->target < minSize) ? minSize : (file->target > maxSize) ? maxSize : file->target;
+        file->blocks = (file->target + FS3_WLGEN_BLOCK - 1) / FS3_WLGEN_BLOCK;
+        if ((file->path = malloc(FS3_MAX_PATH_LENGTH)) == NULL) {
+            return(-1);
+        }
+        if (snprintf(file->path, FS3_MAX_PATH_LENGTH, "%s/file%04d.dat", prefix, i) >= FS3_MAX_PATH_LENGTH) {
+            fprintf(stderr, "Path prefix [%s] too long, aborting.\n", prefix);
+            return(-1);
+        }
+        if (wlgenPattern == WLGEN_ZIPF) {
+            wlgen_zipf_init(&file->zipf, file->blocks);
+        }
+        total += file->target;
+    }
+    if (total > FS3_WLGEN_DISK_BYTES) {
+        fprintf(stderr, "Files total %lu bytes, more than the disk holds (%lu), aborting.\n",
+            (unsigned long)total, (unsigned long)FS3_WLGEN_DISK_BYTES);
+        return(-1);
+    }
+    wlgen_zipf_init(&wlgenFileZipf, wlgenFileCount);
+
+    // Fill the files a write each in turn
+    if ((wlgenOut = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "Cannot open workload [%s]: %s, aborting.\n", output, strerror(errno));
+        return(-1);
+    }
+    do {
+        filling = 0;
+        for (i = 0; i < wlgenFileCount; i++) {
+            file = &wlgenFiles[i];
+            if (file->length < file->target) {
+                len = wlgen_size();
+                len = (len > file->target - file->length) ? file->target - file->length : len;
+                if (wlgen_write(file, file->length, len, 0) == -1) {
+                    return(-1);
+                }
+                filling = 1;
+            }
+        }
+    } while (filling);
+
+    // Then the mix of operations
+    for (uint64_t op = 0; op < ops; op++) {
+        len = wlgen_size();
+        file = wlgen_choose(op, &offset);
+        for (pick = (int)wlgen_below(100), i = 0; pick >= mix[i]; pick -= mix[i], i++);
+        switch (i) {
+        case WLGEN_READ:
+            if (offset == file->length) {
+                offset = (file->length > len) ? file->length - len : 0;
+            }
+            len = (len > file->length - offset) ? file->length - offset : len;
+            wlgen_seek(file, offset);
+            fprintf(wlgenOut, "%s READ %u 0 :\n", file->path, len);
+            file->position += len;
+            break;
+        case WLGEN_WRITE:
+        case WLGEN_WRITEAT:
+            if (wlgen_write(file, offset, len, i == WLGEN_WRITEAT) == -1) {
+                return(-1);
+            }
+            break;
+        default:
+            fprintf(wlgenOut, "%s SEEK 0 %u :\n", file->path, offset);
+            file->position = offset;
+            break;
+        }
+    }
+    if (fclose(wlgenOut) != 0) {
+        fprintf(stderr, "Cannot write workload [%s]: %s, aborting.\n", output, strerror(errno));
+        return(-1);
+    }
+
+    // Write the copies the simulator validates against
+    if (wlgen_reference(dir) == -1) {
+        return(-1);
+    }
+    fprintf(stderr, "Wrote %s: %d files (%lu bytes), %lu operations, %s access, references in %s/%s\n",
+        output, wlgenFileCount, (unsigned long)total, (unsigned long)ops, wlgenPatternNames[wlgenPattern], dir, prefix);
+    return(0);
+}
@@ -0,0 +1,309 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_workload.c
+//  Description    : This is the implementation of FS3 workload decoding
+//                   and the compiled binary op log.  Compiling does the
+//                   parsing, the path lookups and the '^' decoding once, so
+//                   a replay only has to walk the ops in the mapping.
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_workload.h>
+
+//
+// Support Macros/Data
+
+#define WORKLOAD_NAME_BUCKETS (FS3_MAX_TOTAL_FILES * 2)     // open addressing, half full at most
+#define WORKLOAD_NO_NAME 0xffff
+
+// Command names in the text format; WRITEAT before WRITE, they share a prefix
+static const struct {
+    const char *name;
+    FS3WorkloadCommand command;
+} workloadCommands[] = {
+    { "WRITEAT", FS3_WORKLOAD_WRITEAT },
+    { "WRITE", FS3_WORKLOAD_WRITE },
+    { "SEEK", FS3_WORKLOAD_SEEK },
+    { "READ", FS3_WORKLOAD_READ }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_workload_parse
+// Description  : Decode one line of a text workload
+//
+// Inputs       : line - the line, its text is decoded in place
+//                fname - where to store the path (FS3_MAX_PATH_LENGTH bytes)
+//                command - where to store the command
+//                len - where to store the length
+//                off - where to store the offset
+//                text - where to store a pointer to the text to write
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_workload_parse(char *line, char *fname, FS3WorkloadCommand *command,
+        int32_t *len, int32_t *off, char **text) {
+    char name[16], *sep, *end;
+    int i;
+
+    sep = strchr(line, ':');
+    if ((sep == NULL) || (sscanf(line, "%127s %15s %d %d", fname, name, len, off) != 4) || (*len < 0)) {
+        return(-1);
+    }
+    for (i = 0; (i < 4) && (strncmp(name, workloadCommands[i].name, strlen(workloadCommands[i].name)) != 0); i++);
+    if (i == 4) {
+        return(-1);
+    }
+    *command = workloadCommands[i].command;
+    *text = sep + 1;
+    if ((*command == FS3_WORKLOAD_WRITE) || (*command == FS3_WORKLOAD_WRITEAT)) {
+
+        // The text runs to the end of the line and must hold len bytes
+        if ((end = memchr(*text, '\0', *len + 1)) != NULL) {
+            if ((end > *text) && (end[-1] == '\n')) {
+                end--;
+            }
+            if (end - *text < *len) {
+                return(-1);
+            }
+        }
+        for (sep = *text; (sep = memchr(sep, '^', *text + *len - sep)) != NULL; *sep++ = '\n');
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_workload_name
+// Description  : Find a path in the compiler's names, adding it if new
+//
+// Inputs       : buckets - the name hash table
+//                names - the names, FS3_MAX_PATH_LENGTH each
+//                count - the number of names, updated
+//                fname - the path
+// Outputs      : the index of the name, -1 if there are too many
+
+static int fs3_workload_name(uint16_t *buckets, char (*names)[FS3_MAX_PATH_LENGTH], uint32_t *count, const char *fname) {
+    uint32_t hash = 2166136261u;
+    const char *c;
+
+    for (c = fname; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    for (hash %= WORKLOAD_NAME_BUCKETS; buckets[hash] != WORKLOAD_NO_NAME; hash = (hash + 1) % WORKLOAD_NAME_BUCKETS) {
+        if (strcmp(names[buckets[hash]], fname) == 0) {
+            return(buckets[hash]);
+        }
+    }
+    if (*count == FS3_MAX_TOTAL_FILES) {
+        return(-1);
+    }
+    strcpy(names[*count], fname);                   // parse keeps it under FS3_MAX_PATH_LENGTH
+    buckets[hash] = *count;
+    return((*count)++);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_workload_compile
+// Description  : Compile a text workload into a binary op log
+//
+// Inputs       : wload - the text workload
+//                log - the log to write
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_workload_compile(const char *wload, const char *log) {
+    char line[FS3_WORKLOAD_MAX_LINE], fname[FS3_MAX_PATH_LENGTH], *text, *payload = NULL, *grown;
+    char (*names)[FS3_MAX_PATH_LENGTH];
+    uint16_t *buckets;
+    FS3WorkloadOp *ops = NULL, *op;
+    FS3WorkloadHeader header;
+    FS3WorkloadCommand command;
+    size_t opRoom = 0, payloadRoom = 0;
+    int32_t len, off;
+    int linecount = 0, file, result = 0;
+    FILE *in, *out;
+
+    memset(&header, 0x0, sizeof(header));
+    header.magic = FS3_WORKLOAD_MAGIC;
+    header.version = FS3_WORKLOAD_VERSION;
+    header.opSize = sizeof(FS3WorkloadOp);
+    if ((in = fopen(wload, "r")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.", wload, strerror(errno));
+        return(-1);
+    }
+    names = calloc(FS3_MAX_TOTAL_FILES, FS3_MAX_PATH_LENGTH);
+    buckets = malloc(WORKLOAD_NAME_BUCKETS * sizeof(uint16_t));
+    if ((names == NULL) || (buckets == NULL)) {
+        result = -1;
+    } else {
+        memset(buckets, 0xff, WORKLOAD_NAME_BUCKETS * sizeof(uint16_t));
+    }
+
+    while ((result == 0) && (fgets(line, sizeof(line), in) != NULL)) {
+        linecount++;
+        if (fs3_workload_parse(line, fname, &command, &len, &off, &text) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "FS3 un-parsable workload string, aborting [%s], line %d", line, linecount);
+            result = -1;
+            break;
+        }
+        if ((file = fs3_workload_name(buckets, names, &header.files, fname)) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Workload names more than %d files, line %d", FS3_MAX_TOTAL_FILES, linecount);
+            result = -1;
+            break;
+        }
+
+        // Grow the op and payload buffers as needed
+        if (header.ops == opRoom) {
+            opRoom = (opRoom == 0) ? 4096 : opRoom * 2;
+            if ((op = realloc(ops, opRoom * sizeof(FS3WorkloadOp))) == NULL) {
+                result = -1;
+                break;
+            }
+            ops = op;
+        }
+        op = &ops[header.ops++];
+        memset(op, 0x0, sizeof(FS3WorkloadOp));
+        op->command = command;
+        op->file = file;
+        op->length = len;
+        op->offset = off;
+        if ((command == FS3_WORKLOAD_WRITE) || (command == FS3_WORKLOAD_WRITEAT)) {
+            op->payload = header.payloadBytes;
+            if (header.payloadBytes + len > payloadRoom) {
+                payloadRoom = (header.payloadBytes + len) * 2;
+                if ((grown = realloc(payload, payloadRoom)) == NULL) {
+                    result = -1;
+                    break;
+                }
+                payload = grown;
+            }
+            memcpy(&payload[header.payloadBytes], text, len);
+            header.payloadBytes += len;
+        } else if ((command == FS3_WORKLOAD_READ) && ((uint32_t)len > header.maxRead)) {
+            header.maxRead = len;
+        }
+    }
+    fclose(in);
+
+    // Header, names, ops, payload
+    if ((result == 0) && ((out = fopen(log, "w")) == NULL)) {
+        result = -1;
+    } else if (result == 0) {
+        if ((fwrite(&header, sizeof(header), 1, out) != 1) ||
+                (fwrite(names, FS3_MAX_PATH_LENGTH, header.files, out) != header.files) ||
+                (fwrite(ops, sizeof(FS3WorkloadOp), header.ops, out) != header.ops) ||
+                (fwrite(payload, 1, header.payloadBytes, out) != header.payloadBytes)) {
+            result = -1;
+        }
+        if (fclose(out) != 0) {
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        logMessage(LOG_OUTPUT_LEVEL, "Compiled [%s] to [%s]: %lu ops on %u files, %lu bytes of text",
+            wload, log, (unsigned long)header.ops, header.files, (unsigned long)header.payloadBytes);
+    } else {
+        logMessage(LOG_ERROR_LEVEL, "Failed compiling workload [%s] to [%s]", wload, log);
+    }
+    free(names);
+    free(buckets);
+    free(ops);
+    free(payload);
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_workload_map
+// Description  : Map a compiled log and check every op is inside it, so a
+//                replay need not
+//
+// Inputs       : path - the file
+//                workload - where to store the mapping
+// Outputs      : 1 if mapped, 0 if not a compiled log, -1 if failure
+
+int fs3_workload_map(const char *path, FS3Workload *workload) {
+    FS3WorkloadHeader header;
+    struct stat st;
+    uint64_t i;
+    const FS3WorkloadOp *op;
+    int fd;
+
+    memset(workload, 0x0, sizeof(FS3Workload));
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.", path, strerror(errno));
+        return(-1);
+    }
+    if ((fstat(fd, &st) == -1) || ((size_t)st.st_size < sizeof(header)) ||
+            (read(fd, &header, sizeof(header)) != sizeof(header)) || (header.magic != FS3_WORKLOAD_MAGIC)) {
+        close(fd);
+        return(0);
+    }
+    if ((header.version != FS3_WORKLOAD_VERSION) || (header.opSize != sizeof(FS3WorkloadOp)) ||
+            (header.files > FS3_MAX_TOTAL_FILES) ||
+            ((uint64_t)st.st_size != sizeof(header) + (uint64_t)header.files * FS3_MAX_PATH_LENGTH +
+                header.ops * sizeof(FS3WorkloadOp) + header.payloadBytes)) {
+        logMessage(LOG_ERROR_LEVEL, "Workload log [%s] is damaged or from another version", path);
+        close(fd);
+        return(-1);
+    }
+    workload->size = st.st_size;
+    workload->mapping = mmap(NULL, workload->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (workload->mapping == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Cannot map workload log [%s]: %s", path, strerror(errno));
+        workload->mapping = NULL;
+        return(-1);
+    }
+    madvise(workload->mapping, workload->size, MADV_SEQUENTIAL);
+    workload->header = workload->mapping;
+    workload->names = (const char (*)[FS3_MAX_PATH_LENGTH])(workload->header + 1);
+    workload->ops = (const FS3WorkloadOp *)(workload->names + header.files);
+    workload->payload = (const char *)(workload->ops + header.ops);
+
+    for (i = 0, op = workload->ops; i < header.ops; i++, op++) {
+        if ((op->command > FS3_WORKLOAD_SEEK) || (op->file >= header.files) ||
+                (((op->command == FS3_WORKLOAD_WRITE) || (op->command == FS3_WORKLOAD_WRITEAT)) &&
+                 (op->payload + op->length > header.payloadBytes))) {
+            logMessage(LOG_ERROR_LEVEL, "Workload log [%s] has a bad op %lu", path, (unsigned long)i);
+            fs3_workload_unmap(workload);
+            return(-1);
+        }
+    }
+    for (i = 0; i < header.files; i++) {
+        if (memchr(workload->names[i], '\0', FS3_MAX_PATH_LENGTH) == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "Workload log [%s] has a bad path %lu", path, (unsigned long)i);
+            fs3_workload_unmap(workload);
+            return(-1);
+        }
+    }
+    return(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_workload_unmap
+// Description  : Unmap a compiled log
+//
+// Inputs       : workload - the mapping
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_workload_unmap(FS3Workload *workload) {
+    if (workload->mapping == NULL) {
+        return(-1);
+    }
+    munmap(workload->mapping, workload->size);
+    memset(workload, 0x0, sizeof(FS3Workload));
+    return(0);
+}
@@ -0,0 +1,96 @@
+#ifndef FS3_WORKLOAD_INCLUDED
+#define FS3_WORKLOAD_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_workload.h
+//  Description    : This is the interface for FS3 workloads: decoding the
+//                   text format fs3_sim reads, and the compiled binary op
+//                   log that can be replayed straight from a mapping.
+//
+//                   Layout of a compiled log (host byte order):
+//                     FS3WorkloadHeader
+//                     names    header.files paths, FS3_MAX_PATH_LENGTH each
+//                     ops      header.ops FS3WorkloadOp, in workload order
+//                     payload  header.payloadBytes of text to write, with
+//                              '^' already turned into newlines
+//
+
+// Include
+#include <stdint.h>
+#include <stddef.h>
+#include <fs3_driver.h>
+
+// Defines
+#define FS3_WORKLOAD_MAGIC 0x57335346       // "FS3W"
+#define FS3_WORKLOAD_VERSION 1
+#define FS3_WORKLOAD_MAX_LINE 2048          // A path, a command and up to 1023 bytes of text
+
+// Commands of a workload
+typedef enum {
+
+    FS3_WORKLOAD_READ    = 0,   // Read length bytes
+    FS3_WORKLOAD_WRITE   = 1,   // Write length bytes of text
+    FS3_WORKLOAD_WRITEAT = 2,   // Seek to offset, then write length bytes of text
+    FS3_WORKLOAD_SEEK    = 3    // Seek to offset
+
+} FS3WorkloadCommand;
+
+// One command of a compiled log
+typedef struct {
+
+    uint8_t command;            // FS3WorkloadCommand
+    uint8_t reserved;
+    uint16_t file;              // Index in the names
+    uint32_t length;
+    uint32_t offset;
+    uint32_t reserved2;
+    uint64_t payload;           // Where the text is in the payload
+
+} FS3WorkloadOp;
+
+// Start of a compiled log
+typedef struct {
+
+    uint32_t magic;             // FS3_WORKLOAD_MAGIC
+    uint16_t version;           // FS3_WORKLOAD_VERSION
+    uint16_t opSize;            // sizeof(FS3WorkloadOp), catches layout changes
+    uint32_t files;             // Paths in the names
+    uint32_t maxRead;           // Longest READ, to size a buffer
+    uint64_t ops;               // Commands
+    uint64_t payloadBytes;      // Text to write
+
+} FS3WorkloadHeader;
+
+// A compiled log mapped into memory
+typedef struct {
+
+    const FS3WorkloadHeader *header;
+    const char (*names)[FS3_MAX_PATH_LENGTH];
+    const FS3WorkloadOp *ops;
+    const char *payload;
+    void *mapping;
+    size_t size;
+
+} FS3Workload;
+
+//
+// Workload Functions
+
+int fs3_workload_parse(char *line, char *fname, FS3WorkloadCommand *command,
+        int32_t *len, int32_t *off, char **text);
+    // Decode a text workload line: fname (FS3_MAX_PATH_LENGTH bytes) gets
+    // the path and text points at the len bytes to write, decoded in place
+    // in the line; -1 if the line is malformed
+
+int fs3_workload_compile(const char *wload, const char *log);
+    // Compile a text workload into a binary op log
+
+int fs3_workload_map(const char *path, FS3Workload *workload);
+    // Map a compiled log and check it; 1 if mapped, 0 if the file is not
+    // a compiled log (so is text), -1 on error
+
+int fs3_workload_unmap(FS3Workload *workload);
+    // Unmap a compiled log
+
+#endif